@@ -43,7 +43,9 @@
     __EMIT_ERROR_CODE(EOVERFLOW, Value too large to be stored in data type) \
     __EMIT_ERROR_CODE(EPERM, Operation not permitted)                       \
     __EMIT_ERROR_CODE(ERANGE, Result too large)                             \
-    __EMIT_ERROR_CODE(ESPIPE, Invalid seek)
+    __EMIT_ERROR_CODE(ESPIPE, Invalid seek)                                 \
+    __EMIT_ERROR_CODE(ETIMEDOUT, Timed out)                                 \
+    __EMIT_ERROR_CODE(EINTR, Interrupted)
 
 enum ErrorCode {
 #define __EMIT_ERROR_CODE(CODE, DESCRIPTION) CODE,
@@ -61,6 +61,15 @@ enum class SysCall : u64 {
     // Miscellaneous
     Sleep,
     GetTicks,
+    GetKernelHeapStats,
+    // Calls added since are appended here, as the numbers of existing ones must not change.
+    Discard,
+    GetIdleTicks,
+    CreateThread,
+    ExitThread,
+    JoinThread,
+    FutexWait,
+    FutexWake,
 };
 
 enum class OpenFlags {
@@ -110,6 +119,32 @@ struct CreatePipeHandleFlags {
 
 enum class AllocateFlags { None = 0 };
 
+enum class SleepFlags {
+    None = 0,
+    /// The argument is a deadline in nanoseconds since boot (as returned by GetTicks), rather than a duration.
+    Absolute = 1,
+};
+
+/// Counters for one size class of the kernel heap.
+struct HeapSizeClassStats {
+    /// Largest allocation served by this class, or 0 if unbounded.
+    u64 max_size;
+    u64 allocations;
+    u64 frees;
+    u64 live_bytes;
+    u64 peak_live_bytes;
+    u64 failures;
+};
+
+/// Slab classes, then the bitmap arenas, then whole-page allocations.
+inline constexpr uSize HEAP_SIZE_CLASS_COUNT = 8;
+
+struct KernelHeapStats {
+    u64 total_bytes;
+    u64 free_bytes;
+    HeapSizeClassStats size_classes[HEAP_SIZE_CLASS_COUNT];
+};
+
 struct DeviceListItem {
     /// Offset from this structure to next Item. If 0, this means EOF. If = to end or beyond buffer, means get next
     /// buffer.
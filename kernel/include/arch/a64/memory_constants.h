@@ -30,7 +30,16 @@
 // Offset for the identity mapping of memory etc.
 #define VA_IDENT_OFFSET VA_START
 
+// Offset for the uncached alias of normal memory, used for coherent DMA buffers. This limits the
+// identity mapping to the lower 64TB of physical memory (and the alias to the lower 32TB).
+#define VA_DMA_OFFSET 0xFFFF400000000000
+
+// Window for large kernel allocations, built from individually allocated pages.
+#define VA_VMALLOC_OFFSET 0xFFFF600000000000
+#define VA_VMALLOC_SIZE (1ul << 40)
+
 #define SIZE_2M (2ul << 20)
+#define SIZE_64K (64ul << 10)
 
 #define PAGE_SHIFT 12
 #define PAGE_SIZE 4096
@@ -58,6 +58,8 @@ struct SavedRegisters {
     static SavedRegisters create_for_user_execute(uPtr user_entry, void* kernel_stack_top, uPtr user_stack);
     static SavedRegisters create_for_return_from_fork(const InterruptContext& ctx, void* kernel_stack_top,
                                                       uPtr current_user_stack);
+    static SavedRegisters create_for_user_thread(uPtr user_entry, u64 argument, void* kernel_stack_top,
+                                                 uPtr user_stack);
 };
 
 #endif  // BEKOS_A64_SAVED_REGISTERS_H
@@ -23,13 +23,17 @@
 
 #define MAIR_DEVICE_nGnRnE_INDEX 0x0
 #define MAIR_NORMAL_NC_INDEX 0x1
+#define MAIR_NORMAL_WB_INDEX 0x2
 
 #define MAIR_DEVICE_nGnRnE_FLAGS \
     0x00ul  // Device non-Gathering, non-Reorderable, no-Early-Write-Acknowledgement
 #define MAIR_NORMAL_NC_FLAGS 0x44ul  // Outer non-Cacheable, Inner non-Cacheable
+#define MAIR_NORMAL_WB_FLAGS \
+    0xFFul  // Outer Write-Back Read/Write-Allocate, Inner Write-Back Read/Write-Allocate
 #define MAIR_VALUE                                                  \
     ((MAIR_DEVICE_nGnRnE_FLAGS << (8 * MAIR_DEVICE_nGnRnE_INDEX)) | \
-     (MAIR_NORMAL_NC_FLAGS << (8 * MAIR_NORMAL_NC_INDEX)))
+     (MAIR_NORMAL_NC_FLAGS << (8 * MAIR_NORMAL_NC_INDEX)) |         \
+     (MAIR_NORMAL_WB_FLAGS << (8 * MAIR_NORMAL_WB_INDEX)))
 
 // --- TCR ---
 
@@ -40,7 +44,7 @@
 #define TCR_TTBR0_DISABLE (1ul << 7)
 
 // I/O GRN0 - lower-half walk cacheability - outer & inner write-back cacheable
-#define TCR_I_O_GRN0 (0x11ul << 8)
+#define TCR_I_O_GRN0 (0b0101ul << 8)
 
 // SH0 - lower-half walk shareability
 #define TCR_SHO_INNER (0b11ul << 12)
@@ -58,7 +62,7 @@
 #define TCR_TTBR1_DISABLE (1ul << 23)
 
 // I/O GRN1 - upper-half walk cacheability - outer & inner write-back cacheable
-#define TCR_I_O_GRN1 (0x11ul << 24)
+#define TCR_I_O_GRN1 (0b0101ul << 24)
 
 // SH1 - upper-half walk shareability
 #define TCR_SH1_INNER (0b11ul << 28)
@@ -103,7 +107,8 @@
 #define SCTLR_MMU_ENABLED (1ul << 0)
 
 #define SCTLR_VALUE_MMU_DISABLED (SCTLR_RESERVED)
-#define SCTLR_VALUE_MMU_ENABLED (SCTLR_RESERVED | SCTLR_MMU_ENABLED)
+#define SCTLR_VALUE_MMU_ENABLED \
+    (SCTLR_RESERVED | SCTLR_I_CACHE_ENABLED | SCTLR_D_CACHE_ENABLED | SCTLR_MMU_ENABLED)
 
 // HCR_EL2, Hypervisor Configuration Register (EL2)
 // Aarch64 used in EL1
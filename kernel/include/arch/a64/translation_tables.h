@@ -27,8 +27,12 @@
 #include "mm/addresses.h"
 
 enum MemAttributeIndex {
-    NormalRAM = MAIR_NORMAL_NC_INDEX,
-    MMIO      = MAIR_DEVICE_nGnRnE_INDEX,
+    /// Ordinary memory: inner/outer write-back cacheable.
+    NormalRAM = MAIR_NORMAL_WB_INDEX,
+    /// Normal memory which bypasses the caches - used for DMA buffers and framebuffers, where
+    /// writes may be gathered but must reach memory without explicit maintenance.
+    NormalUncached = MAIR_NORMAL_NC_INDEX,
+    MMIO           = MAIR_DEVICE_nGnRnE_INDEX,
 };
 
 enum TableLevel { L0 = 0, L1 = 1, L2 = 2, L3 = 3 };
@@ -41,11 +45,12 @@ enum PageAttributes : u64 {
     DirtyBitModifier         = BIT(51),
     GP                       = BIT(50),
     /// Not 4KB
-    nT        = BIT(16),
-    nG        = BIT(11),
-    AF        = BIT(10),
-    ReadOnly  = BIT(7),
-    EL0Access = BIT(6)
+    nT             = BIT(16),
+    nG             = BIT(11),
+    AF             = BIT(10),
+    InnerShareable = BIT(9) | BIT(8),
+    ReadOnly       = BIT(7),
+    EL0Access      = BIT(6)
 };
 
 constexpr inline PageAttributes AttributesRWnE =
@@ -56,7 +61,8 @@ constexpr inline PageAttributes AttributedRnWnE =
 
 constexpr inline PageAttributes attributes_for_user(bool readable, bool writeable, bool executable) {
     // We never execute user code!
-    bek::underlying_type<PageAttributes> attrs = AF | PrivilegedExecuteNever;
+    // User mappings are tagged with the ASID of their address space.
+    bek::underlying_type<PageAttributes> attrs = AF | PrivilegedExecuteNever | nG;
     if (readable || writeable) attrs |= EL0Access;
     if (!writeable) attrs |= ReadOnly;
     if (!executable) attrs |= UnprivilegedExecuteNever;
@@ -70,6 +76,9 @@ constexpr inline PageAttributes attributes_for_user(bool readable, bool writeabl
 bool crude_map_region(uPtr virt_addr, uPtr phys_addr, uSize size, u64 flags, uPtr tables_start,
                       uPtr& tables_current, uPtr tables_end);
 
+union ARMv8MMU_UpperEntry;
+struct ARMv8MMU_L3_Entry;
+
 class TableManager {
 public:
     static TableManager create_global_manager(u8* current_embedded_table);
@@ -78,15 +87,32 @@ public:
                     MemAttributeIndex attr_idx);
     bool unmap_region(uPtr virt_start, uSize size);
     u8* get_root_table() const;
+    /// Value for TTBR0 to activate these (user) tables on the calling CPU - the root table and the address space's
+    /// ASID. Allocates a new ASID if it has none from the current generation.
+    u64 translation_base();
+    /// Value for TTBR0 which maps nothing, for CPUs not running a user address space - so none can walk the
+    /// tables of one which may since have been freed.
+    static u64 empty_translation_base();
 
     TableManager(const TableManager&) = delete;
     TableManager& operator=(const TableManager&) = delete;
 
     TableManager(TableManager&& manager) noexcept;
     TableManager& operator=(TableManager&&) noexcept;
+    /// Frees all tables of a user address space. Kernel tables are never freed.
+    ~TableManager();
 
 private:
-    explicit TableManager(u8* current_embedded_table, u8* root_table);
+    explicit TableManager(u8* current_embedded_table, u8* root_table, bool global);
+
+    void allocate_asid();
+    void invalidate_tlb(uPtr virt_start, uSize size);
+    /// Invalidates every entry of this address space, including walk-cache entries.
+    void invalidate_tlb_all();
+    static void invalidate_tlb_range(u64 asid_bits, uPtr virt_start, uSize pages);
+    u8* split_block(ARMv8MMU_UpperEntry& entry, uPtr block_start, TableLevel level);
+    static bool can_map_contiguous(const ARMv8MMU_L3_Entry* entries, uSize idx, uPtr phys_start, uSize size);
+    void break_contiguous_group(ARMv8MMU_L3_Entry* table, uSize idx, uPtr virt_addr);
 
     bool unmap_upper(u8* table, uPtr& virt_start, uSize& size, TableLevel level);
     bool unmap_lower(u8* table, uPtr& virt_start, uSize& size);
@@ -96,9 +122,21 @@ private:
     bool map_lower(u8* table, uPtr& virt_start, uPtr& phys_start, uSize& size, u64 flags);
     u8* allocate_table();
     bool free_table(u8* table);
+    static bool table_is_empty(const u8* table);
+    /// Unhooked tables (and everything below them) are queued, and freed by free_pending_tables once the TLB
+    /// has been invalidated.
+    void release_table_tree(u8* table, TableLevel level);
+    void free_pending_tables();
+    void release_all_tables();
 
     u8* m_embedded_tables_current;
     u8* m_root_table;
+    /// Kernel tables, with global mappings. Otherwise, user tables tagged with m_asid.
+    bool m_global;
+    u16 m_asid{0};
+    /// ASID generation that m_asid was allocated in - 0 if never allocated.
+    u64 m_asid_generation{0};
+    u8* m_pending_free_tables{nullptr};
 };
 
 #endif  // BEKOS_TRANSLATION_TABLES_H
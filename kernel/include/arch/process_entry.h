@@ -28,9 +28,9 @@ struct InterruptContext;
 /// \pre Must switch to next user address space prior to call.
 extern "C" void do_context_switch(SavedRegisters& previous, SavedRegisters& next);
 
-/// Switches user address space.
-/// \param new_address_root Physical address of root page table. Returned from SpaceManager.
-extern "C" void do_switch_user_address_space(uPtr new_address_root);
+/// Switches user address space. The TLB is not flushed: entries of other spaces are tagged with their ASID.
+/// \param translation_base Root page table and ASID, as returned from SpaceManager::translation_base().
+extern "C" void do_switch_user_address_space(u64 translation_base);
 
 extern "C" uPtr do_get_current_user_stack();
 
@@ -0,0 +1,71 @@
+/*
+ * bekOS is a basic OS for the Raspberry Pi
+ * Copyright (C) 2025 Bekos Contributors
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef BEKOS_SMP_H
+#define BEKOS_SMP_H
+
+#include "bek/types.h"
+#include "library/kernel_error.h"
+#include "peripherals/device_tree.h"
+
+namespace smp {
+
+/// The GIC (v2) can't target any more than this.
+inline constexpr u32 MAX_CPUS = 8;
+
+/// Software-generated interrupt used to ask another CPU to reschedule.
+inline constexpr u32 RESCHEDULE_SGI = 0;
+/// Software-generated interrupt used to ask the CPU that owns the system timer to reprogram it.
+inline constexpr u32 TIMER_SGI = 1;
+
+/// Index of the calling CPU - the boot CPU is 0.
+u32 current_cpu_id();
+bool is_online(u32 cpu);
+u32 online_count();
+
+/// Sets up per-CPU data for the boot CPU. Must be called before anything uses current_cpu_id().
+void initialise_boot_cpu();
+
+/// Powers on the other CPUs in the device tree, using PSCI. They each sit in an idle task until there is work
+/// to steal or be given.
+ErrorCode start_secondary_cpus(const dev_tree::device_tree& tree);
+
+/// Asks cpu to call schedule() at its next opportunity.
+void request_reschedule(u32 cpu);
+/// Asks every other online CPU to call schedule().
+void request_reschedule_others();
+/// Clears and returns the calling CPU's pending reschedule request.
+bool take_reschedule_request();
+
+// The kernel is serialised by a single recursive lock, which a CPU holds whenever it runs kernel code, apart
+// from its idle wait. Exception entry takes it, and exception return drops it, so userspace runs in parallel.
+
+/// Swaps the calling CPU's lock depth, when switching between processes that each hold it.
+/// \return the previous depth.
+u32 exchange_kernel_lock_depth(u32 depth);
+/// Releases the lock completely, for waiting on something that another CPU may need the lock to provide.
+/// \return the depth to reacquire with.
+u32 kernel_lock_release_all();
+void kernel_lock_reacquire(u32 depth);
+
+}  // namespace smp
+
+extern "C" void kernel_lock_acquire();
+extern "C" void kernel_lock_release();
+
+#endif  // BEKOS_SMP_H
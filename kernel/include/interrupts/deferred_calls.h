@@ -20,13 +20,36 @@
 #define BEKOS_DEFERRED_CALLS_H
 
 #include "library/function.h"
-#include "library/kernel_error.h"
 
 namespace deferred {
 
+enum class Priority : u8 {
+    /// Runs before any low priority work, and is never held back by the budget.
+    High,
+    Low,
+};
+
+/// Work to run once an interrupt has been handled, with interrupts enabled. Callers embed and own these, so
+/// queueing never allocates or fails. An item must outlive its time on the queue, and may be queued again as soon
+/// as it starts running.
+struct WorkItem {
+    explicit WorkItem(bek::function<void()> fn) : function(bek::move(fn)) {}
+    WorkItem(const WorkItem&)            = delete;
+    WorkItem& operator=(const WorkItem&) = delete;
+
+    bek::function<void()> function;
+    WorkItem* next{nullptr};
+    bool queued{false};
+};
+
 void initialise();
-ErrorCode queue_call(bek::function<void()> callback);
+/// Queues item on the calling CPU. Safe from any context, including interrupt handlers.
+/// \return false if item was already queued, in which case it still runs only once.
+bool queue_work(WorkItem& item, Priority priority = Priority::Low);
+/// Runs all high priority work, then low priority work up to a fixed budget. Leftover work waits for the next
+/// interrupt exit, or for the CPU to go idle.
 void execute_queue();
+bool has_pending_work();
 
 }  // namespace deferred
 
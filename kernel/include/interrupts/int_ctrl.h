@@ -27,9 +27,18 @@ void enable_interrupts(void);
 extern "C"
 void disable_interrupts(void);
 
+extern "C"
+bool interrupts_enabled(void);
+
+/// Disables interrupts for its lifetime. Nests: interrupts are only re-enabled if they were enabled before.
 struct InterruptDisabler {
-    InterruptDisabler() { disable_interrupts(); }
-    ~InterruptDisabler() { enable_interrupts(); }
+    InterruptDisabler() : m_were_enabled(interrupts_enabled()) { disable_interrupts(); }
+    ~InterruptDisabler() {
+        if (m_were_enabled) enable_interrupts();
+    }
+
+private:
+    bool m_were_enabled;
 };
 
 #endif //BEKOS_INT_CTRL_H
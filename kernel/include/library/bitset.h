@@ -21,6 +21,7 @@
 
 #include "bek/assertions.h"
 #include "bek/buffer.h"
+#include "bek/memory.h"
 #include "bek/types.h"
 
 namespace bek {
@@ -45,7 +46,7 @@ public:
     }
 
     void set_range(uSize start, uSize count, bool val) {
-        ASSERT(start + count < m_length);
+        ASSERT(start + count <= m_length);
         uSize end = start + count;
         // Align Start
         while (start % 8 && start < end) {
@@ -53,49 +54,35 @@ public:
         }
 
         // Align End
-        while (end & 8 && start < end) {
+        while (end % 8 && start < end) {
             set(--end, val);
         }
 
-        // Now aligned, so do full
-        while (start < end) {
-            m_data[start / 8] = (val) ? 0xFF : 0x00;
-            start += 8;
+        // Now aligned, so do full bytes.
+        if (start < end) {
+            bek::memset(&m_data[start / 8], val ? 0xFF : 0x00, (end - start) / 8);
         }
     }
 
-    uSize get_region_size(uSize start_index, bool val, uSize max_size = 0xFFFFFFFFFFFFFFFF) const {
-        uSize region_max_size = bek::min(max_size, m_length - start_index);
-        uSize end             = start_index + region_max_size;
-        uSize aligned_end     = (end / 8) * 8;
-        uSize start           = start_index;
-        bool cease            = false;
-        // Align Start
-        while (start % 8 && start < end) {
-            if (get(start) != val) {
-                cease = true;
-                break;
-            }
-            start++;
-        }
-        if (cease) return start - start_index;
-
-        while (start < aligned_end) {
-            if (m_data[start / 8] != (val ? 0xFF : 0x00)) {
-                break;
-            }
-            start += 8;
+    /// Index of the first bit at or after from (and before limit) equal to val, or limit if there is none.
+    [[nodiscard]] uSize find_next(uSize from, bool val, uSize limit = 0xFFFFFFFFFFFFFFFF) const {
+        limit = bek::min(limit, m_length);
+        if (from >= limit) return limit;
+        uSize word = from / word_bits;
+        // Discard bits before from.
+        u64 bits = matching_bits(word, val) & (~0ull << (from % word_bits));
+        // Whole words without a match are skipped in one step.
+        while (!bits) {
+            word++;
+            if (word * word_bits >= limit) return limit;
+            bits = matching_bits(word, val);
         }
+        return bek::min(word * word_bits + __builtin_ctzll(bits), limit);
+    }
 
-        // Either, we've ceased prematurely (byte not uniform) or ceased to do unaligned checking at
-        // end.
-        while (start < end) {
-            if (get(start) != val) {
-                break;
-            }
-            start++;
-        }
-        return start - start_index;
+    uSize get_region_size(uSize start_index, bool val, uSize max_size = 0xFFFFFFFFFFFFFFFF) const {
+        uSize region_max_size = bek::min(max_size, m_length - start_index);
+        return find_next(start_index, !val, start_index + region_max_size) - start_index;
     }
 
     struct fit_result_t {
@@ -107,29 +94,49 @@ public:
         [[nodiscard]] constexpr bool is_invalid() const { return (index == 0) && (size == 0); }
     };
 
+    /// Finds the first run of at least length bits equal to val, starting at or after hint, whose start index
+    /// (plus alignment_offset) is a multiple of alignment.
     [[nodiscard]] fit_result_t find_first_fit(uSize length, bool val, uSize hint = 0,
                                               uSize alignment = 1, uSize alignment_offset = 0,
                                               uSize max_size = 0xFFFFFFFFFFFFFFFF) const {
-        // Align-up hint.
         VERIFY(alignment_offset < alignment);
-        uSize start_index = align_up(hint + alignment_offset, alignment) - alignment_offset;
-        // Search in units of alignment
-        while (start_index < m_length) {
-            if (get(start_index) == val) {
-                uSize region_size = get_region_size(start_index, val, max_size);
-                if (region_size >= length) {
-                    return {start_index, region_size};
-                }
-                start_index += region_size;
-            } else {
-                uSize bad_region_size = get_region_size(start_index, !val);
-                bad_region_size       = bek::align_up(bad_region_size, alignment);
-                start_index += bad_region_size;
+        uSize start_index = hint;
+        while (start_index + length <= m_length) {
+            start_index = find_next(start_index, val);
+            // Align-up to the next candidate.
+            start_index = align_up(start_index + alignment_offset, alignment) - alignment_offset;
+            if (start_index + length > m_length) break;
+
+            uSize run_end = find_next(start_index, !val, start_index + length);
+            if (run_end == start_index + length) {
+                return {start_index, get_region_size(start_index, val, max_size)};
             }
+            start_index = run_end;
         }
         return fit_result_t::invalid();
     }
 
+private:
+    static constexpr uSize word_bits = 64;
+
+    /// Bits [64 * word, 64 * word + 64) - bit n of the result is bit 64 * word + n. Bits past the end read as zero.
+    [[nodiscard]] u64 load_word(uSize word) const {
+        uSize byte_count = bek::ceil_div(m_length, 8ul) - word * 8;
+        u64 result       = 0;
+        // Byte i holds bits [8i, 8i + 8), so a little-endian load gives the bits in order.
+        __builtin_memcpy(&result, &m_data[word * 8], bek::min(byte_count, sizeof(u64)));
+        return result;
+    }
+
+    /// Bits of word equal to val, as set bits.
+    [[nodiscard]] u64 matching_bits(uSize word, bool val) const {
+        u64 bits = val ? load_word(word) : ~load_word(word);
+        if (auto valid = m_length - word * word_bits; valid < word_bits) {
+            bits &= (1ull << valid) - 1;
+        }
+        return bits;
+    }
+
 private:
     char* m_data;
     /// In bits.
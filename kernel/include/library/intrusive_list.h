@@ -40,6 +40,9 @@ public:
     IntrusiveListNode* m_next = nullptr;
     IntrusiveListNode* m_prev = nullptr;
 
+    /// Whether the node is currently in a list.
+    bool is_linked() const { return m_list_head != nullptr; }
+
     void remove() {
         if (m_list_head) {
             if (m_list_head->first == this) {
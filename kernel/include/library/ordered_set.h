@@ -0,0 +1,189 @@
+// bekOS is a basic OS for the Raspberry Pi
+// Copyright (C) 2025 Bekos Contributors
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#ifndef BEKOS_ORDERED_SET_H
+#define BEKOS_ORDERED_SET_H
+
+#include "bek/types.h"
+#include "bek/utility.h"
+
+namespace bek {
+
+/// Set of distinct values ordered by operator<, kept as an AVL tree so that insertion, removal and lower_bound
+/// are all O(log n).
+template <typename T>
+class ordered_set {
+public:
+    ordered_set() = default;
+    ordered_set(const ordered_set&)            = delete;
+    ordered_set& operator=(const ordered_set&) = delete;
+    ordered_set(ordered_set&& other) : m_root{bek::exchange(other.m_root, nullptr)}, m_size{other.m_size} {
+        other.m_size = 0;
+    }
+    ordered_set& operator=(ordered_set&& other) {
+        if (this != &other) {
+            clear();
+            m_root = bek::exchange(other.m_root, nullptr);
+            m_size = bek::exchange(other.m_size, 0ul);
+        }
+        return *this;
+    }
+    ~ordered_set() { clear(); }
+
+    /// Returns false (and leaves the set unchanged) if an equal value is already present.
+    bool insert(T value) {
+        bool inserted = false;
+        m_root        = insert_into(m_root, value, inserted);
+        if (inserted) m_size++;
+        return inserted;
+    }
+
+    /// Returns false if no equal value was present.
+    bool remove(const T& value) {
+        bool removed = false;
+        m_root       = remove_from(m_root, value, removed);
+        if (removed) m_size--;
+        return removed;
+    }
+
+    /// The smallest value not less than value, if any.
+    const T* lower_bound(const T& value) const {
+        const T* best = nullptr;
+        for (auto* node = m_root; node;) {
+            if (node->value < value) {
+                node = node->right;
+            } else {
+                best = &node->value;
+                node = node->left;
+            }
+        }
+        return best;
+    }
+
+    [[nodiscard]] uSize size() const { return m_size; }
+
+    void clear() {
+        destroy(m_root);
+        m_root = nullptr;
+        m_size = 0;
+    }
+
+private:
+    struct Node {
+        T value;
+        Node* left{nullptr};
+        Node* right{nullptr};
+        int height{1};
+    };
+
+    static int height(Node* node) { return node ? node->height : 0; }
+    static void update(Node* node) { node->height = 1 + max(height(node->left), height(node->right)); }
+
+    static Node* rotate_right(Node* node) {
+        auto* left  = node->left;
+        node->left  = left->right;
+        left->right = node;
+        update(node);
+        update(left);
+        return left;
+    }
+    static Node* rotate_left(Node* node) {
+        auto* right = node->right;
+        node->right = right->left;
+        right->left = node;
+        update(node);
+        update(right);
+        return right;
+    }
+
+    /// Restores the AVL invariant at node, whose subtrees differ in height by at most two.
+    static Node* rebalance(Node* node) {
+        update(node);
+        auto balance = height(node->left) - height(node->right);
+        if (balance > 1) {
+            if (height(node->left->left) < height(node->left->right)) node->left = rotate_left(node->left);
+            return rotate_right(node);
+        }
+        if (balance < -1) {
+            if (height(node->right->right) < height(node->right->left)) node->right = rotate_right(node->right);
+            return rotate_left(node);
+        }
+        return node;
+    }
+
+    static Node* insert_into(Node* node, T& value, bool& inserted) {
+        if (!node) {
+            inserted = true;
+            return new Node{bek::move(value)};
+        }
+        if (value < node->value) {
+            node->left = insert_into(node->left, value, inserted);
+        } else if (node->value < value) {
+            node->right = insert_into(node->right, value, inserted);
+        } else {
+            return node;
+        }
+        return rebalance(node);
+    }
+
+    /// Unlinks the smallest node of the subtree into min, returning what is left of the subtree.
+    static Node* unlink_min(Node* node, Node*& min) {
+        if (!node->left) {
+            min = node;
+            return node->right;
+        }
+        node->left = unlink_min(node->left, min);
+        return rebalance(node);
+    }
+
+    static Node* remove_from(Node* node, const T& value, bool& removed) {
+        if (!node) return nullptr;
+        if (value < node->value) {
+            node->left = remove_from(node->left, value, removed);
+        } else if (node->value < value) {
+            node->right = remove_from(node->right, value, removed);
+        } else {
+            removed = true;
+            auto* left  = node->left;
+            auto* right = node->right;
+            delete node;
+            if (!right) return left;
+            // Replace the node with its successor, the smallest node on the right.
+            Node* successor  = nullptr;
+            auto* rest       = unlink_min(right, successor);
+            successor->left  = left;
+            successor->right = rest;
+            return rebalance(successor);
+        }
+        return rebalance(node);
+    }
+
+    static void destroy(Node* node) {
+        while (node) {
+            destroy(node->right);
+            auto* left = node->left;
+            delete node;
+            node = left;
+        }
+    }
+
+    Node* m_root{nullptr};
+    uSize m_size{0};
+};
+
+}  // namespace bek
+
+#endif  // BEKOS_ORDERED_SET_H
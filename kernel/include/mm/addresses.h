@@ -197,6 +197,10 @@ struct VirtualRegion {
 
 bek::optional<PhysicalPtr> kernel_virt_to_phys(void* ptr);
 void* kernel_phys_to_virt(PhysicalPtr ptr);
+/// Returns the uncached alias of a normal memory (RAM or kernel image) address. Accesses through
+/// it bypass the caches, so it must only be used for memory which is not otherwise being accessed
+/// through its cacheable mapping.
+void* kernel_phys_to_uncached(PhysicalPtr ptr);
 
 }  // namespace mem
 
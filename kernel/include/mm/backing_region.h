@@ -18,7 +18,9 @@
 #define BEKOS_BACKING_REGION_H
 
 #include "arch/a64/translation_tables.h"
+#include "bek/buffer.h"
 #include "bek/own_ptr.h"
+#include "bek/vector.h"
 #include <bek/intrusive_shared_ptr.h>
 #include "library/kernel_error.h"
 
@@ -54,6 +56,49 @@ public:
 
     virtual expected<bek::shared_ptr<BackingRegion>> clone_for_fork(UserspaceRegion& current_region) = 0;
 
+    /**
+     * Handles a fault on a page which map_into_table left unmapped (i.e. demand-allocated pages), or
+     * mapped read-only despite being asked for a writable mapping (i.e. copy-on-write pages).
+     * @param manager The manager of the userspace address space.
+     * @param page The faulting (single) page of userspace.
+     * @param offset Offset into backing region of the page. Page-aligned.
+     * @param is_write Whether the faulting access was a write.
+     * @return ESUCCESS if the access can now be retried, otherwise relevant ErrorCode.
+     */
+    virtual ErrorCode resolve_fault(TableManager& manager, UserRegion page, uSize offset, bool is_write,
+                                    bool readable, bool writable, bool executable) {
+        return EFAULT;
+    }
+
+    /**
+     * Gives this region its own copy of any pages it still shares copy-on-write, and remaps them in manager.
+     * Must be done before the region itself is shared, as a copy made on a later fault would only be mapped
+     * into the faulting address space.
+     * @param user_region Where the region is mapped in manager. Must be page-aligned and cover the whole region.
+     */
+    virtual ErrorCode break_copy_on_write(TableManager& manager, UserRegion user_region, bool readable,
+                                          bool writable, bool executable) {
+        return ESUCCESS;
+    }
+
+    /**
+     * Creates a backing region for part of this one, sharing its contents. Used to keep the remainder of a
+     * userspace region which is only partly deallocated.
+     * @param offset Offset of the part. Page-aligned.
+     * @param size Size of the part. Page-aligned.
+     */
+    virtual expected<bek::shared_ptr<BackingRegion>> slice(uSize offset, uSize size) { return ENOTSUP; }
+
+    /**
+     * Drops the contents of part of the region, keeping it reserved: it reads as zero when next accessed.
+     * The pages are unmapped from manager, so that the next access faults.
+     * @param user_region The part of userspace to discard. Must be page-aligned.
+     * @param offset Offset into backing region of user_region. Page-aligned.
+     */
+    virtual ErrorCode discard(TableManager& manager, UserRegion user_region, uSize offset) { return ENOTSUP; }
+    /// Whether discard is supported. If so, it only fails on invalid arguments.
+    virtual bool can_discard() const { return false; }
+
     BackingRegion()                                = default;
     BackingRegion(const BackingRegion&)            = delete;
     BackingRegion& operator=(const BackingRegion&) = delete;
@@ -61,34 +106,121 @@ public:
     BackingRegion& operator=(BackingRegion&&)      = default;
 };
 
+/// Physically contiguous pages, which may be shared between several copy-on-write
+/// UserOwnedAllocations. Each page counts the allocations which reference it, and goes back to the
+/// PageAllocator as soon as none do - even while the rest of the chunk is still in use.
+class PageChunk : public bek::RefCounted<PageChunk> {
+public:
+    /// Every page starts with one reference, held by the creator.
+    static expected<bek::shared_ptr<PageChunk>> create(uSize pages);
+    /// Creates a single zeroed page, preferring the pool of pre-zeroed pages.
+    static expected<bek::shared_ptr<PageChunk>> create_zeroed_page();
+
+    constexpr mem::VirtualRegion region() const { return m_region; }
+    u8* kernel_page(uSize index) const { return m_region.start.ptr + index * PAGE_SIZE; }
+    PhysicalPtr physical_page(uSize index) const { return m_physical_ptr.offset(index * PAGE_SIZE); }
+
+    u32 page_references(uSize index) const { return m_page_references[index]; }
+    void acquire_page(uSize index) {
+        VERIFY(m_page_references[index]);
+        m_page_references[index]++;
+    }
+    /// Frees the page once the last reference is released. It must not be used after that.
+    void release_page(uSize index);
+
+    ~PageChunk();
+
+private:
+    PageChunk(VirtualRegion region, PhysicalPtr physical_ptr)
+        : m_region{region}, m_physical_ptr{physical_ptr}, m_page_references(region.size / PAGE_SIZE) {
+        VERIFY(m_region.page_aligned());
+        VERIFY(m_physical_ptr.page_offset() == 0);
+        for (auto& references : m_page_references) references = 1;
+    }
+
+    mem::VirtualRegion m_region;
+    mem::PhysicalPtr m_physical_ptr;
+    bek::vector<u32> m_page_references;
+};
+
+/// Anonymous memory owned by userspace. Forking shares the pages copy-on-write: pages referenced
+/// by more than one allocation are mapped read-only, and copied on the first write. Lazy allocations
+/// start with no pages at all, each being allocated and zeroed on first access.
 class UserOwnedAllocation : public BackingRegion {
 public:
 
-    static expected<bek::shared_ptr<UserOwnedAllocation>> create_contiguous(uSize pages);
+    /// Allocates all pages up front. They need not be physically contiguous, so this succeeds as long
+    /// as enough free pages exist. If `zeroed`, the pages are cleared; small allocations take
+    /// pre-zeroed pages where possible.
+    static expected<bek::shared_ptr<UserOwnedAllocation>> create_scattered(uSize pages, bool zeroed = false);
+    static expected<bek::shared_ptr<UserOwnedAllocation>> create_lazy(uSize pages);
 
 public:
-    constexpr mem::VirtualRegion kernel_mapped_region() const {
-        return m_region;
+    /// Calls fn(run, run_offset) -> ErrorCode on each kernel-mapped run of the allocation within
+    /// [offset, offset + length). All pages in the range must be populated.
+    template <typename Fn>
+    ErrorCode for_each_kernel_run(uSize offset, uSize length, Fn&& fn) {
+        VERIFY(offset + length <= size());
+        while (length) {
+            auto& page       = m_pages[offset / PAGE_SIZE];
+            auto page_offset = offset % PAGE_SIZE;
+            VERIFY(page.populated());
+            uSize run = bek::min(length, PAGE_SIZE - page_offset);
+            // Pages of the same chunk are adjacent in the kernel mapping too.
+            for (uSize next = offset / PAGE_SIZE + 1; run < length && next < m_pages.size() &&
+                                                      m_pages[next].chunk == m_pages[next - 1].chunk &&
+                                                      m_pages[next].index == m_pages[next - 1].index + 1;
+                 next++) {
+                run += bek::min(length - run, static_cast<uSize>(PAGE_SIZE));
+            }
+            bek::mut_buffer buffer{reinterpret_cast<char*>(page.chunk->kernel_page(page.index)) + page_offset, run};
+            EXPECT_SUCCESS(fn(buffer, offset));
+            offset += run;
+            length -= run;
+        }
+        return ESUCCESS;
     }
-    uSize size() const override { return m_region.size; }
+    /// Copies length bytes from data into the allocation at offset.
+    void write(uSize offset, const void* data, uSize length);
+    /// Zeroes length bytes of the allocation at offset.
+    void clear(uSize offset, uSize length);
+    /// Makes code written into the allocation visible to instruction fetch.
+    void sync_instruction_cache();
+
+    uSize size() const override { return m_pages.size() * PAGE_SIZE; }
     ErrorCode map_into_table(TableManager& manager, UserRegion user_region, uSize offset,
                              bool readable, bool writeable, bool executable) override;
     ErrorCode unmap_from_table(TableManager& manager, UserRegion user_region,
                                uSize offset) override;
     expected<bek::shared_ptr<BackingRegion>> clone_for_fork(UserspaceRegion& current_region) override;
+    ErrorCode resolve_fault(TableManager& manager, UserRegion page, uSize offset, bool is_write, bool readable,
+                            bool writable, bool executable) override;
+    ErrorCode break_copy_on_write(TableManager& manager, UserRegion user_region, bool readable, bool writable,
+                                  bool executable) override;
+    expected<bek::shared_ptr<BackingRegion>> slice(uSize offset, uSize size) override;
+    ErrorCode discard(TableManager& manager, UserRegion user_region, uSize offset) override;
+    bool can_discard() const override { return true; }
 
     UserOwnedAllocation(UserOwnedAllocation&&) = default;
     ~UserOwnedAllocation() override;
 
 private:
-    explicit UserOwnedAllocation(VirtualRegion region, PhysicalPtr physical_ptr)
-        : m_region{region}, m_physical_ptr(physical_ptr) {
-        VERIFY(m_region.page_aligned());
-        VERIFY(m_physical_ptr.page_offset() == 0);
-    }
+    /// A page of the allocation. Pages of lazy allocations have no chunk until first accessed.
+    struct Page {
+        bek::shared_ptr<PageChunk> chunk;
+        uSize index;
 
-    mem::VirtualRegion m_region;
-    mem::PhysicalPtr m_physical_ptr;
+        bool populated() const { return chunk.get() != nullptr; }
+        PhysicalPtr physical() const { return chunk->physical_page(index); }
+        bool exclusive() const { return chunk->page_references(index) == 1; }
+    };
+
+    explicit UserOwnedAllocation(bek::vector<Page> pages) : m_pages{bek::move(pages)} {}
+
+    /// Replaces the page with a private copy of it.
+    static ErrorCode copy_page(Page& entry, bool executable);
+
+    bek::vector<Page> m_pages;
 };
 
 }  // namespace mem
@@ -0,0 +1,34 @@
+/*
+ * bekOS is a basic OS for the Raspberry Pi
+ * Copyright (C) 2024 Bekos Contributors
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef BEKOS_CACHE_H
+#define BEKOS_CACHE_H
+
+#include "bek/types.h"
+
+namespace mem {
+
+/// Size of the smallest data cache line, in bytes.
+uSize cache_line_size();
+
+/// Makes code written to the range through the data side visible to instruction fetch.
+void sync_instruction_cache(const void* ptr, uSize size);
+
+}  // namespace mem
+
+#endif  // BEKOS_CACHE_H
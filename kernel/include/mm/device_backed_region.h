@@ -24,7 +24,8 @@
 
 class DeviceBackedRegion : public mem::BackingRegion {
 public:
-    explicit DeviceBackedRegion(mem::PhysicalRegion region) : m_region(region) {}
+    explicit DeviceBackedRegion(mem::PhysicalRegion region, MemAttributeIndex attributes = MMIO)
+        : m_region(region), m_attributes(attributes) {}
     uSize size() const override { return m_region.size; }
     ErrorCode map_into_table(TableManager& manager, mem::UserRegion user_region, uSize offset, bool readable,
                              bool writable, bool executable) override;
@@ -33,6 +34,7 @@ public:
 
 private:
     mem::PhysicalRegion m_region;
+    MemAttributeIndex m_attributes;
 };
 
 #endif  // BEKOS_DEVICE_BACKED_REGION_H
@@ -23,12 +23,17 @@
 #include "bek/buffer.h"
 #include "bek/optional.h"
 #include "bek/vector.h"
+#include "cache.h"
 #include "kmalloc.h"
 #include "peripherals/device_tree.h"
 
 namespace mem {
+/// Discards cached copies of the range, so that data written by a device is visible to the CPU.
 void dma_sync_before_read(const void* ptr, uSize size);
+/// Writes back cached copies of the range, so that data written by the CPU is visible to a device.
 void dma_sync_after_write(const void* ptr, uSize size);
+/// Writes back and then discards cached copies of the range.
+void dma_flush_cache(const void* ptr, uSize size);
 
 class dma_pool;
 
@@ -193,6 +198,9 @@ private:
     own_dma_buffer m_buffer;
 };
 
+/// DMA pool over kernel memory, where devices see RAM through a set of bus mappings. Buffers are
+/// handed out through the uncached alias of memory, so they are coherent with devices without
+/// explicit cache maintenance.
 class MappedDmaPool final : public mem::dma_pool {
 public:
     explicit MappedDmaPool(bek::vector<dev_tree::range_t> mappings)
@@ -23,11 +23,20 @@
 #include "bek/types.h"
 #include "bek/utility.h"
 
+namespace sc {
+struct KernelHeapStats;
+}
+
 namespace mem {
 
 void initialise_kmalloc();
 
+/// Like allocate(), but the region is also physically contiguous - as needed for buffers accessed by devices. Free
+/// with free().
+AllocatedRegion allocate_contiguous(uSize size, uSize align = ALLOCATOR_DEFAULT_ALIGNMENT);
+
 bek::pair<uSize, uSize> get_kmalloc_usage();
+void get_kmalloc_stats(sc::KernelHeapStats& stats);
 void log_kmalloc_usage();
 
 }  // namespace mem
@@ -37,6 +46,7 @@ void log_kmalloc_usage();
 
 inline void* kmalloc(uSize sz) { return mem::allocate(sz).pointer; }
 inline void* kmalloc(uSize sz, uSize align) { return mem::allocate(sz, align).pointer; }
+inline void* kmalloc_contiguous(uSize sz, uSize align) { return mem::allocate_contiguous(sz, align).pointer; }
 
 inline void kfree(void* ptr, uSize sz) { return mem::free(ptr, sz); }
 inline void kfree(void* ptr, uSize sz, uSize align) { return mem::free(ptr, sz, align); }
@@ -24,6 +24,8 @@
 #include "bek/format_core.h"
 #include "bek/types.h"
 #include "bek/vector.h"
+#include "library/intrusive_list.h"
+#include "library/kernel_error.h"
 #include "page_allocator.h"
 
 namespace mem {
@@ -44,15 +46,41 @@ class MemoryManager {
 public:
     DeviceArea map_for_io(PhysicalRegion region);
 
+    /// Allocates a virtually contiguous region in the vmalloc window, backed by individually allocated (so not
+    /// physically contiguous) pages. Not for DMA.
+    bek::optional<VirtualRegion> allocate_virtual(uSize pages);
+    /// Frees a region from allocate_virtual(), along with its pages.
+    void free_virtual(VirtualPtr start);
+    static bool is_virtual_allocation(const void* ptr) {
+        auto address = reinterpret_cast<uPtr>(ptr);
+        return address >= VA_VMALLOC_OFFSET && address < VA_VMALLOC_OFFSET + VA_VMALLOC_SIZE;
+    }
+
     static MemoryManager& the();
-    static void initialise(const bek::vector<AnnotatedRegion>& regions, u8* current_embedded_table);
+    static bool is_initialised();
+    static ErrorCode initialise(const bek::vector<AnnotatedRegion>& regions, u8* current_embedded_table);
 
 private:
+    struct VirtualArea {
+        uPtr start;
+        /// Includes the unmapped guard page at the end.
+        uSize size;
+        bek::IntrusiveListNode<VirtualArea> node;
+    };
+    using VirtualAreaList = bek::IntrusiveList<VirtualArea, &VirtualArea::node>;
+
     explicit MemoryManager(u8* current_embedded_table);
     VirtualRegion map_normal_memory(PhysicalRegion region);
+    /// Maps region a second time, uncached, at VA_DMA_OFFSET. See kernel_phys_to_uncached().
+    ErrorCode map_uncached_alias(PhysicalRegion region);
+
+    /// Unmaps and frees the pages of [start, start + size) which were mapped by allocate_virtual.
+    void release_virtual_pages(uPtr start, uSize size);
 
 private:
     TableManager m_table_manager;
+    /// Allocated areas of the vmalloc window, sorted by address.
+    VirtualAreaList m_virtual_areas;
 };
 
 }  // namespace mem
@@ -25,34 +25,63 @@
 #include "bek/types.h"
 namespace mem {
 
-/// Allocator for a contiguous region of pages. Stores allocation data within its own get_region.
+/// Binary buddy allocator for a contiguous region of pages. Stores allocation data within its own region.
+///
+/// Free blocks of 2^order pages are kept on per-order free lists, threaded through the free pages
+/// themselves. A single tag byte per page (stored at the start of the region) records the order and
+/// state of the block beginning at that page. Blocks are aligned to their size by address, not just by
+/// offset into the region, so an allocation of 2^n pages is naturally aligned.
 class RegionPageAllocator {
 public:
+    static constexpr u8 MAX_ORDER = 18;
+
     explicit RegionPageAllocator(VirtualRegion region);
 
-    /// @brief Allocates contiguous get_region of `n_pages` pages.
-    /// @returns Physical Pointer to first page, or -1 if failed.
+    /// @brief Allocates contiguous region of `n_pages` pages.
+    /// @returns Pointer to first page, or nullopt if failed.
     bek::optional<VirtualPtr> allocate_pages(uSize n_pages);
 
     void mark_as_reserved(VirtualRegion region);
 
-    /// @brief Frees a region allocated. UB if get_region is not valid.
-    /// \param region Physical Pointer to first page of get_region.
+    /// @brief Frees a region allocated. UB if region is not valid.
+    /// \param region Pointer to first page of region.
     void free_region(VirtualPtr region);
 
+    /// @brief Frees n_pages pages of an allocation from start, which need not be all of it. The rest of the
+    /// allocation must then also be freed with release_pages, rather than free_region.
+    void release_pages(VirtualPtr start, uSize n_pages);
+
     [[nodiscard]] VirtualRegion region() const { return m_region; }
+    [[nodiscard]] uSize total_pages() const { return m_page_count; }
+    [[nodiscard]] uSize free_pages() const { return m_free_pages; }
 
 private:
-    void mark_as_reserved(uSize index, uSize n_pages);
-    void mark_region_as_free(uSize start_index);
-    uSize search_for_free(uSize n_pages);
+    struct FreeBlock {
+        FreeBlock* next;
+        FreeBlock* prev;
+    };
+
+    [[nodiscard]] FreeBlock* block_at(uSize index) const;
+    [[nodiscard]] uSize index_of(const FreeBlock* block) const;
+
+    void push_free(uSize index, u8 order);
+    void remove_free(uSize index, u8 order);
+    void free_block(uSize index, u8 order);
+    void carve_free_range(uSize start, uSize end);
+    void reserve_page(uSize index);
+    /// First page of the allocated block containing index, if it is allocated.
+    [[nodiscard]] bek::optional<uSize> allocated_block_containing(uSize index) const;
+    /// Splits the allocated block containing index (if any), so that a block starts at index.
+    void split_allocation_at(uSize index);
 
     VirtualRegion m_region;
+    uSize m_page_count;
+    /// Page number of the region's first page, as blocks are aligned to absolute page numbers.
+    uSize m_base_frame;
+    uSize m_free_pages{0};
 
-    bek::mut_buffer m_free_bitmap{nullptr, 0};
-    bek::mut_buffer m_continuation_bitmap{nullptr, 0};
-
-    uSize m_last_freed{0};
+    u8* m_page_tags{nullptr};
+    FreeBlock* m_free_lists[MAX_ORDER + 1]{};
 };
 
 /// Allocator to request (strings of) physical pages of memory.
@@ -68,9 +97,10 @@ public:
     /// within an existing region. \note Erroneous code could free reserved regions.
     void mark_as_reserved(VirtualRegion region);
 
-    /// Tries to allocate a contiguous region of pages `page_number` long.
+    /// Tries to allocate a contiguous region of pages `page_number` long. It is aligned to the smallest
+    /// power of two pages which holds it.
     /// \param page_number Number of pages to attempt to allocate.
-    /// \return Region allocated, if successful. nullopt if not.
+    /// \return Region allocated, if successful. nullopt if not, even after using the pre-zeroed pool.
     bek::optional<VirtualRegion> allocate_region(uSize page_number);
 
     /// Frees a region of contiguous pages starting with start.
@@ -78,11 +108,37 @@ public:
     /// by allocate_region.
     void free_region(VirtualPtr start);
 
+    /// Frees n_pages pages starting with start, which may be only part of a region allocated by allocate_region.
+    /// The rest of that region must then also be freed with release_pages.
+    void release_pages(VirtualPtr start, uSize n_pages);
+
+    /// Allocates a single zeroed page, taken from the pool of pre-zeroed pages if possible (and
+    /// zeroed on the spot otherwise).
+    bek::optional<VirtualRegion> allocate_zeroed_page();
+
+    enum class RefillStatus {
+        Full,
+        /// Budget ran out before the pool was full - call again.
+        NotFull,
+        /// No free pages are left to add, so calling again is pointless until some are freed.
+        OutOfPages,
+    };
+    /// Zeroes up to `budget` free pages into the pre-zeroed pool. Intended to be called when there is
+    /// nothing better to do.
+    RefillStatus refill_zeroed_pages(uSize budget);
+
     static PageAllocator& the();
 
 private:
+    bek::optional<VirtualRegion> allocate_from_regions(uSize page_number);
+
     static constexpr uSize MAX_PHYSICAL_REGIONS = 4;
+    static constexpr uSize ZEROED_POOL_PAGES    = 256;
     bek::optional<RegionPageAllocator> m_phys_regions[MAX_PHYSICAL_REGIONS];
+
+    /// Pages known to be zero. Kept out-of-line, as threading a free list through them would dirty them.
+    VirtualPtr m_zeroed_pages[ZEROED_POOL_PAGES]{};
+    uSize m_zeroed_count{0};
 };
 
 }  // namespace mem
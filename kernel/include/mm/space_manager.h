@@ -23,6 +23,7 @@
 #include "bek/str.h"
 #include "bek/vector.h"
 #include "library/kernel_error.h"
+#include "library/ordered_set.h"
 
 enum class MemoryOperation {
     None = 0x0,
@@ -49,19 +50,31 @@ public:
     expected<mem::UserRegion> place_region(bek::optional<uPtr> location, MemoryOperation allowed_operations,
                                            bek::string name, bek::shared_ptr<mem::BackingRegion> region);
     bool check_region(uPtr location, uSize size, MemoryOperation operation);
+    /// Unmaps [location, location + size), which may cover several regions, and parts of regions. On failure,
+    /// nothing has changed.
     ErrorCode deallocate_userspace_region(uPtr location, uSize size);
+    /// Drops the contents of [location, location + size), which stays allocated but reads as zero. On failure,
+    /// nothing has changed.
+    ErrorCode discard_userspace_region(uPtr location, uSize size);
     ErrorCode deallocate_userspace_region(const bek::shared_ptr<mem::BackingRegion>& region);
 
     expected<bek::shared_ptr<mem::UserOwnedAllocation>> allocate_placed_region(mem::UserRegion region,
                                                                                MemoryOperation allowed_operations,
-                                                                               bek::str_view name);
+                                                                               bek::str_view name,
+                                                                               bool zeroed = false);
 
     expected<bek::shared_ptr<mem::BackingRegion>> get_shareable_region(mem::UserRegion user_region);
     expected<MemoryOperation> get_allowed_operations(mem::UserRegion region);
 
     expected<SpaceManager> clone_for_fork();
+    /// Resolves a fault at address, if it was to a demand-allocated or copy-on-write page.
+    ErrorCode handle_fault(uPtr address, bool is_write);
+    /// The physical address behind readable address, once its page is present - and, if the region is writable, no
+    /// longer shared copy-on-write - so stable for as long as it stays mapped. Must be the active address space.
+    expected<mem::PhysicalPtr> resolve_physical(uPtr address);
     void debug_print() const;
-    uPtr raw_root_ptr() const;
+    /// Value for the user translation base register (root table and ASID) to switch to this space.
+    u64 translation_base();
 
     SpaceManager(const SpaceManager&) = delete;
     SpaceManager& operator=(const SpaceManager&) = delete;
@@ -70,11 +83,37 @@ public:
     SpaceManager& operator=(SpaceManager&&) = default;
 
 private:
-    explicit SpaceManager(TableManager manager) : m_tables(bek::move(manager)) {}
-    SpaceManager(TableManager manager, bek::vector<UserspaceRegion> regions)
-        : m_regions{bek::move(regions)}, m_tables{bek::move(manager)} {}
+    /// Unused space between regions, ordered by size so that the best fit is found in O(log n).
+    struct Gap {
+        uSize size;
+        uPtr start;
+        bool operator<(const Gap& other) const {
+            return size < other.size || (size == other.size && start < other.start);
+        }
+    };
 
+    explicit SpaceManager(TableManager manager);
+    SpaceManager(TableManager manager, bek::vector<UserspaceRegion> regions);
+
+    ErrorCode remap_region(UserspaceRegion& region);
+    /// A new region for part of region, with its own backing.
+    static expected<UserspaceRegion> slice_region(const UserspaceRegion& region, mem::UserRegion part);
+    void insert_region(uSize index, UserspaceRegion region);
+    UserspaceRegion erase_region(uSize index);
+    /// The gap between regions index - 1 and index, if there is space between them.
+    bek::optional<Gap> gap_before(uSize index) const;
+    void add_gap_before(uSize index);
+    void remove_gap_before(uSize index);
+    /// Index of the first region ending after address - the only region which could contain it.
+    uSize region_index_for(uPtr address) const;
+    UserspaceRegion* find_region(uPtr address);
+    /// Finds space for a region of size bytes, aligned to alignment.
+    bek::optional<uPtr> find_gap(uSize size, uPtr alignment) const;
+
+    /// Sorted by address, and non-overlapping.
     bek::vector<UserspaceRegion> m_regions{};
+    /// Exactly the gaps before each region, and after the last - updated as regions come and go.
+    bek::ordered_set<Gap> m_gaps{};
     TableManager m_tables;
 };
 
@@ -38,6 +38,8 @@ public:
     void disable_interrupt(u32 interrupt_id) override;
 
     void handle_interrupt() override;
+    void initialise_secondary_cpu() override;
+    bool send_software_interrupt(u32 cpu, u32 id) override;
 
 private:
     ArmGIC(mem::DeviceArea distributor_area, mem::DeviceArea cpu_base, u8 num_cpus, u32 max_ids);
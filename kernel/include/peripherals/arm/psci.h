@@ -0,0 +1,40 @@
+/*
+ * bekOS is a basic OS for the Raspberry Pi
+ * Copyright (C) 2025 Bekos Contributors
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef BEKOS_PSCI_H
+#define BEKOS_PSCI_H
+
+#include "bek/types.h"
+#include "library/kernel_error.h"
+#include "mm/addresses.h"
+#include "peripherals/device_tree.h"
+
+/// Power State Coordination Interface - firmware calls for powering CPUs on and off.
+namespace psci {
+
+/// Finds the /psci node, and the conduit (HVC or SMC) to call it through.
+ErrorCode initialise(const dev_tree::device_tree& tree);
+
+bool is_available();
+
+/// Powers on the CPU with the given MPIDR affinity. It starts at entry with the MMU off, and context in x0.
+ErrorCode cpu_on(u64 target_mpidr, mem::PhysicalPtr entry, u64 context);
+
+}  // namespace psci
+
+#endif  // BEKOS_PSCI_H
@@ -50,6 +50,11 @@ public:
     virtual void enable_interrupt(u32 interrupt_id)                             = 0;
     virtual void disable_interrupt(u32 interrupt_id)                            = 0;
     virtual void handle_interrupt()                                             = 0;
+    /// Sets up the calling CPU's interface to the controller. The boot CPU's is set up on creation.
+    virtual void initialise_secondary_cpu() {}
+    /// Raises software-generated interrupt id on another CPU.
+    /// \return false if not supported.
+    virtual bool send_software_interrupt(u32 cpu, u32 id) { return false; }
     Kind kind() const override;
     bek::str_view preferred_name_prefix() const override;
 };
@@ -21,6 +21,7 @@
 
 #include "device.h"
 #include "library/function.h"
+#include "library/intrusive_list.h"
 
 class TimerDevice : public Device {
 public:
@@ -44,10 +45,45 @@ public:
 };
 inline constexpr TimerDevice::CallbackAction TimerDevice::CallbackAction::Cancel = CallbackAction{-1};
 
+class TimingManager;
+
 namespace timing {
 ErrorCode initialise();
 ErrorCode schedule_callback(bek::function<TimerDevice::CallbackAction(u64)> action, long nanoseconds);
 
+/// A callback at a deadline, which the caller embeds and owns. Arming and cancelling take constant time, however
+/// many other timers are pending.
+class Timer {
+public:
+    using Action = bek::function<TimerDevice::CallbackAction(u64)>;
+
+    explicit Timer(Action action) : m_action{bek::move(action)} {}
+    Timer(const Timer&)            = delete;
+    Timer& operator=(const Timer&) = delete;
+    ~Timer() { cancel(); }
+
+    /// Runs the action, in interrupt context, once nanoseconds have passed. Replaces any pending deadline. If the
+    /// action returns Reschedule, it runs again after that many nanoseconds.
+    void arm(u64 nanoseconds);
+    void cancel();
+    bool is_armed() const { return m_node.is_linked(); }
+
+private:
+    friend class ::TimingManager;
+
+    Action m_action;
+    bek::IntrusiveListNode<Timer> m_node;
+    /// In ticks.
+    u64 m_deadline{0};
+    u8 m_level{0};
+    u8 m_slot{0};
+    /// Allocated by schedule_callback, and deleted once cancelled.
+    bool m_owned{false};
+};
+
+/// Programs the timer for the earliest pending deadline. Run on the timer's CPU when another CPU has armed one.
+void reprogram();
+
 uSize nanoseconds_since_start();
 
 constexpr u64 nanoseconds_from_frequency(u64 hertz) {
@@ -0,0 +1,39 @@
+/*
+ * bekOS is a basic OS for the Raspberry Pi
+ * Copyright (C) 2025 Bekos Contributors
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef BEKOS_FUTEX_H
+#define BEKOS_FUTEX_H
+
+#include "library/kernel_error.h"
+#include "mm/addresses.h"
+
+/// Wait queues keyed by the physical address of a word of user memory, so that processes sharing memory can wait
+/// on the same word. Callers check the word's value first - the kernel lock keeps that check and the wait atomic
+/// with respect to wake().
+namespace futex {
+
+/// Blocks until wake() is called for address, or timeout_ns passes (if non-zero).
+/// \return ETIMEDOUT if not woken in time.
+ErrorCode wait(mem::PhysicalPtr address, u64 timeout_ns);
+/// Wakes up to count processes waiting on address, longest-waiting first.
+/// \return the number woken.
+u32 wake(mem::PhysicalPtr address, u32 count);
+
+}  // namespace futex
+
+#endif  // BEKOS_FUTEX_H
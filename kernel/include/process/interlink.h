@@ -23,6 +23,7 @@
 
 #include "bek/vector.h"
 #include "entity.h"
+#include "wait_queue.h"
 #include <bek/intrusive_shared_ptr.h>
 #include "library/kernel_error.h"
 
@@ -82,7 +83,7 @@ class Connection: public bek::RefCounted<Connection> {
     };
 
 public:
-    Connection(bek::shared_ptr<Server> server, uSize ringbuffer_size): m_server{bek::move(server)}, m_client_ringbuffer(ringbuffer_size), m_server_ringbuffer(ringbuffer_size) {}
+    Connection(bek::shared_ptr<Server> server, uSize ringbuffer_size): m_server{bek::move(server)}, m_client_channel(ringbuffer_size), m_server_channel(ringbuffer_size) {}
     ALWAYS_INLINE expected<uSize> client_receive(TransactionalBuffer& buffer, bool blocking);
     ALWAYS_INLINE expected<uSize> send_to_client(TransactionalBuffer& buffer, bool blocking);
     ALWAYS_INLINE expected<uSize> server_read(TransactionalBuffer& buffer, bool blocking);
@@ -90,24 +91,33 @@ public:
 
     virtual ~Connection();
 private:
-    static expected<uSize> write_to_queue(TransactionalBuffer& buffer, ring_buffer& binary_queue, bek::vector<Connection::QueuedMessage>&, bool blocking);
-    static expected<uSize> read_from_queue(TransactionalBuffer& buffer, ring_buffer& binary_queue, bek::vector<Connection::QueuedMessage>&, bool blocking);
+    /// One direction of the connection.
+    struct Channel {
+        explicit Channel(uSize ringbuffer_size) : ringbuffer(ringbuffer_size) {}
+
+        bek::vector<QueuedMessage> queue;
+        /// Buffer of pending data.
+        ring_buffer ringbuffer;
+        /// Receivers waiting for a message, and senders waiting for buffer space.
+        WaitQueue receivers;
+        WaitQueue senders;
+    };
 
-    bek::shared_ptr<Server> m_server;
-    bek::vector<QueuedMessage> m_client_queue;
-    bek::vector<QueuedMessage> m_server_queue;
+    static expected<uSize> write_to_queue(TransactionalBuffer& buffer, Channel& channel, bool blocking);
+    static expected<uSize> read_from_queue(TransactionalBuffer& buffer, Channel& channel, bool blocking);
 
-    /// Buffer of pending data to client (from server).
-    ring_buffer m_client_ringbuffer;
-    /// Buffer of pending data to server (from client).
-    ring_buffer m_server_ringbuffer;
+    bek::shared_ptr<Server> m_server;
+    /// Messages to client (from server).
+    Channel m_client_channel;
+    /// Messages to server (from client).
+    Channel m_server_channel;
 };
 
 class Server final : public bek::RefCounted<Server> {
 public:
     explicit Server(bek::string address);
     expected<bek::shared_ptr<Connection>> connect();
-    expected<bek::shared_ptr<Connection>> accept();
+    expected<bek::shared_ptr<Connection>> accept(bool blocking);
 
     bek::shared_ptr<ServerHandle> take_handle();
     void detach_handle(ServerHandle& handle);
@@ -116,6 +126,7 @@ private:
     bek::string m_address;
     ServerHandle* m_server_handle{nullptr};
     bek::vector<bek::shared_ptr<Connection>> m_pending_connections;
+    WaitQueue m_acceptors;
 };
 
 class ConnectionHandle: public EntityHandle {
@@ -24,6 +24,7 @@
 #include "entity.h"
 #include "library/kernel_error.h"
 #include "library/transactional_buffer.h"
+#include "wait_queue.h"
 
 class Pipe : public bek::RefCounted<Pipe> {
 public:
@@ -32,9 +33,15 @@ public:
     expected<uSize> read(TransactionalBuffer& buffer, bool blocking);
 
 private:
+    uSize read_space() const;
+    uSize write_space() const;
+
     bek::vector<u8> m_data;
     uSize m_read_idx;
     uSize m_write_idx;
+    /// Readers waiting for data, and writers waiting for space.
+    WaitQueue m_readers;
+    WaitQueue m_writers;
 };
 
 class PipeHandle : public EntityHandle {
@@ -22,11 +22,16 @@
 
 #include "api/syscalls.h"
 #include "arch/saved_registers.h"
+#include "arch/smp.h"
 #include "entity.h"
+#include "interrupts/deferred_calls.h"
 #include "library/function.h"
+#include "library/intrusive_list.h"
 #include "library/user_buffer.h"
 #include "mm/space_manager.h"
 #include "peripherals/device.h"
+#include "peripherals/timer.h"
+#include "process/wait_queue.h"
 
 enum class ProcessState {
     Unready,
@@ -36,6 +41,10 @@ enum class ProcessState {
     AwaitingDeath,
 };
 
+/// Scheduling priorities - lower values run first, and processes of the same priority take turns.
+inline constexpr u8 SCHED_PRIORITY_LEVELS  = 8;
+inline constexpr u8 SCHED_DEFAULT_PRIORITY = 3;
+
 expected<long> handle_syscall(u64 syscall_no, u64 arg1, u64 arg2, u64 arg3, u64 arg4, u64 arg5, u64 arg6, u64 arg7,
                               InterruptContext& ctx);
 
@@ -49,15 +58,19 @@ public:
 
     bek::str_view name() const { return m_name.view(); }
     long pid() const { return m_pid; }
-    ProcessState set_state(ProcessState new_state) {
-        auto old_state = m_running_state;
-        m_running_state = new_state;
-        return old_state;
-    }
+    /// Changes state, moving the process on or off the run queues.
+    ProcessState set_state(ProcessState new_state);
 
-    bool has_userspace() const { return m_userspace_state.is_valid(); }
+    bool has_userspace() const { return m_userspace_state.get() != nullptr; }
 
+    /// Ends this thread of execution. The process ends once all of its threads have.
     void quit_process(int exit_code);
+    /// Ends every thread of the process. The others quit at their next return to userspace.
+    void exit_process(int exit_code);
+    /// Quits if another thread has ended the process. Called when about to return to userspace.
+    void exit_if_requested();
+    /// Whether another thread has ended the process, and this one has yet to quit.
+    bool exit_requested() const;
 
     expected<long> sys_open(uPtr path_str, uSize path_len, sc::OpenFlags flags, int parent, uPtr stat_struct);
     expected<long> sys_read(int entity_handle, uSize offset, uPtr buffer, uSize len);
@@ -69,15 +82,22 @@ public:
     expected<long> sys_list_devices(uPtr buffer, uSize len, u64 protocol_filter);
     expected<long> sys_allocate(uPtr address, uSize size, sc::AllocateFlags flags);
     expected<long> sys_deallocate(uPtr address, uSize size);
+    expected<long> sys_discard(uPtr address, uSize size);
     expected<long> sys_get_pid();
+    expected<long> sys_get_kernel_heap_stats(uPtr stats_struct);
     expected<long> sys_open_device(uPtr path_str, uPtr path_len);
     expected<long> sys_message_device(int entity_handle, u64 id, uPtr buffer, uSize size);
     expected<long> sys_fork(InterruptContext& ctx);
+    expected<long> sys_create_thread(uPtr entry, u64 argument, uPtr user_stack);
+    expected<long> sys_join_thread(long thread_id, uPtr status_ptr);
     expected<long> sys_execute(uPtr executable_path, uSize path_len, uPtr args_array, uSize args_n, uPtr env_array,
                                uSize env_n);
     expected<long> sys_create_pipe(uPtr pipe_handle_arr, u64 raw_flags);
     expected<long> sys_duplicate(long handle_slot, long new_handle_slot, u8 group);
     expected<long> sys_wait(long pid, uPtr status_ptr, u64 flags);
+    expected<long> sys_sleep(u64 nanoseconds, sc::SleepFlags flags);
+    expected<long> sys_futex_wait(uPtr address, u32 expected_value, u64 timeout_ns);
+    expected<long> sys_futex_wake(uPtr address, u32 count);
     expected<long> sys_chdir(uPtr path_str, uSize path_len);
     expected<long> sys_interlink_advertise(uPtr address_str, uSize address_len, u8 group);
     expected<long> sys_interlink_connect(uPtr address_str, uSize address_len, u8 group);
@@ -114,6 +134,11 @@ private:
                                                bek::vector<LocalEntityHandle> handles,
                                                bek::vector<bek::string> arguments, bek::vector<bek::string> environ);
 
+    /// The main thread, which owns the others. Returns itself for the main thread.
+    Process& thread_leader() { return m_thread_leader ? *m_thread_leader : *this; }
+    /// Whether the process, and all of its threads, have quit.
+    bool has_exited() const;
+
     // Basic properties.
     bek::string m_name;
     long m_pid;
@@ -121,29 +146,57 @@ private:
     // Child and Parent relations
     Process* m_parent;
     bek::vector<Process*> m_children;
+    /// Woken whenever a child quits.
+    WaitQueue m_child_waiters;
+
+    // Threads share the main thread's userspace state. Only the main thread has children, and it is only reaped
+    // (along with any unjoined threads) once every thread has quit.
+    Process* m_thread_leader{nullptr};
+    bek::vector<Process*> m_threads;
+    /// Woken whenever a thread quits.
+    WaitQueue m_thread_waiters;
+    /// Set when a thread ends the whole process.
+    bek::optional<int> m_group_exit_code;
 
     // Important State
     SavedRegisters m_saved_registers{};
     mem::VirtualRegion m_kernel_stack{};
 
-    struct UserspaceState {
+    struct UserspaceState : bek::RefCounted<UserspaceState> {
+        UserspaceState(mem::UserPtr user_stack_top, fs::EntryRef cwd, SpaceManager address_space_manager,
+                       bek::vector<LocalEntityHandle> open_entities)
+            : user_stack_top{user_stack_top},
+              cwd{bek::move(cwd)},
+              address_space_manager{bek::move(address_space_manager)},
+              open_entities{bek::move(open_entities)} {}
+
         mem::UserPtr user_stack_top;
         fs::EntryRef cwd;
         SpaceManager address_space_manager;
         bek::vector<LocalEntityHandle> open_entities;
     };
     // TODO: Lock these.
-    bek::optional<UserspaceState> m_userspace_state;
+    /// Shared between all threads of a process.
+    bek::shared_ptr<UserspaceState> m_userspace_state;
 
     // Scheduling Information
-    long m_processor_time_counter{1};
+    u8 m_priority{SCHED_DEFAULT_PRIORITY};
     int m_preempt_counter{0};
     ProcessState m_running_state;
+    /// Links the process into the run queue of its priority while runnable, but not running.
+    bek::IntrusiveListNode<Process> m_run_queue_node;
+    /// The queue the process is blocked on while Waiting.
+    WaitQueue* m_blocked_on{nullptr};
+    /// The CPU running the process, or whose run queue it is on. Otherwise, the one it last ran on.
+    u32 m_cpu{0};
+    /// Kernel lock depth to restore when switched back to. New processes drop the lock once on first entry.
+    u32 m_kernel_lock_depth{1};
 
     // Other Information
     bek::optional<int> m_exit_code;
 
     friend class ProcessManager;
+    friend class WaitQueue;
 };
 
 class ProcessManager {
@@ -164,6 +217,11 @@ public:
     bool schedule();
 
     Process& current_process();
+    /// Total time spent in the idle tasks, across all CPUs, since the scheduler started.
+    u64 idle_nanoseconds() const;
+
+    /// Makes the calling (secondary) CPU available for scheduling, running its idle task on kernel_stack.
+    [[noreturn]] void adopt_secondary_cpu(mem::VirtualRegion kernel_stack);
 
     ProcessManager(const ProcessManager&) = delete;
 
@@ -175,10 +233,52 @@ private:
     ProcessManager() = default;
     ErrorCode initialise_with_scheduling(bek::shared_ptr<Process> first_process);
     void switch_context(Process& process);
+    /// Runs when nothing else is runnable: does background work, then waits for an interrupt.
+    [[noreturn]] static void idle_loop(void*);
+
+    using RunQueue = bek::IntrusiveList<Process, &Process::m_run_queue_node>;
+    struct CpuState {
+        Process* current{nullptr};
+        /// Never on a run queue - only chosen when there is nothing to run or steal.
+        bek::shared_ptr<Process> idle{};
+        uSize last_nanoseconds{0};
+        u64 idle_nanoseconds{0};
+
+        /// Runnable processes, other than the current one.
+        RunQueue run_queues[SCHED_PRIORITY_LEVELS]{};
+        /// Bit n is set if run_queues[n] is non-empty.
+        u32 runnable_priorities{0};
+        u32 runnable_count{0};
+    };
+
+    CpuState& this_cpu() { return m_cpus[smp::current_cpu_id()]; }
+    const CpuState& this_cpu() const { return m_cpus[smp::current_cpu_id()]; }
+    /// The online CPU with the fewest runnable processes.
+    u32 least_loaded_cpu() const;
+    /// Whether any CPU has a process this one could run.
+    bool has_runnable() const;
+
+    /// Queues or dequeues process to match its state.
+    void update_run_queue(Process& process);
+    /// Queues process on its CPU, prodding that CPU if it should switch to it.
+    void enqueue(Process& process);
+    void dequeue(Process& process);
+    /// Takes the first process of the highest non-empty priority of cpu, or nullptr if it has nothing runnable.
+    static Process* dequeue_from(CpuState& cpu);
+    /// Takes the next local process, or else steals from the busiest CPU. nullptr if nothing is runnable.
+    Process* dequeue_next();
+
+    /// The time slice to give each process, sized so that everything runnable gets a turn within a fixed latency.
+    u64 preempt_quantum() const;
+    TimerDevice::CallbackAction on_preempt_tick();
 
     bek::vector<bek::shared_ptr<Process>> m_processes{};
-    Process* m_current{nullptr};
-    uSize m_last_nanoseconds;
+    CpuState m_cpus[smp::MAX_CPUS]{};
+    /// Only armed while a runnable process is waiting for a CPU - otherwise, nothing needs preempting.
+    timing::Timer m_preempt_timer{[](u64) { return ProcessManager::the().on_preempt_tick(); }};
+    deferred::WorkItem m_schedule_work{[] { ProcessManager::the().schedule(); }};
+
+    friend class Process;
 };
 
 #endif  // BEKOS_PROCESS_H
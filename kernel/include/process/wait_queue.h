@@ -0,0 +1,73 @@
+/*
+ * bekOS is a basic OS for the Raspberry Pi
+ * Copyright (C) 2025 Bekos Contributors
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef BEKOS_WAIT_QUEUE_H
+#define BEKOS_WAIT_QUEUE_H
+
+#include "interrupts/int_ctrl.h"
+#include "library/intrusive_list.h"
+
+class Process;
+
+/// Processes blocked until some event. Waiting processes are taken off the run queues entirely, and put back
+/// by wake_one or wake_all.
+class WaitQueue {
+public:
+    WaitQueue() = default;
+    WaitQueue(const WaitQueue&)            = delete;
+    WaitQueue& operator=(const WaitQueue&) = delete;
+
+    /// Blocks the current process until condition() holds. The condition is checked with interrupts disabled
+    /// once queued, so a wake-up between checking and sleeping is not lost.
+    /// \return false if given up because another thread has ended the process.
+    template <typename Fn>
+    [[nodiscard]] bool wait_until(Fn&& condition) {
+        while (true) {
+            Waiter waiter;
+            {
+                InterruptDisabler disabler;
+                if (condition()) return true;
+                if (current_must_exit()) return false;
+                enqueue_current(waiter);
+            }
+            sleep(waiter);
+        }
+    }
+
+    /// Wakes the longest-waiting process.
+    /// \return true if there was one.
+    bool wake_one();
+    void wake_all();
+    /// Takes process off whichever queue it waits on, so that its wait_until can notice it must exit.
+    static void interrupt(Process& process);
+
+private:
+    struct Waiter {
+        Process* process{nullptr};
+        bek::IntrusiveListNode<Waiter> node;
+    };
+
+    static bool current_must_exit();
+    void enqueue_current(Waiter& waiter);
+    /// Yields until woken, then makes sure waiter has left the queue.
+    void sleep(Waiter& waiter);
+
+    bek::IntrusiveList<Waiter, &Waiter::node> m_waiters;
+};
+
+#endif  // BEKOS_WAIT_QUEUE_H
@@ -17,6 +17,7 @@
 #include <process/interlink.h>
 
 #include "arch/a64/memory_constants.h"
+#include "arch/smp.h"
 #include "bek/array.h"
 #include "filesystem/block_device.h"
 #include "filesystem/fatfs.h"
@@ -122,6 +123,9 @@ bek::OutputStream* debug_stream  = nullptr;
 using DBG = DebugScope<"Kern", DebugLevel::INFO>;
 
 extern "C" [[noreturn]] void kernel_boot(u64 dev_tree_address) {
+    // 0. Everything from here on may want to know which CPU it's on.
+    smp::initialise_boot_cpu();
+
     // 1. Setup Debug UART
     PL011 uart{qemu_pl011_address, qemu_clock_freq};
     debug_stream = &uart;
@@ -150,8 +154,13 @@ extern "C" [[noreturn]] void kernel_boot(u64 dev_tree_address) {
 
     // 5. Using Physical map of space, initialise the memory manager.
     //  (a) Map all the physical memory, using embedded tables initially (and then PageAllocator itself!)
-    mem::MemoryManager::initialise(
-        memory_space, static_cast<u8*>(mem::kernel_phys_to_virt(mem::PhysicalPtr(g_current_embedded_table_phys))));
+    if (auto r = mem::MemoryManager::initialise(
+            memory_space,
+            static_cast<u8*>(mem::kernel_phys_to_virt(mem::PhysicalPtr(g_current_embedded_table_phys))));
+        r != ESUCCESS) {
+        DBG::errln("Failed to initialise memory manager: {}"_sv, r);
+        PANIC("Critical Startup Failure");
+    }
 
     // 6. Probe DeviceTree
     dev_tree::probe_nodes(dtb, bek::span{standard_probes.begin(), standard_probes.end()});
@@ -175,6 +184,9 @@ extern "C" [[noreturn]] void kernel_boot(u64 dev_tree_address) {
         DBG::errln("Failed to transition into process: {}"_sv, r);
     }
 
+    // 8.5. Bring up the other CPUs - they wait for the kernel lock until we first let go of it.
+    smp::start_secondary_cpus(dtb);
+
     // 9. Find block devices
     for (int tries = 0;; tries++) {
         auto mount_result = fs::FilesystemRegistry::try_mount_root();
@@ -218,8 +230,9 @@ extern "C" [[noreturn]] void kernel_boot(u64 dev_tree_address) {
 
     proc.set_state(ProcessState::Running);
 
+    // Nothing left for the kernel task to do - background work happens in the idle task.
+    ProcessManager::the().current_process().set_state(ProcessState::Stopped);
     while (true) {
-        DBG::dbgln("Noot"_sv);
-        timing::spindelay_us(10'000'000);
+        ProcessManager::the().schedule();
     }
 }
\ No newline at end of file
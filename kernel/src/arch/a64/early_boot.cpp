@@ -29,9 +29,10 @@ extern "C" {
 extern uPtr g_current_embedded_table_phys;
 }
 
-#define PT_NORMAL_RE (ReadOnly | AF | (MAIR_NORMAL_NC_INDEX << 2))
-#define PT_NORMAL_RW (PrivilegedExecuteNever | AF | (MAIR_NORMAL_NC_INDEX << 2))
-#define PT_NORMAL_RO (ReadOnly | PrivilegedExecuteNever | AF | (MAIR_NORMAL_NC_INDEX << 2))
+#define PT_NORMAL_RE (ReadOnly | AF | InnerShareable | (MAIR_NORMAL_WB_INDEX << 2))
+#define PT_NORMAL_RW (PrivilegedExecuteNever | AF | InnerShareable | (MAIR_NORMAL_WB_INDEX << 2))
+#define PT_NORMAL_RO \
+    (ReadOnly | PrivilegedExecuteNever | AF | InnerShareable | (MAIR_NORMAL_WB_INDEX << 2))
 #define PT_DEVICE (AF | (MAIR_DEVICE_nGnRnE_INDEX << 2))
 
 uSize devtree_mapping_size(uPtr device_tree_address) {
@@ -115,6 +116,15 @@ extern "C" i64 setup_early_tables(uPtr load_address, uPtr device_tree_address) {
     *reinterpret_cast<uPtr*>(kptr_phys((uPtr)&g_current_embedded_table_phys, load_address)) =
         pgtable_current;
 
+    // The tables were written with the caches off, but will be walked as cacheable memory: make
+    // sure no stale lines shadow them.
+    u64 ctr_reg;
+    asm volatile("mrs %0, ctr_el0" : "=r"(ctr_reg));
+    uSize line_sz = 4 << ((ctr_reg >> 16) & 0xF);
+    for (uPtr line = pgtables_start; line < pgtable_current; line += line_sz) {
+        asm volatile("dc ivac, %0" : : "r"(line) : "memory");
+    }
+
     // Get AArch64 Memory Model Feature Register 0
     u64 a64_mem_feature_reg;
     asm volatile("mrs %0, id_aa64mmfr0_el1" : "=r"(a64_mem_feature_reg));
@@ -125,6 +135,10 @@ extern "C" i64 setup_early_tables(uPtr load_address, uPtr device_tree_address) {
 
     u64 physical_addr_size_tag = a64_mem_feature_reg & 0xF;
     u64 tcr_value              = TCR_VALUE(physical_addr_size_tag);
+    // Use 16-bit ASIDs where supported, so that address spaces rarely need to share the TLB.
+    if (((a64_mem_feature_reg >> 4) & 0xF) == 0b0010) {
+        tcr_value |= TCR_ASID_ENABLE;
+    }
 
     asm volatile("msr mair_el1, %0" : : "r"(MAIR_VALUE));
     // Insert an ISB in case the TTBR registers care about addr space settings.
@@ -134,6 +148,6 @@ extern "C" i64 setup_early_tables(uPtr load_address, uPtr device_tree_address) {
     asm volatile("msr ttbr0_el1, %0" : : "r"(pgtables_start | 1));
     asm volatile("msr ttbr1_el1, %0" : : "r"(pgtables_start | 1));
 
-    asm volatile("dsb ish; isb");
+    asm volatile("dsb ish; tlbi vmalle1; dsb ish; isb");
     return 0;
 }
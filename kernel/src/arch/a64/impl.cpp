@@ -17,6 +17,7 @@
  */
 
 #include "mm/addresses.h"
+#include "mm/cache.h"
 #include "mm/dma_utils.h"
 
 extern "C" {
@@ -43,7 +44,11 @@ void* mem::kernel_phys_to_virt(mem::PhysicalPtr ptr) {
     }
 }
 
-u64 get_cache_line_size() {
+void* mem::kernel_phys_to_uncached(mem::PhysicalPtr ptr) {
+    return reinterpret_cast<void*>(ptr.get() + VA_DMA_OFFSET);
+}
+
+uSize mem::cache_line_size() {
     // CTR_EL0 - §D13.2.34
     u64 ctr_reg;
     asm("mrs %0, CTR_EL0" : "=r"(ctr_reg));
@@ -53,24 +58,59 @@ u64 get_cache_line_size() {
 extern "C" {
 void asm_arm64_clean_cache(u64 start, u64 end, u64 line_sz);
 void asm_arm64_invalidate_cache(u64 start, u64 end, u64 line_sz);
+void asm_arm64_clean_invalidate_cache(u64 start, u64 end, u64 line_sz);
+void asm_arm64_sync_icache(u64 start, u64 end, u64 line_sz);
 }
 
-// FIXME: When aligning, could invalidate some memory still to be written.
 void mem::dma_sync_before_read(const void* ptr, uSize size) {
-    auto line_sz = get_cache_line_size();
+    if (!size) return;
+    auto line_sz = cache_line_size();
 
-    // Align start downwards
-    uPtr start = reinterpret_cast<uPtr>(ptr) & (1 - line_sz);
-    // Want to align up.
-    uPtr end = (reinterpret_cast<uPtr>(ptr) + size + line_sz - 1) & (1 - line_sz);
-    asm_arm64_invalidate_cache(start, end, line_sz);
+    uPtr start = reinterpret_cast<uPtr>(ptr);
+    uPtr end   = start + size;
+    // Align start downwards, and end upwards.
+    uPtr aligned_start = start & ~(line_sz - 1);
+    uPtr aligned_end   = (end + line_sz - 1) & ~(line_sz - 1);
+
+    // Partially covered lines may hold unrelated data, which must be written back rather than lost.
+    if (aligned_start != start) {
+        asm_arm64_clean_invalidate_cache(aligned_start, aligned_start + line_sz, line_sz);
+        aligned_start += line_sz;
+    }
+    if (aligned_end != end && aligned_end > aligned_start) {
+        asm_arm64_clean_invalidate_cache(aligned_end - line_sz, aligned_end, line_sz);
+        aligned_end -= line_sz;
+    }
+    if (aligned_start < aligned_end) {
+        asm_arm64_invalidate_cache(aligned_start, aligned_end, line_sz);
+    }
 }
+
 void mem::dma_sync_after_write(const void* ptr, uSize size) {
-    auto line_sz = get_cache_line_size();
+    if (!size) return;
+    auto line_sz = cache_line_size();
 
     // Align start downwards
-    uPtr start = reinterpret_cast<uPtr>(ptr) & (1 - line_sz);
+    uPtr start = reinterpret_cast<uPtr>(ptr) & ~(line_sz - 1);
     // Want to align up.
-    uPtr end = (reinterpret_cast<uPtr>(ptr) + size + line_sz - 1) & (1 - line_sz);
+    uPtr end = (reinterpret_cast<uPtr>(ptr) + size + line_sz - 1) & ~(line_sz - 1);
     asm_arm64_clean_cache(start, end, line_sz);
 }
+
+void mem::dma_flush_cache(const void* ptr, uSize size) {
+    if (!size) return;
+    auto line_sz = cache_line_size();
+
+    uPtr start = reinterpret_cast<uPtr>(ptr) & ~(line_sz - 1);
+    uPtr end   = (reinterpret_cast<uPtr>(ptr) + size + line_sz - 1) & ~(line_sz - 1);
+    asm_arm64_clean_invalidate_cache(start, end, line_sz);
+}
+
+void mem::sync_instruction_cache(const void* ptr, uSize size) {
+    if (!size) return;
+    auto line_sz = cache_line_size();
+
+    uPtr start = reinterpret_cast<uPtr>(ptr) & ~(line_sz - 1);
+    uPtr end   = reinterpret_cast<uPtr>(ptr) + size;
+    asm_arm64_sync_icache(start, end, line_sz);
+}
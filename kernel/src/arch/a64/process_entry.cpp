@@ -28,4 +28,5 @@ extern "C" void handle_syscall_a64(InterruptContext& ctx) {
     } else {
         ctx.set_return_value(-result.error());
     }
+    ProcessManager::the().current_process().exit_if_requested();
 }
@@ -59,3 +59,21 @@ SavedRegisters SavedRegisters::create_for_return_from_fork(const InterruptContex
     regs.el0_sp = current_user_stack;
     return regs;
 }
+
+SavedRegisters SavedRegisters::create_for_user_thread(uPtr user_entry, u64 argument, void* kernel_stack_top,
+                                                      uPtr user_stack) {
+    // Enter through ret_from_fork, as if returning from an exception taken at user_entry.
+    uPtr kernel_stack_pushed = reinterpret_cast<uPtr>(kernel_stack_top) - sizeof(InterruptContext);
+    auto& new_ctx = *reinterpret_cast<InterruptContext*>(kernel_stack_pushed);
+    new_ctx = {};
+    new_ctx.x[0] = argument;
+    new_ctx.sp_el0 = user_stack;
+    new_ctx.elr_el1 = user_entry;
+    new_ctx.spsr_el1 = 0;  // EL0t, with interrupts unmasked.
+
+    SavedRegisters regs{};
+    regs.sp = kernel_stack_pushed;
+    regs.lr = reinterpret_cast<uPtr>(ret_from_fork_a64);
+    regs.el0_sp = user_stack;
+    return regs;
+}
@@ -0,0 +1,266 @@
+/*
+ * bekOS is a basic OS for the Raspberry Pi
+ * Copyright (C) 2025 Bekos Contributors
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "arch/smp.h"
+
+#include "interrupts/int_ctrl.h"
+#include "library/debug.h"
+#include "mm/dma_utils.h"
+#include "mm/page_allocator.h"
+#include "peripherals/arm/psci.h"
+#include "peripherals/interrupt_controller.h"
+#include "peripherals/timer.h"
+#include "process/process.h"
+
+using DBG = DebugScope<"SMP", DebugLevel::INFO>;
+
+extern InterruptController* global_intc;
+
+// boot.S: entry point for secondary CPUs, at its physical address with the MMU off.
+extern "C" u8 _secondary_start;
+
+namespace {
+
+constexpr u32 NO_OWNER = ~0u;
+/// Affinity fields of MPIDR_EL1 - the rest are flags.
+constexpr u64 MPIDR_AFFINITY_MASK = 0xFF'00FF'FFFF;
+constexpr uSize SECONDARY_STACK_PAGES = 3;
+
+struct CpuData {
+    u64 mpidr;
+    bool online;
+    bool reschedule_requested;
+    /// How many times this CPU has taken the kernel lock.
+    u32 kernel_lock_depth;
+};
+
+/// Handed to a secondary CPU in x0. It is read with the MMU off - see boot.S for the offsets.
+struct SecondaryBootInfo {
+    u64 mair;
+    u64 tcr;
+    u64 ttbr;
+    u64 stack_top;
+    /// Virtual address of this structure.
+    u64 self;
+    u64 cpu_id;
+};
+static_assert(__builtin_offsetof(SecondaryBootInfo, mair) == 0);
+static_assert(__builtin_offsetof(SecondaryBootInfo, tcr) == 8);
+static_assert(__builtin_offsetof(SecondaryBootInfo, ttbr) == 16);
+static_assert(__builtin_offsetof(SecondaryBootInfo, stack_top) == 24);
+static_assert(__builtin_offsetof(SecondaryBootInfo, self) == 32);
+static_assert(__builtin_offsetof(SecondaryBootInfo, cpu_id) == 40);
+
+CpuData g_cpus[smp::MAX_CPUS]{};
+SecondaryBootInfo g_boot_info[smp::MAX_CPUS]{};
+mem::VirtualRegion g_secondary_stacks[smp::MAX_CPUS]{};
+u32 g_kernel_lock_owner = NO_OWNER;
+
+u64 read_mpidr() {
+    u64 mpidr;
+    asm volatile("mrs %0, mpidr_el1" : "=r"(mpidr));
+    return mpidr & MPIDR_AFFINITY_MASK;
+}
+
+ErrorCode start_cpu(u32 cpu_id, u64 mpidr) {
+    auto stack = mem::PageAllocator::the().allocate_region(SECONDARY_STACK_PAGES);
+    if (!stack) return ENOMEM;
+
+    auto& info = g_boot_info[cpu_id];
+    // The secondary CPU shares the kernel's translation tables and settings. The kernel root table still holds
+    // the identity mapping of the kernel image from early boot, so it serves as TTBR0 while the MMU comes on.
+    asm volatile("mrs %0, mair_el1" : "=r"(info.mair));
+    asm volatile("mrs %0, tcr_el1" : "=r"(info.tcr));
+    asm volatile("mrs %0, ttbr1_el1" : "=r"(info.ttbr));
+    info.stack_top = reinterpret_cast<uPtr>(stack->end().get());
+    info.self      = reinterpret_cast<uPtr>(&info);
+    info.cpu_id    = cpu_id;
+    mem::dma_flush_cache(&info, sizeof(info));
+
+    g_cpus[cpu_id].mpidr       = mpidr;
+    g_secondary_stacks[cpu_id] = *stack;
+
+    auto entry     = mem::kernel_virt_to_phys(&_secondary_start);
+    auto info_phys = mem::kernel_virt_to_phys(&info);
+    VERIFY(entry && info_phys);
+    if (auto r = psci::cpu_on(mpidr, *entry, info_phys->get()); r != ESUCCESS) {
+        mem::PageAllocator::the().free_region(stack->start);
+        return r;
+    }
+    return ESUCCESS;
+}
+
+}  // namespace
+
+u32 smp::current_cpu_id() {
+    u64 id;
+    asm volatile("mrs %0, tpidr_el1" : "=r"(id));
+    return static_cast<u32>(id);
+}
+
+bool smp::is_online(u32 cpu) { return cpu < MAX_CPUS && g_cpus[cpu].online; }
+
+u32 smp::online_count() {
+    u32 count = 0;
+    for (auto& cpu : g_cpus) {
+        if (cpu.online) count++;
+    }
+    return count;
+}
+
+void smp::initialise_boot_cpu() {
+    asm volatile("msr tpidr_el1, %0" : : "r"(0ul));
+    g_cpus[0].mpidr  = read_mpidr();
+    g_cpus[0].online = true;
+    // The boot CPU holds the kernel lock until it first leaves the kernel.
+    g_kernel_lock_owner         = 0;
+    g_cpus[0].kernel_lock_depth = 1;
+}
+
+ErrorCode smp::start_secondary_cpus(const dev_tree::device_tree& tree) {
+    if (auto r = psci::initialise(tree); r != ESUCCESS) {
+        DBG::infoln("No PSCI ({}), so only using the boot CPU."_sv, r);
+        return r;
+    }
+    VERIFY(global_intc);
+
+    dev_tree::Node* cpus_node = nullptr;
+    for (auto& child : tree.root_node->children) {
+        if (child->name == "cpus"_sv) {
+            cpus_node = child.get();
+            break;
+        }
+    }
+    if (!cpus_node) return ENODEV;
+
+    global_intc->register_handler(RESCHEDULE_SGI, InterruptHandler{[] {
+                                      g_cpus[current_cpu_id()].reschedule_requested = true;
+                                  }});
+    global_intc->enable_interrupt(RESCHEDULE_SGI);
+    global_intc->register_handler(TIMER_SGI, InterruptHandler{[] { timing::reprogram(); }});
+    global_intc->enable_interrupt(TIMER_SGI);
+
+    auto address_cells = dev_tree::get_property_u32(*cpus_node, "#address-cells"_sv).value_or(1);
+    u32 next_cpu_id    = 1;
+    for (auto& cpu_node : cpus_node->children) {
+        auto device_type = cpu_node->get_property("device_type"_sv);
+        if (!device_type) continue;
+        auto type_strings = dev_tree::parse_stringlist(*device_type);
+        if (type_strings.size() == 0 || type_strings[0] != "cpu"_sv) continue;
+        auto reg = cpu_node->get_property("reg"_sv);
+        if (!reg) continue;
+        u32 offset = 0;
+        auto mpidr = dev_tree::read_from_buffer(*reg, offset, address_cells) & MPIDR_AFFINITY_MASK;
+        if (mpidr == g_cpus[0].mpidr) continue;
+
+        if (next_cpu_id >= MAX_CPUS) {
+            DBG::warnln("Ignoring CPUs beyond the first {}."_sv, MAX_CPUS);
+            break;
+        }
+        if (auto r = start_cpu(next_cpu_id, mpidr); r == ESUCCESS) {
+            DBG::infoln("Starting CPU {} (MPIDR {:Xl})."_sv, next_cpu_id, mpidr);
+            next_cpu_id++;
+        } else {
+            DBG::warnln("Could not start CPU with MPIDR {:Xl}: {}"_sv, mpidr, r);
+        }
+    }
+    return ESUCCESS;
+}
+
+void smp::request_reschedule(u32 cpu) {
+    if (cpu == current_cpu_id() || !is_online(cpu)) return;
+    global_intc->send_software_interrupt(cpu, RESCHEDULE_SGI);
+}
+
+void smp::request_reschedule_others() {
+    for (u32 cpu = 0; cpu < MAX_CPUS; cpu++) {
+        request_reschedule(cpu);
+    }
+}
+
+bool smp::take_reschedule_request() {
+    InterruptDisabler disabler;
+    return bek::exchange(g_cpus[current_cpu_id()].reschedule_requested, false);
+}
+
+u32 smp::exchange_kernel_lock_depth(u32 depth) {
+    VERIFY(depth);
+    return bek::exchange(g_cpus[current_cpu_id()].kernel_lock_depth, depth);
+}
+
+u32 smp::kernel_lock_release_all() {
+    auto& cpu  = g_cpus[current_cpu_id()];
+    auto depth = bek::exchange(cpu.kernel_lock_depth, 1u);
+    kernel_lock_release();
+    return depth;
+}
+
+void smp::kernel_lock_reacquire(u32 depth) {
+    kernel_lock_acquire();
+    g_cpus[current_cpu_id()].kernel_lock_depth = depth;
+}
+
+extern "C" void kernel_lock_acquire() {
+    auto id   = smp::current_cpu_id();
+    auto& cpu = g_cpus[id];
+    // Only we can make ourselves the owner, so no ordering is needed to check.
+    if (__atomic_load_n(&g_kernel_lock_owner, __ATOMIC_RELAXED) == id) {
+        cpu.kernel_lock_depth++;
+        return;
+    }
+    // Between taking ownership and recording the depth, an interrupt handler's nested acquire and release
+    // would see a depth of zero and hand the lock back, so mask interrupts around the two. They stay
+    // enabled while spinning - the current owner may be waiting on an interrupt delivered here.
+    while (true) {
+        {
+            InterruptDisabler disabler;
+            u32 expected = NO_OWNER;
+            if (__atomic_compare_exchange_n(&g_kernel_lock_owner, &expected, id, false, __ATOMIC_ACQUIRE,
+                                            __ATOMIC_RELAXED)) {
+                cpu.kernel_lock_depth = 1;
+                return;
+            }
+        }
+        asm volatile("yield");
+    }
+}
+
+extern "C" void kernel_lock_release() {
+    auto id   = smp::current_cpu_id();
+    auto& cpu = g_cpus[id];
+    VERIFY(g_kernel_lock_owner == id && cpu.kernel_lock_depth);
+    // As in kernel_lock_acquire, an interrupt between the decrement and the store must not see us at depth zero.
+    InterruptDisabler disabler;
+    if (--cpu.kernel_lock_depth == 0) {
+        __atomic_store_n(&g_kernel_lock_owner, NO_OWNER, __ATOMIC_RELEASE);
+    }
+}
+
+extern "C" [[noreturn]] void secondary_kernel_boot(SecondaryBootInfo* info) {
+    auto cpu_id = static_cast<u32>(info->cpu_id);
+    asm volatile("msr tpidr_el1, %0" : : "r"(info->cpu_id));
+    do_set_vector_table();
+
+    kernel_lock_acquire();
+    global_intc->initialise_secondary_cpu();
+    global_intc->enable_interrupt(smp::RESCHEDULE_SGI);
+    g_cpus[cpu_id].online = true;
+    DBG::infoln("CPU {} online."_sv, cpu_id);
+
+    ProcessManager::the().adopt_secondary_cpu(g_secondary_stacks[cpu_id]);
+}
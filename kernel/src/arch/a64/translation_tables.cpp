@@ -18,6 +18,7 @@
 
 #include <arch/a64/translation_tables.h>
 
+#include "arch/smp.h"
 #include "library/debug.h"
 #include "mm/page_allocator.h"
 
@@ -35,6 +36,8 @@ using DBG = DebugScope<"PGTBL", DebugLevel::WARN>;
 
 #define PT_INDEX_MASK (512 - 1)
 #define PT_ENTRY_COUNT (512)
+// Number of adjacent L3 entries covered by one contiguous-hint TLB entry (64KiB with 4KiB pages).
+#define PT_CONTIGUOUS_ENTRIES (16)
 
 #define PT_UPPER_BLOCK_DESCRIPTOR (0b01)
 #define PT_UPPER_TABLE_DESCRIPTOR (0b11)
@@ -45,11 +48,64 @@ constexpr inline uSize SHIFTS[] = {39, 30, 21, 12};
 constexpr inline uSize SIZES[]  = {1ull << 39, 1ull << 30, 1ull << 21, 1ull << 12};
 
 #define PAGE_OFFSET_MASK ((1ul << 12) - 1)
+#define PT_ADDRESS_MASK (0x0000FFFFFFFFF000ul)
+#define PT_DESCRIPTOR_MASK (0b11ul)
+
+// Beyond this many bytes, invalidating the whole TLB is cheaper than going page by page.
+#define TLBI_RANGE_LIMIT (64ul * PAGE_SIZE)
+// TLBI by VA takes VA[55:12] in bits [43:0].
+#define TLBI_VA_MASK ((1ul << 44) - 1)
+// TLBI and TTBR0 both take the ASID in bits [63:48].
+#define ASID_SHIFT (48)
+// TLBI by range (FEAT_TLBIRANGE) covers (NUM + 1) * 2^(5 * SCALE + 1) pages from BaseADDR = VA[48:12].
+#define TLBI_RANGE_TG_4K (1ul << 46)
+#define TLBI_RANGE_SCALE_SHIFT (44)
+#define TLBI_RANGE_NUM_SHIFT (39)
+#define TLBI_RANGE_MAX_NUM (32ul)
+#define TLBI_RANGE_ADDR_MASK ((1ul << 37) - 1)
+// Span of the largest single range operation. Beyond it, invalidating the whole ASID is cheaper.
+#define TLBI_RANGE_MAX_SIZE (TLBI_RANGE_MAX_NUM << (5 * 3 + 1 + PAGE_SHIFT))
+
+// ASIDs are handed out in generations. When they run out, the whole TLB is flushed and each address
+// space takes a fresh ASID on its next activation. The first activation starts a generation, which
+// also flushes any global entries for the boot-time lower-half mappings.
+//
+// A CPU keeps running its current address space across a rollover, and keeps filling the TLB with
+// entries for its ASID. So the ASIDs active on each CPU are reserved: they stay allocated in the new
+// generation, and an address space holding one keeps it - including when another CPU activates it, as
+// threads of one process do.
+static constexpr u32 MAX_ASIDS = 1u << 16;
+static u64 g_asid_generation = 0;
+static u32 g_next_asid       = 0;
+/// ASIDs allocated in the current generation.
+static u64 g_asids_in_use[MAX_ASIDS / 64];
+/// Context (generation and ASID) each CPU activated since the last rollover, or 0 if none.
+static u64 g_active_contexts[smp::MAX_CPUS];
+/// Context each CPU was running at the last rollover, which it may still be using.
+static u64 g_reserved_contexts[smp::MAX_CPUS];
+
+/// Root table with no entries. ASID 0 is never given to a user address space, so nothing is cached under it.
+alignas(PAGE_SIZE) static u8 g_empty_user_table[PAGE_SIZE];
+
+static constexpr u64 make_context(u64 generation, u16 asid) { return (generation << 16) | asid; }
+static void mark_asid_in_use(u32 asid) { g_asids_in_use[asid / 64] |= 1ul << (asid % 64); }
+static bool asid_in_use(u32 asid) { return g_asids_in_use[asid / 64] & (1ul << (asid % 64)); }
 
 extern "C" {
 extern u8 __initial_pgtables_start, __initial_pgtables_end;
 }
 
+/// Whether TLBI by range is implemented (ID_AA64ISAR0_EL1.TLB == 0b0010).
+static bool tlbi_range_supported() {
+    static int supported = -1;
+    if (supported < 0) {
+        u64 isar0;
+        asm volatile("mrs %0, id_aa64isar0_el1" : "=r"(isar0));
+        supported = ((isar0 >> 56) & 0xF) >= 2;
+    }
+    return supported;
+}
+
 /*
 
 bool CrudeTableManager::map_region(uPtr virtual_address, uPtr phys_address, uSize size,
@@ -87,6 +143,14 @@ struct [[gnu::packed]] ARMv8MMU_L3_Entry {
 
     static constexpr ARMv8MMU_L3_Entry create_null() { return {}; }
 
+    // upper_attrs starts at bit 51.
+    constexpr bool contiguous() const { return upper_attrs & (Contiguous >> 51); }
+    constexpr ARMv8MMU_L3_Entry without_contiguous() const {
+        auto entry = *this;
+        entry.upper_attrs &= ~(Contiguous >> 51);
+        return entry;
+    }
+
     friend bool operator==(ARMv8MMU_L3_Entry a, ARMv8MMU_L3_Entry b) = default;
 };
 
@@ -178,28 +242,126 @@ bool crude_map_region(uPtr virt_addr, uPtr phys_addr, uSize size, u64 flags, uPt
     return true;
 }
 
-TableManager::TableManager(u8* current_embedded_table, u8* root_table)
-    : m_embedded_tables_current(current_embedded_table), m_root_table(root_table) {}
+TableManager::TableManager(u8* current_embedded_table, u8* root_table, bool global)
+    : m_embedded_tables_current(current_embedded_table), m_root_table(root_table), m_global(global) {}
 bool TableManager::map_region(uPtr virt_start, uPtr phys_start, uSize size, PageAttributes attrs,
                               MemAttributeIndex attr_idx) {
     VERIFY(m_root_table);
     // Check properly aligned to page.
     if (virt_start & PAGE_OFFSET_MASK || phys_start & PAGE_OFFSET_MASK || size & PAGE_OFFSET_MASK)
         return false;
-    return map_upper(m_root_table, virt_start, phys_start, size, static_cast<u64>(attrs) | (attr_idx << 2), L0);
+    u64 flags = static_cast<u64>(attrs) | (attr_idx << 2);
+    // Normal memory is shared between all cores (device memory is always outer shareable).
+    if (attr_idx != MMIO) flags |= InnerShareable;
+    return map_upper(m_root_table, virt_start, phys_start, size, flags, L0);
 }
 
 bool TableManager::unmap_region(uPtr virt_start, uSize size) {
     VERIFY(m_root_table);
     // Check properly aligned to page.
     if (virt_start & PAGE_OFFSET_MASK || size & PAGE_OFFSET_MASK) return false;
-    auto b = unmap_upper(m_root_table, virt_start, size, L0);
+    uPtr region_start = virt_start;
+    uSize region_size = size;
+    auto b            = unmap_upper(m_root_table, virt_start, size, L0);
     if (!b) {
-        DBG::dbgln("Failed to unmap region {:Xl} (size {})"_sv, virt_start, size);
+        DBG::dbgln("Failed to unmap region {:Xl} (size {})"_sv, region_start, region_size);
+    }
+    if (m_pending_free_tables) {
+        // Walk-cache entries for an unhooked table may have been made through any address it covered, not
+        // just those in the region (e.g. untouched pages of the same 2MiB span), so drop them all before
+        // the tables can be reused.
+        invalidate_tlb_all();
+    } else {
+        // One invalidation for the whole region.
+        invalidate_tlb(region_start, region_size);
     }
+    free_pending_tables();
     return b;
 }
 
+void TableManager::invalidate_tlb(uPtr virt_start, uSize size) {
+    // Make table updates visible to the walker before invalidating.
+    asm volatile("dsb ishst" ::: "memory");
+    if (m_global) {
+        if (size > TLBI_RANGE_LIMIT) {
+            asm volatile("tlbi vmalle1is" ::: "memory");
+        } else {
+            for (uPtr va = virt_start; va < virt_start + size; va += PAGE_SIZE) {
+                asm volatile("tlbi vaae1is, %0" : : "r"((va >> PAGE_SHIFT) & TLBI_VA_MASK) : "memory");
+            }
+        }
+    } else if (m_asid_generation != 0) {
+        // Only entries tagged with our ASID can be stale. Even if it is from an old generation, another CPU
+        // may still be running us with it reserved.
+        u64 asid_bits = static_cast<u64>(m_asid) << ASID_SHIFT;
+        if (size <= TLBI_RANGE_MAX_SIZE && tlbi_range_supported()) {
+            invalidate_tlb_range(asid_bits, virt_start, size / PAGE_SIZE);
+        } else if (size > TLBI_RANGE_LIMIT) {
+            asm volatile("tlbi aside1is, %0" : : "r"(asid_bits) : "memory");
+        } else {
+            for (uPtr va = virt_start; va < virt_start + size; va += PAGE_SIZE) {
+                asm volatile("tlbi vae1is, %0" : : "r"(asid_bits | ((va >> PAGE_SHIFT) & TLBI_VA_MASK)) : "memory");
+            }
+        }
+    }
+    asm volatile("dsb ish; isb" ::: "memory");
+}
+
+void TableManager::invalidate_tlb_all() {
+    asm volatile("dsb ishst" ::: "memory");
+    if (m_global) {
+        asm volatile("tlbi vmalle1is" ::: "memory");
+    } else if (m_asid_generation != 0) {
+        asm volatile("tlbi aside1is, %0" : : "r"(static_cast<u64>(m_asid) << ASID_SHIFT) : "memory");
+    }
+    asm volatile("dsb ish; isb" ::: "memory");
+}
+
+void TableManager::invalidate_tlb_range(u64 asid_bits, uPtr virt_start, uSize pages) {
+    while (pages) {
+        if (pages == 1) {
+            // A range covers at least two pages.
+            asm volatile("tlbi vae1is, %0" : : "r"(asid_bits | ((virt_start >> PAGE_SHIFT) & TLBI_VA_MASK)) : "memory");
+            return;
+        }
+        // Use the largest unit which fits, as many times as one operation allows.
+        u64 scale = 3;
+        while ((pages >> (5 * scale + 1)) == 0) scale--;
+        uSize unit_pages = 1ul << (5 * scale + 1);
+        uSize units      = bek::min(pages / unit_pages, TLBI_RANGE_MAX_NUM);
+        u64 operand      = asid_bits | TLBI_RANGE_TG_4K | (scale << TLBI_RANGE_SCALE_SHIFT) |
+                      ((units - 1) << TLBI_RANGE_NUM_SHIFT) | ((virt_start >> PAGE_SHIFT) & TLBI_RANGE_ADDR_MASK);
+        // TLBI RVAE1IS, spelt out so the assembler needn't know about ARMv8.4.
+        asm volatile("sys #0, c8, c2, #1, %0" : : "r"(operand) : "memory");
+        virt_start += units * unit_pages * PAGE_SIZE;
+        pages -= units * unit_pages;
+    }
+}
+
+u8* TableManager::split_block(ARMv8MMU_UpperEntry& entry, uPtr block_start, TableLevel level) {
+    VERIFY(level == L1 || level == L2);
+    uPtr phys_start = entry.raw & PT_ADDRESS_MASK;
+    u64 flags       = entry.raw & ~(PT_ADDRESS_MASK | PT_DESCRIPTOR_MASK);
+
+    u8* table = allocate_table();
+    for (uSize i = 0; i < PT_ENTRY_COUNT; i++) {
+        auto entry_phys = phys_start + i * SIZES[level + 1];
+        if (level == L2) {
+            // The block was physically contiguous, so every aligned group of pages is too.
+            reinterpret_cast<ARMv8MMU_L3_Entry*>(table)[i] = ARMv8MMU_L3_Entry::create(entry_phys, flags | Contiguous);
+        } else {
+            reinterpret_cast<ARMv8MMU_UpperEntry*>(table)[i] =
+                ARMv8MMU_UpperEntry::create_block_entry(entry_phys, flags);
+        }
+    }
+
+    // Break-before-make: the block must be gone from the TLBs before the table replaces it.
+    entry = ARMv8MMU_UpperEntry::create_null();
+    invalidate_tlb(block_start, SIZES[level]);
+    entry = ARMv8MMU_UpperEntry::create_table_entry(*mem::kernel_virt_to_phys(table));
+    return table;
+}
+
 bool TableManager::map_upper(u8* table, uPtr& virt_start, uPtr& phys_start, uSize& size, u64 flags,
                              TableLevel level) {
     VERIFY(level != L3);
@@ -249,12 +411,20 @@ bool TableManager::map_lower(u8* table, uPtr& virt_start, uPtr& phys_start, uSiz
                              u64 flags) {
     auto* tbl = reinterpret_cast<ARMv8MMU_L3_Entry*>(table);
     auto idx  = (virt_start >> SHIFTS[L3]) & PT_INDEX_MASK;
+    // Remaining entries of the current contiguous-hint group.
+    uSize hinted_entries = 0;
     for (; idx < PT_ENTRY_COUNT && size > 0; idx++) {
-        auto new_entry = ARMv8MMU_L3_Entry::create(phys_start, flags);
-        if (tbl[idx].descriptor_code != PT_INVALID_DESCRIPTOR && tbl[idx] != new_entry) {
-            return false;
+        if (hinted_entries == 0 && can_map_contiguous(&tbl[idx], idx, phys_start, size)) {
+            hinted_entries = PT_CONTIGUOUS_ENTRIES;
+        }
+        auto new_entry = ARMv8MMU_L3_Entry::create(phys_start, hinted_entries ? (flags | Contiguous) : flags);
+        if (hinted_entries) hinted_entries--;
+        if (tbl[idx].descriptor_code != PT_INVALID_DESCRIPTOR) {
+            // Re-mapping the same page is fine, but must not disturb the hint of its group.
+            if (tbl[idx].without_contiguous() != new_entry.without_contiguous()) return false;
+        } else {
+            tbl[idx] = new_entry;
         }
-        tbl[idx] = new_entry;
         phys_start += SIZES[L3];
         virt_start += SIZES[L3];
         size -= SIZES[L3];
@@ -273,10 +443,10 @@ bool TableManager::unmap_upper(u8* table, uPtr& virt_start, uSize& size, TableLe
 
         if (entry_kind == PT_UPPER_TABLE_DESCRIPTOR) {
             next_table = (u8*)mem::kernel_phys_to_virt(PhysPtr{tbl[idx].table.table_page << PAGE_SHIFT});
-            // If spans whole range of entry, remove that table.
+            // If spans whole range of entry, remove that table (and any below it).
             if ((virt_start & (SIZES[level] - 1)) == 0 && size >= SIZES[level]) {
                 tbl[idx] = ARMv8MMU_UpperEntry::create_null();
-                free_table(next_table);
+                release_table_tree(next_table, static_cast<TableLevel>(level + 1));
                 virt_start += SIZES[level];
                 size -= SIZES[level];
                 continue;
@@ -286,15 +456,20 @@ bool TableManager::unmap_upper(u8* table, uPtr& virt_start, uSize& size, TableLe
             // If spans whole block, simple!
             if ((virt_start & (SIZES[level] - 1)) == 0 && size >= SIZES[level]) {
                 tbl[idx] = ARMv8MMU_UpperEntry::create_null();
+                virt_start += SIZES[level];
+                size -= SIZES[level];
                 continue;
             } else {
-                // Does not span whole block - needs to free individual entries within block.
-                // TODO: Need to do a complex thing.
-                return false;
+                // Does not span whole block - split it into a table, and unmap within that.
+                next_table = split_block(tbl[idx], virt_start & ~(SIZES[level] - 1), level);
             }
         } else {
-            // Trying to unmap non-mapped region.
-            return false;
+            // Nothing mapped here (e.g. lazily-populated memory) - skip over this entry.
+            auto step = SIZES[level] - (virt_start & (SIZES[level] - 1));
+            step      = bek::min(step, size);
+            virt_start += step;
+            size -= step;
+            continue;
         }
 
         if (level == L2) {
@@ -305,12 +480,28 @@ bool TableManager::unmap_upper(u8* table, uPtr& virt_start, uSize& size, TableLe
             auto res = unmap_upper(next_table, virt_start, size, static_cast<TableLevel>(level + 1));
             if (!res) return false;
         }
+
+        // The table may have had its last mapping removed.
+        if (table_is_empty(next_table)) {
+            tbl[idx] = ARMv8MMU_UpperEntry::create_null();
+            release_table_tree(next_table, static_cast<TableLevel>(level + 1));
+        }
     }
     return true;
 }
 bool TableManager::unmap_lower(u8* table, uPtr& virt_start, uSize& size) {
     auto* tbl = reinterpret_cast<ARMv8MMU_L3_Entry*>(table);
     auto idx = (virt_start >> SHIFTS[L3]) & PT_INDEX_MASK;
+
+    // Every entry of a contiguous group must carry the hint, so groups only partly unmapped lose it.
+    auto end_idx = bek::min(idx + size / SIZES[L3], static_cast<uSize>(PT_ENTRY_COUNT));
+    if (idx % PT_CONTIGUOUS_ENTRIES || end_idx - idx < PT_CONTIGUOUS_ENTRIES) {
+        break_contiguous_group(tbl, idx, virt_start);
+    }
+    if (end_idx % PT_CONTIGUOUS_ENTRIES && (end_idx & ~static_cast<uSize>(PT_CONTIGUOUS_ENTRIES - 1)) > idx) {
+        break_contiguous_group(tbl, end_idx, virt_start + (end_idx - idx) * SIZES[L3]);
+    }
+
     for (; idx < PT_ENTRY_COUNT && size > 0; idx++) {
         tbl[idx] = ARMv8MMU_L3_Entry::create_null();
         virt_start += SIZES[L3];
@@ -319,16 +510,85 @@ bool TableManager::unmap_lower(u8* table, uPtr& virt_start, uSize& size) {
     return true;
 }
 
+bool TableManager::can_map_contiguous(const ARMv8MMU_L3_Entry* entries, uSize idx, uPtr phys_start, uSize size) {
+    constexpr uSize group_size = PT_CONTIGUOUS_ENTRIES * PAGE_SIZE;
+    if (idx % PT_CONTIGUOUS_ENTRIES || size < group_size || phys_start & (group_size - 1)) return false;
+    for (uSize i = 0; i < PT_CONTIGUOUS_ENTRIES; i++) {
+        if (entries[i].descriptor_code != PT_INVALID_DESCRIPTOR) return false;
+    }
+    return true;
+}
+
+void TableManager::break_contiguous_group(ARMv8MMU_L3_Entry* table, uSize idx, uPtr virt_addr) {
+    auto group_idx = idx & ~static_cast<uSize>(PT_CONTIGUOUS_ENTRIES - 1);
+    if (!table[group_idx].contiguous()) return;
+    auto group_virt = virt_addr - (idx - group_idx) * SIZES[L3];
+
+    // Break-before-make: the combined TLB entry must go before the pages are mapped individually.
+    ARMv8MMU_L3_Entry entries[PT_CONTIGUOUS_ENTRIES];
+    for (uSize i = 0; i < PT_CONTIGUOUS_ENTRIES; i++) {
+        entries[i]           = table[group_idx + i];
+        table[group_idx + i] = ARMv8MMU_L3_Entry::create_null();
+    }
+    invalidate_tlb(group_virt, PT_CONTIGUOUS_ENTRIES * SIZES[L3]);
+    for (uSize i = 0; i < PT_CONTIGUOUS_ENTRIES; i++) {
+        table[group_idx + i] = entries[i].without_contiguous();
+    }
+}
+
+bool TableManager::table_is_empty(const u8* table) {
+    auto* entries = reinterpret_cast<const u64*>(table);
+    for (uSize i = 0; i < PT_ENTRY_COUNT; i++) {
+        if ((entries[i] & PT_DESCRIPTOR_MASK) != PT_INVALID_DESCRIPTOR) return false;
+    }
+    return true;
+}
+
+void TableManager::release_table_tree(u8* table, TableLevel level) {
+    if (level != L3) {
+        auto* tbl = reinterpret_cast<ARMv8MMU_UpperEntry*>(table);
+        for (uSize i = 0; i < PT_ENTRY_COUNT; i++) {
+            if (tbl[i].table.descriptor_code == PT_UPPER_TABLE_DESCRIPTOR) {
+                release_table_tree(
+                    (u8*)mem::kernel_phys_to_virt(PhysPtr{tbl[i].table.table_page << PAGE_SHIFT}),
+                    static_cast<TableLevel>(level + 1));
+            }
+        }
+    }
+    // The walker may still reach the table through cached entries until the TLB is invalidated, so it
+    // is only freed after that. The list link is page-aligned, so reads as an invalid descriptor.
+    *reinterpret_cast<u8**>(table) = m_pending_free_tables;
+    m_pending_free_tables          = table;
+}
+
+void TableManager::free_pending_tables() {
+    while (m_pending_free_tables) {
+        auto* table           = m_pending_free_tables;
+        m_pending_free_tables = *reinterpret_cast<u8**>(table);
+        free_table(table);
+    }
+}
+
+void TableManager::release_all_tables() {
+    if (!m_root_table || m_global) return;
+    release_table_tree(m_root_table, L0);
+    // No entries with our ASID may outlive the tables. The ASID itself is not handed out again until the
+    // next generation, which starts with a full flush.
+    invalidate_tlb_all();
+    free_pending_tables();
+    m_root_table = nullptr;
+}
+
 u8* TableManager::allocate_table() {
     u8* res = nullptr;
     if (m_embedded_tables_current && m_embedded_tables_current < &__initial_pgtables_end) {
         res = m_embedded_tables_current;
         m_embedded_tables_current += PAGE_SIZE;
+        bek::memset(res, 0, PAGE_SIZE);
     } else {
-        res = mem::PageAllocator::the().allocate_region(1)->start.ptr;
+        res = mem::PageAllocator::the().allocate_zeroed_page()->start.ptr;
     }
     VERIFY(res);
-    bek::memset(res, 0, PAGE_SIZE);
     return res;
 }
 
@@ -345,25 +605,89 @@ bool TableManager::free_table(u8* table) {
     return true;
 }
 TableManager TableManager::create_global_manager(u8* current_embedded_table) {
-    return TableManager(current_embedded_table, &__initial_pgtables_start);
+    return TableManager(current_embedded_table, &__initial_pgtables_start, true);
 }
 TableManager TableManager::create_user_manager() {
-    auto root_table = mem::PageAllocator::the().allocate_region(1);
+    auto root_table = mem::PageAllocator::the().allocate_zeroed_page();
     VERIFY(root_table && root_table->start.ptr);
     // TODO: Error handling?
-    return TableManager(nullptr, root_table->start.ptr);
+    return TableManager(nullptr, root_table->start.ptr, false);
 }
 u8* TableManager::get_root_table() const {
     VERIFY(m_root_table);
     return m_root_table;
 }
+void TableManager::allocate_asid() {
+    // Callers hold the kernel lock, so the ASID state needs no locking of its own.
+    if (m_asid_generation != 0) {
+        // Keep an ASID that is reserved for us across a rollover, as some CPU may still be using it.
+        auto old_context = make_context(m_asid_generation, m_asid);
+        auto new_context = make_context(g_asid_generation, m_asid);
+        bool reserved    = false;
+        for (auto& context : g_reserved_contexts) {
+            if (context == old_context) {
+                context  = new_context;
+                reserved = true;
+            }
+        }
+        if (reserved) {
+            m_asid_generation = g_asid_generation;
+            return;
+        }
+    }
+
+    u64 tcr;
+    asm volatile("mrs %0, tcr_el1" : "=r"(tcr));
+    u32 asid_limit = (tcr & TCR_ASID_ENABLE) ? MAX_ASIDS : (1u << 8);
+    while (g_next_asid < asid_limit && asid_in_use(g_next_asid)) g_next_asid++;
+    if (g_asid_generation == 0 || g_next_asid >= asid_limit) {
+        g_asid_generation++;
+        bek::memset(g_asids_in_use, 0, sizeof(g_asids_in_use));
+        // ASID 0 is left for the kernel's tables.
+        mark_asid_in_use(0);
+        for (u32 cpu = 0; cpu < smp::MAX_CPUS; cpu++) {
+            auto context = bek::exchange(g_active_contexts[cpu], 0ul);
+            // A CPU which activated nothing since the last rollover is still running what it reserved then.
+            if (!context) context = g_reserved_contexts[cpu];
+            if (context) mark_asid_in_use(context & (MAX_ASIDS - 1));
+            g_reserved_contexts[cpu] = context;
+        }
+        g_next_asid = 1;
+        while (asid_in_use(g_next_asid)) g_next_asid++;
+        asm volatile("dsb ishst; tlbi vmalle1is; dsb ish; isb" ::: "memory");
+    }
+    mark_asid_in_use(g_next_asid);
+    m_asid            = static_cast<u16>(g_next_asid++);
+    m_asid_generation = g_asid_generation;
+}
+u64 TableManager::translation_base() {
+    VERIFY(m_root_table && !m_global);
+    if (m_asid_generation == 0 || m_asid_generation != g_asid_generation) allocate_asid();
+    g_active_contexts[smp::current_cpu_id()] = make_context(m_asid_generation, m_asid);
+    auto root = mem::kernel_virt_to_phys(m_root_table);
+    VERIFY(root);
+    return root->get() | (static_cast<u64>(m_asid) << ASID_SHIFT);
+}
+u64 TableManager::empty_translation_base() {
+    auto root = mem::kernel_virt_to_phys(g_empty_user_table);
+    VERIFY(root);
+    return root->get();
+}
+TableManager::~TableManager() { release_all_tables(); }
 TableManager::TableManager(TableManager&& manager) noexcept
     : m_embedded_tables_current(bek::exchange(manager.m_embedded_tables_current, nullptr)),
-      m_root_table(bek::exchange(manager.m_root_table, nullptr)) {}
+      m_root_table(bek::exchange(manager.m_root_table, nullptr)),
+      m_global(manager.m_global),
+      m_asid(manager.m_asid),
+      m_asid_generation(bek::exchange(manager.m_asid_generation, 0)) {}
 TableManager& TableManager::operator=(TableManager&& manager) noexcept {
     if (&manager != this) {
+        release_all_tables();
         m_embedded_tables_current = bek::exchange(manager.m_embedded_tables_current, nullptr);
-        m_root_table = bek::exchange(manager.m_root_table, nullptr);
+        m_root_table              = bek::exchange(manager.m_root_table, nullptr);
+        m_global                  = manager.m_global;
+        m_asid                    = manager.m_asid;
+        m_asid_generation         = bek::exchange(manager.m_asid_generation, 0);
     }
     return *this;
 }
@@ -18,29 +18,87 @@
 
 #include "interrupts/deferred_calls.h"
 
-using QueueMember = bek::function<void(), false, true>;
+#include "arch/smp.h"
+#include "interrupts/int_ctrl.h"
 
-static QueueMember g_queue_member_pool[5] = {};
+namespace {
 
-ErrorCode deferred::queue_call(bek::function<void()> callback) {
-    for (auto& member : g_queue_member_pool) {
-        if (!member) {
-            member = QueueMember(bek::move(callback));
-            return ESUCCESS;
+/// Low priority items run per call to execute_queue.
+constexpr uSize LOW_PRIORITY_BUDGET = 16;
+
+struct Lane {
+    /// Newest first. Producers push here without locking, as they may be interrupt handlers.
+    deferred::WorkItem* incoming;
+    /// Oldest first. Only touched by execute_queue, with interrupts disabled.
+    deferred::WorkItem* pending;
+};
+
+/// Work runs on the CPU that queued it.
+Lane g_lanes[smp::MAX_CPUS][2] = {};
+
+Lane& lane_for(deferred::Priority priority) {
+    return g_lanes[smp::current_cpu_id()][static_cast<u8>(priority)];
+}
+
+deferred::WorkItem* take_next(deferred::Priority priority) {
+    // A nested interrupt may run execute_queue on top of us.
+    InterruptDisabler disabler;
+    auto& lane = lane_for(priority);
+    if (!lane.pending) {
+        auto* item = __atomic_exchange_n(&lane.incoming, nullptr, __ATOMIC_ACQUIRE);
+        while (item) {
+            auto* next   = item->next;
+            item->next   = lane.pending;
+            lane.pending = item;
+            item         = next;
         }
     }
-    return ENOMEM;
+    auto* item = lane.pending;
+    if (item) {
+        lane.pending = item->next;
+        item->next   = nullptr;
+        // Cleared before running, so the item can requeue itself.
+        __atomic_store_n(&item->queued, false, __ATOMIC_RELEASE);
+    }
+    return item;
+}
+
+}  // namespace
+
+bool deferred::queue_work(WorkItem& item, Priority priority) {
+    if (__atomic_exchange_n(&item.queued, true, __ATOMIC_ACQ_REL)) return false;
+    auto& lane = lane_for(priority);
+    auto* head = __atomic_load_n(&lane.incoming, __ATOMIC_RELAXED);
+    do {
+        item.next = head;
+    } while (!__atomic_compare_exchange_n(&lane.incoming, &head, &item, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    return true;
 }
+
 void deferred::execute_queue() {
-    for (auto& member : g_queue_member_pool) {
-        if (member) {
-            member();
-            member = {};
-        }
+    // Work may call schedule(), after which we could be on another CPU, so the lane is looked up each time.
+    while (auto* item = take_next(Priority::High)) {
+        item->function();
+    }
+    for (uSize budget = LOW_PRIORITY_BUDGET; budget; budget--) {
+        auto* item = take_next(Priority::Low);
+        if (!item) break;
+        item->function();
+    }
+}
+
+bool deferred::has_pending_work() {
+    InterruptDisabler disabler;
+    for (auto& lane : g_lanes[smp::current_cpu_id()]) {
+        if (lane.pending || __atomic_load_n(&lane.incoming, __ATOMIC_RELAXED)) return true;
     }
+    return false;
 }
+
 void deferred::initialise() {
-    for (auto& member : g_queue_member_pool) {
-        member = {};
+    for (auto& cpu_lanes : g_lanes) {
+        for (auto& lane : cpu_lanes) {
+            lane = {};
+        }
     }
 }
@@ -17,7 +17,9 @@
 #include <peripherals/interrupt_controller.h>
 #include <peripherals/uart.h>
 
+#include "arch/a64/memory_constants.h"
 #include "library/debug.h"
+#include "process/process.h"
 
 using DBG = DebugScope<"ERR", DebugLevel::WARN>;
 
@@ -50,6 +52,8 @@ struct ExceptionSyndrome {
             }
         }
         constexpr bool was_write() const { return wnr; }
+        constexpr bool is_translation_fault() const { return ((fault_status_code >> 2) & 0b1111) == 1; }
+        constexpr bool is_permission_fault() const { return ((fault_status_code >> 2) & 0b1111) == 3; }
         constexpr u8 table_level() const { return (fault_status_code & 0b11); }
         u8 fault_status_code;
         bool wnr;
@@ -128,6 +132,23 @@ constexpr bek::str_view str_int_level(unsigned long type) {
     }
 }
 
+/// Attempts to resolve a synchronous abort (from EL0, or from EL1 accessing user memory), such as
+/// an access to a demand-allocated page or a write to a copy-on-write page.
+/// \return true if the faulting instruction can be retried.
+extern "C" bool handle_abort_a64(u64 esr, u64 far) {
+    ExceptionSyndrome syndrome{esr};
+    if (!syndrome.is_data_abort() && !syndrome.is_instruction_abort()) return false;
+    auto abort_info = syndrome.abort_information();
+    bool is_write   = syndrome.is_data_abort() && abort_info.was_write();
+    if (far >= VA_START) return false;
+    if (!abort_info.is_translation_fault() && !(abort_info.is_permission_fault() && is_write)) return false;
+
+    auto& process = ProcessManager::the().current_process();
+    if (!process.has_userspace()) return false;
+    return process.with_space_manager(
+               [far, is_write](SpaceManager& manager) { return manager.handle_fault(far, is_write); }) == ESUCCESS;
+}
+
 /**
  * common exception handler
  */
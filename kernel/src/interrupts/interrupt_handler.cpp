@@ -16,11 +16,14 @@
  * along with this program.  If not, see <https://www.gnu.org/licenses/>.
  */
 
+#include "arch/a64/memory_constants.h"
+#include "arch/smp.h"
 #include "bek/assertions.h"
 #include "bek/types.h"
 #include "interrupts/deferred_calls.h"
 #include "interrupts/int_ctrl.h"
 #include "peripherals/interrupt_controller.h"
+#include "process/process.h"
 
 extern InterruptController* global_intc;
 
@@ -29,5 +32,12 @@ extern "C" void handle_hardware_interrupt(u64 esr, u64 elr) {
     global_intc->handle_interrupt();
     enable_interrupts();
     deferred::execute_queue();
+    if (smp::take_reschedule_request()) {
+        ProcessManager::the().schedule();
+    }
+    // Only interrupted userspace is safe to end - kernel code could be halfway through something.
+    if (elr < VA_START) {
+        ProcessManager::the().current_process().exit_if_requested();
+    }
     disable_interrupts();
 }
@@ -18,46 +18,245 @@
 
 #include "mm/backing_region.h"
 
+#include "mm/cache.h"
 #include "mm/page_allocator.h"
 #include "mm/space_manager.h"
 
-expected<bek::shared_ptr<mem::UserOwnedAllocation>> mem::UserOwnedAllocation::create_contiguous(uSize pages) {
+expected<bek::shared_ptr<mem::PageChunk>> mem::PageChunk::create(uSize pages) {
     auto allocation = mem::PageAllocator::the().allocate_region(pages);
     if (!allocation) return ENOMEM;
     auto phys_ptr = mem::kernel_virt_to_phys(allocation->start.get());
     VERIFY(phys_ptr);
-    return bek::adopt_shared(new UserOwnedAllocation(*allocation, *phys_ptr));
+    return bek::adopt_shared(new PageChunk(*allocation, *phys_ptr));
+}
+
+expected<bek::shared_ptr<mem::PageChunk>> mem::PageChunk::create_zeroed_page() {
+    auto allocation = mem::PageAllocator::the().allocate_zeroed_page();
+    if (!allocation) return ENOMEM;
+    auto phys_ptr = mem::kernel_virt_to_phys(allocation->start.get());
+    VERIFY(phys_ptr);
+    return bek::adopt_shared(new PageChunk(*allocation, *phys_ptr));
+}
+
+void mem::PageChunk::release_page(uSize index) {
+    VERIFY(m_page_references[index]);
+    if (--m_page_references[index] == 0) mem::PageAllocator::the().release_pages(VirtualPtr{kernel_page(index)}, 1);
+}
+
+mem::PageChunk::~PageChunk() {
+    // Return the pages still referenced (normally none, unless the creator never handed them out), in runs.
+    uSize count = m_page_references.size();
+    for (uSize first = 0; first < count;) {
+        if (!m_page_references[first]) {
+            first++;
+            continue;
+        }
+        uSize last = first + 1;
+        while (last < count && m_page_references[last]) last++;
+        mem::PageAllocator::the().release_pages(VirtualPtr{kernel_page(first)}, last - first);
+        first = last;
+    }
+}
+
+expected<bek::shared_ptr<mem::UserOwnedAllocation>> mem::UserOwnedAllocation::create_scattered(uSize pages,
+                                                                                               bool zeroed) {
+    bek::vector<Page> page_list;
+    page_list.reserve(pages);
+    if (zeroed && pages < SIZE_64K / PAGE_SIZE) {
+        // Too small to benefit from contiguous mappings, so use pre-zeroed pages.
+        while (page_list.size() < pages) {
+            auto chunk = EXPECTED_TRY(PageChunk::create_zeroed_page());
+            page_list.push_back({bek::move(chunk), 0});
+        }
+        return bek::adopt_shared(new UserOwnedAllocation(bek::move(page_list)));
+    }
+    // Take runs as large as possible, but settle for smaller ones when memory is fragmented.
+    uSize run = pages;
+    while (page_list.size() < pages) {
+        run        = bek::min(run, pages - page_list.size());
+        auto chunk = PageChunk::create(run);
+        if (!chunk) {
+            if (run == 1) return ENOMEM;
+            run /= 2;
+            continue;
+        }
+        if (zeroed) bek::memset(chunk.value()->kernel_page(0), 0, run * PAGE_SIZE);
+        for (uSize i = 0; i < run; i++) {
+            page_list.push_back({chunk.value(), i});
+        }
+    }
+    return bek::adopt_shared(new UserOwnedAllocation(bek::move(page_list)));
+}
+
+expected<bek::shared_ptr<mem::UserOwnedAllocation>> mem::UserOwnedAllocation::create_lazy(uSize pages) {
+    bek::vector<Page> page_list(pages);
+    return bek::adopt_shared(new UserOwnedAllocation(bek::move(page_list)));
 }
 
 ErrorCode mem::UserOwnedAllocation::map_into_table(TableManager& manager, mem::UserRegion user_region, uSize offset,
                                                    bool readable, bool writeable, bool executable) {
-    VERIFY(user_region.page_aligned() && (offset % PAGE_SIZE) == 0 && (user_region.size + offset) <= m_region.size);
+    VERIFY(user_region.page_aligned() && (offset % PAGE_SIZE) == 0 && (user_region.size + offset) <= size());
 
-    if (!manager.map_region(user_region.start.ptr, m_physical_ptr.get(), user_region.size,
-                            attributes_for_user(readable, writeable, executable), NormalRAM)) {
-        return EFAIL;
+    // Map runs of physically contiguous pages which share permissions together. Shared pages are
+    // mapped read-only, so that writes fault and can be copied.
+    uSize first = offset / PAGE_SIZE;
+    uSize end   = first + user_region.size / PAGE_SIZE;
+    while (first < end) {
+        if (!m_pages[first].populated()) {
+            // Left unmapped until first access.
+            first++;
+            continue;
+        }
+        bool run_writeable = writeable && m_pages[first].exclusive();
+        uSize last         = first + 1;
+        while (last < end && m_pages[last].populated() && (writeable && m_pages[last].exclusive()) == run_writeable &&
+               m_pages[last].physical() == m_pages[last - 1].physical().offset(PAGE_SIZE)) {
+            last++;
+        }
+        if (!manager.map_region(user_region.start.offset((first * PAGE_SIZE) - offset).ptr,
+                                m_pages[first].physical().get(), (last - first) * PAGE_SIZE,
+                                attributes_for_user(readable, run_writeable, executable), NormalRAM)) {
+            return EFAIL;
+        }
+        first = last;
     }
     return ESUCCESS;
 }
 ErrorCode mem::UserOwnedAllocation::unmap_from_table(TableManager& manager, mem::UserRegion user_region, uSize offset) {
-    VERIFY(user_region.page_aligned() && (offset % PAGE_SIZE) == 0 && (user_region.size + offset) <= m_region.size);
+    VERIFY(user_region.page_aligned() && (offset % PAGE_SIZE) == 0 && (user_region.size + offset) <= size());
     if (!manager.unmap_region(user_region.start.get(), user_region.size)) {
         return EFAIL;
     }
 
     return ESUCCESS;
 }
-mem::UserOwnedAllocation::~UserOwnedAllocation() { mem::PageAllocator::the().free_region(m_region.start); }
+mem::UserOwnedAllocation::~UserOwnedAllocation() {
+    for (auto& page : m_pages) {
+        if (page.populated()) page.chunk->release_page(page.index);
+    }
+}
 expected<bek::shared_ptr<mem::BackingRegion>> mem::UserOwnedAllocation::clone_for_fork(
     UserspaceRegion& current_region) {
     if (!(current_region.permissions & MemoryOperation::Write)) {
         // We don't need to write to this region! So just copy reference (nice).
         return bek::shared_ptr<mem::BackingRegion>{this};
+    } else if (ref_count() == 1) {
+        // Only this region refers to us, so the pages can be shared copy-on-write. The caller must
+        // remap the current region so that they become read-only.
+        bek::vector<Page> page_list;
+        page_list.reserve(m_pages.size());
+        for (auto& page : m_pages) {
+            if (page.populated()) page.chunk->acquire_page(page.index);
+            page_list.push_back({page.chunk, page.index});
+        }
+        return bek::shared_ptr<mem::BackingRegion>{
+            bek::adopt_shared(new UserOwnedAllocation(bek::move(page_list)))};
     } else {
-        // May need to write. In future, Copy-on-Write!
-        // TODO: Copy on Write.
-        auto new_backing_region = EXPECTED_TRY(create_contiguous(m_region.size / PAGE_SIZE));
-        bek::memcopy(new_backing_region->m_region.start.ptr, m_region.start.ptr, m_region.size);
-        return new_backing_region;
+        // Shared with another address space, whose mappings we cannot write-protect - copy now.
+        auto new_backing_region = EXPECTED_TRY(create_scattered(m_pages.size()));
+        for (uSize i = 0; i < m_pages.size(); i++) {
+            if (m_pages[i].populated()) {
+                new_backing_region->write(i * PAGE_SIZE, m_pages[i].chunk->kernel_page(m_pages[i].index), PAGE_SIZE);
+            } else {
+                new_backing_region->clear(i * PAGE_SIZE, PAGE_SIZE);
+            }
+        }
+        if ((current_region.permissions & MemoryOperation::Execute) != MemoryOperation::None) {
+            new_backing_region->sync_instruction_cache();
+        }
+        return bek::shared_ptr<mem::BackingRegion>{new_backing_region};
+    }
+}
+ErrorCode mem::UserOwnedAllocation::resolve_fault(TableManager& manager, mem::UserRegion page, uSize offset,
+                                                  bool is_write, bool readable, bool writable, bool executable) {
+    VERIFY(page.page_aligned() && page.size == PAGE_SIZE && (offset % PAGE_SIZE) == 0 && offset < size());
+    auto& entry = m_pages[offset / PAGE_SIZE];
+    if (!entry.populated()) {
+        // First access - allocate a zeroed page.
+        entry = {EXPECTED_TRY(PageChunk::create_zeroed_page()), 0};
+    } else if (is_write && writable && !entry.exclusive()) {
+        // Someone else still uses the page - take our own copy.
+        EXPECT_SUCCESS(copy_page(entry, executable));
     }
+
+    // The page may already be mapped (read-only), or not at all (e.g. populated by another address space).
+    if (!manager.unmap_region(page.start.get(), PAGE_SIZE) ||
+        !manager.map_region(page.start.get(), entry.physical().get(), PAGE_SIZE,
+                            attributes_for_user(readable, writable && entry.exclusive(), executable), NormalRAM)) {
+        return EFAIL;
+    }
+    return ESUCCESS;
+}
+ErrorCode mem::UserOwnedAllocation::break_copy_on_write(TableManager& manager, mem::UserRegion user_region,
+                                                        bool readable, bool writable, bool executable) {
+    VERIFY(user_region.page_aligned() && user_region.size == size());
+    for (uSize i = 0; i < m_pages.size(); i++) {
+        auto& entry = m_pages[i];
+        if (!entry.populated() || entry.exclusive()) continue;
+        EXPECT_SUCCESS(copy_page(entry, executable));
+        auto page = user_region.start.get() + i * PAGE_SIZE;
+        if (!manager.unmap_region(page, PAGE_SIZE) ||
+            !manager.map_region(page, entry.physical().get(), PAGE_SIZE,
+                                attributes_for_user(readable, writable, executable), NormalRAM)) {
+            return EFAIL;
+        }
+    }
+    return ESUCCESS;
+}
+ErrorCode mem::UserOwnedAllocation::copy_page(Page& entry, bool executable) {
+    auto chunk = EXPECTED_TRY(PageChunk::create(1));
+    bek::memcopy(chunk->kernel_page(0), entry.chunk->kernel_page(entry.index), PAGE_SIZE);
+    if (executable) {
+        mem::sync_instruction_cache(chunk->kernel_page(0), PAGE_SIZE);
+    }
+    entry.chunk->release_page(entry.index);
+    entry = {bek::move(chunk), 0};
+    return ESUCCESS;
+}
+expected<bek::shared_ptr<mem::BackingRegion>> mem::UserOwnedAllocation::slice(uSize offset, uSize size) {
+    VERIFY((offset % PAGE_SIZE) == 0 && (size % PAGE_SIZE) == 0 && offset + size <= this->size());
+    // The pages are briefly referenced twice, until the caller drops this allocation.
+    bek::vector<Page> page_list;
+    page_list.reserve(size / PAGE_SIZE);
+    for (uSize i = offset / PAGE_SIZE; i < (offset + size) / PAGE_SIZE; i++) {
+        if (m_pages[i].populated()) m_pages[i].chunk->acquire_page(m_pages[i].index);
+        page_list.push_back({m_pages[i].chunk, m_pages[i].index});
+    }
+    return bek::shared_ptr<mem::BackingRegion>{bek::adopt_shared(new UserOwnedAllocation(bek::move(page_list)))};
+}
+ErrorCode mem::UserOwnedAllocation::discard(TableManager& manager, mem::UserRegion user_region, uSize offset) {
+    VERIFY(user_region.page_aligned() && (offset % PAGE_SIZE) == 0 && (user_region.size + offset) <= size());
+    // Unmap first, so nothing can reach the pages once they are released.
+    if (!manager.unmap_region(user_region.start.get(), user_region.size)) {
+        return EFAIL;
+    }
+    // Each page returns to the PageAllocator as soon as nothing references it.
+    for (uSize i = offset / PAGE_SIZE; i < (offset + user_region.size) / PAGE_SIZE; i++) {
+        if (m_pages[i].populated()) {
+            m_pages[i].chunk->release_page(m_pages[i].index);
+            m_pages[i] = Page{};
+        }
+    }
+    return ESUCCESS;
+}
+void mem::UserOwnedAllocation::write(uSize offset, const void* data, uSize length) {
+    auto result = for_each_kernel_run(offset, length, [&](bek::mut_buffer run, uSize run_offset) {
+        bek::memcopy(run.data(), static_cast<const char*>(data) + (run_offset - offset), run.size());
+        return ESUCCESS;
+    });
+    VERIFY(result == ESUCCESS);
+}
+void mem::UserOwnedAllocation::clear(uSize offset, uSize length) {
+    auto result = for_each_kernel_run(offset, length, [](bek::mut_buffer run, uSize) {
+        bek::memset(run.data(), 0, run.size());
+        return ESUCCESS;
+    });
+    VERIFY(result == ESUCCESS);
+}
+void mem::UserOwnedAllocation::sync_instruction_cache() {
+    auto result = for_each_kernel_run(0, size(), [](bek::mut_buffer run, uSize) {
+        mem::sync_instruction_cache(run.data(), run.size());
+        return ESUCCESS;
+    });
+    VERIFY(result == ESUCCESS);
 }
@@ -23,7 +23,7 @@ ErrorCode DeviceBackedRegion::map_into_table(TableManager& manager, mem::UserReg
     VERIFY(user_region.page_aligned() && (offset % PAGE_SIZE) == 0 && (user_region.size + offset) <= m_region.size);
 
     if (!manager.map_region(user_region.start.get(), m_region.start.get(), user_region.size,
-                            attributes_for_user(readable, writable, executable), MMIO)) {
+                            attributes_for_user(readable, writable, executable), m_attributes)) {
         return EFAIL;
     }
     return ESUCCESS;
@@ -22,24 +22,42 @@
 
 namespace mem {
 
+/// Buffers never share a cache line with other allocations, as those lines could be written back
+/// over data from the device.
+static uSize dma_allocation_size(uSize size) {
+    auto line_sz = cache_line_size();
+    return (size + line_sz - 1) & ~(line_sz - 1);
+}
+
 mem::own_dma_buffer MappedDmaPool::allocate(uSize size, uSize align) {
-    auto allocation = kmalloc(size, align);
+    align           = bek::max(align, cache_line_size());
+    auto allocation = kmalloc_contiguous(dma_allocation_size(size), align);
     VERIFY(allocation);
     auto raw_ptr = mem::kernel_virt_to_phys(allocation);
     VERIFY(raw_ptr);
+    // From here on, the memory is only accessed through the uncached alias - make sure no dirty lines
+    // remain from its previous use.
+    dma_flush_cache(allocation, dma_allocation_size(size));
+    auto* uncached = static_cast<char*>(kernel_phys_to_uncached(*raw_ptr));
     for (auto& mapping : m_mappings) {
         mem::PhysicalPtr region_start{mapping.parent_address};
         if (region_start <= *raw_ptr && *raw_ptr <= region_start.offset(mapping.size)) {
             // In this region!
             mem::DmaPtr dma_region_start{mapping.child_address};
             auto dma_ptr = dma_region_start.offset(raw_ptr->get() - region_start.get());
-            return {*this, {(char*)allocation, size, dma_ptr}, align};
+            return {*this, {uncached, size, dma_ptr}, align};
         }
     }
     ASSERT_UNREACHABLE();
 }
 void MappedDmaPool::deallocate(const mem::own_dma_buffer& buffer) {
-    kfree(buffer.data(), buffer.size(), buffer.align());
+    auto raw_ptr = mem::kernel_virt_to_phys(buffer.data());
+    VERIFY(raw_ptr);
+    // The cacheable alias may have speculatively fetched lines while the device was writing through the
+    // uncached one. Discard them, or the next owner would read stale data.
+    auto* cached = kernel_phys_to_virt(*raw_ptr);
+    dma_sync_before_read(cached, dma_allocation_size(buffer.size()));
+    kfree(cached, dma_allocation_size(buffer.size()), buffer.align());
 }
 
 }  // namespace mem
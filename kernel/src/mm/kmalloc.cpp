@@ -18,26 +18,61 @@
 
 #include <library/bitset.h>
 
+#include "api/syscalls.h"
 #include "arch/a64/memory_constants.h"
 #include "library/debug.h"
 #include "library/intrusive_list.h"
+#include "mm/memory_manager.h"
 #include "mm/page_allocator.h"
 
 constexpr bool is_aligned(uPtr ptr, uSize alignment) { return ptr % alignment == 0; }
 
 using DBG = DebugScope<"kmalloc", DebugLevel::WARN>;
 
+/// Kept up to date on every allocation, so that statistics never need to walk the heap.
+struct SizeClassCounters {
+    void record_allocation(uSize bytes) {
+        allocations++;
+        live_bytes += bytes;
+        if (live_bytes > peak_live_bytes) peak_live_bytes = live_bytes;
+    }
+    void record_free(uSize bytes) {
+        frees++;
+        live_bytes -= bytes;
+    }
+    void record_failure() { failures++; }
+
+    [[nodiscard]] sc::HeapSizeClassStats to_stats(uSize max_size) const {
+        return {max_size, allocations, frees, live_bytes, peak_live_bytes, failures};
+    }
+
+    uSize allocations{0};
+    uSize frees{0};
+    uSize live_bytes{0};
+    uSize peak_live_bytes{0};
+    uSize failures{0};
+};
+
 class BitmapAllocator {
 public:
     static constexpr uSize chunk_size = 128;
-    BitmapAllocator(char* data, uSize size)
+
+    /// Places an allocator, managing the rest of the space, at the start of space.
+    static BitmapAllocator* create_in(char* space, uSize size, bool page_backed) {
+        VERIFY(reinterpret_cast<uPtr>(space) % chunk_size == 0);
+        auto header_size = bek::align_up(sizeof(BitmapAllocator), chunk_size);
+        VERIFY(size > header_size);
+        return new (space) BitmapAllocator(space + header_size, size - header_size, page_backed);
+    }
+
+    BitmapAllocator(char* data, uSize size, bool page_backed = false)
         : m_data{data},
           m_chunk_count{calculate_chunk_count(size)},
-          m_bitmap((data + m_chunk_count * chunk_size), m_chunk_count) {
+          m_bitmap((data + m_chunk_count * chunk_size), m_chunk_count),
+          m_page_backed{page_backed} {
         // Sanity check - bytes taken by chunks + bytes taken by bitmap < size.
         VERIFY(m_chunk_count * chunk_size + bek::ceil_div(m_chunk_count, 8ul) <= size);
     }
-
     void* allocate(uSize size, uSize alignment = 1) {
         auto chunks_needed = bek::ceil_div(size, chunk_size);
 
@@ -50,18 +85,25 @@ public:
         VERIFY(reinterpret_cast<uPtr>(m_data) % chunk_size == 0);
         auto align_offset = (reinterpret_cast<uPtr>(m_data) / chunk_size) % chunk_alignment;
 
-        auto result =
-            m_bitmap.find_first_fit(chunks_needed, false, 0, chunk_alignment, align_offset);
+        // Next fit: carry on from the last allocation, and only then retry from the start.
+        auto result = m_bitmap.find_first_fit(chunks_needed, false, m_next_fit_hint, chunk_alignment, align_offset,
+                                              chunks_needed);
+        if (result.is_invalid() && m_next_fit_hint) {
+            result = m_bitmap.find_first_fit(chunks_needed, false, 0, chunk_alignment, align_offset, chunks_needed);
+        }
         if (result.is_invalid()) return nullptr;
 
         // Mark as used.
         m_bitmap.set_range(result.index, chunks_needed, true);
         m_allocated_chunks += chunks_needed;
+        m_next_fit_hint = result.index + chunks_needed;
         return m_data + result.index * chunk_size;
     }
 
+    [[nodiscard]] bool owns(void* ptr) const { return m_data <= ptr && ptr < (m_data + chunk_size * m_chunk_count); }
+
     void free(void* ptr, uSize size) {
-        VERIFY(m_data <= ptr && ptr < (m_data + chunk_size * m_chunk_count));
+        VERIFY(owns(ptr));
         auto chunk_index    = (reinterpret_cast<char*>(ptr) - m_data) / chunk_size;
         auto chunks_to_free = bek::ceil_div(size, chunk_size);
         // TODO: Verify flip?
@@ -73,6 +115,11 @@ public:
     [[nodiscard]] uSize free_bytes() const {
         return (m_chunk_count - m_allocated_chunks) * chunk_size;
     }
+    [[nodiscard]] bool empty() const { return m_allocated_chunks == 0; }
+    [[nodiscard]] bool page_backed() const { return m_page_backed; }
+
+    bek::IntrusiveListNode<BitmapAllocator> node;
+    using List = bek::IntrusiveList<BitmapAllocator, &BitmapAllocator::node>;
 
 private:
     static constexpr uSize calculate_chunk_count(uSize size) {
@@ -84,13 +131,16 @@ private:
     char* m_data;
     uSize m_chunk_count;
     uSize m_allocated_chunks{0};
+    uSize m_next_fit_hint{0};
     bek::bitset_view m_bitmap;
+    bool m_page_backed;
 };
 
 struct SlabBlock {
     /// Must be placement-new-ed into start of block.
-    SlabBlock(uSize obj_size, uSize block_size)
+    SlabBlock(uSize obj_size, uSize block_size, bool page_backed)
         : object_size{obj_size},
+          page_backed{page_backed},
           allocated_objects{0},
           total_objects{static_cast<int>((block_size - sizeof(SlabBlock)) / obj_size)} {
         char* block_array = data_begin();
@@ -136,6 +186,8 @@ struct SlabBlock {
     };
     uSize object_size;
     FreeListElement* freelist_head{nullptr};
+    /// Taken from the PageAllocator (rather than the kernel heap, as during early boot).
+    bool page_backed;
 
     bek::IntrusiveListNode<SlabBlock> node;
     using List = bek::IntrusiveList<SlabBlock, &SlabBlock::node>;
@@ -162,22 +214,40 @@ public:
 
     void* allocate() {
         if (m_free_blocks.empty()) {
-            auto region = mem::allocate(m_blk_size, m_blk_size);
-            if (!region.pointer) {
+            // Blocks are a power of two pages, so the PageAllocator aligns them to their size, as free() relies on.
+            bool page_backed = true;
+            void* block_ptr  = nullptr;
+            if (auto region = mem::PageAllocator::the().allocate_region(m_blk_size / PAGE_SIZE)) {
+                block_ptr = region->start.get();
+                m_page_blocks++;
+            } else {
+                // No PageAllocator yet (or no pages) - fall back to the initial heap arena.
+                page_backed = false;
+                block_ptr   = mem::allocate(m_blk_size, m_blk_size).pointer;
+            }
+            if (!block_ptr) {
                 DBG::errln("SlabBlock({}) could not allocate another block of size {}."_sv,
                            m_obj_size, m_blk_size);
+                m_counters.record_failure();
+                return nullptr;
             }
-            auto* block = new (region.pointer) SlabBlock(m_obj_size, m_blk_size);
+            VERIFY(is_aligned(reinterpret_cast<uPtr>(block_ptr), m_blk_size));
+            auto* block = new (block_ptr) SlabBlock(m_obj_size, m_blk_size, page_backed);
             m_free_blocks.append(*block);
+            m_free_bytes += block->total_bytes();
+            m_empty_blocks++;
         }
 
         SlabBlock& block = m_free_blocks.front();
+        if (block.allocated_objects == 0) m_empty_blocks--;
         void* allocation = block.allocate();
         // If block now full, place in other list.
         if (block.allocated_objects == block.total_objects) {
             m_free_blocks.remove(block);
             m_full_blocks.append(block);
         }
+        m_counters.record_allocation(m_obj_size);
+        m_free_bytes -= m_obj_size;
         return allocation;
     }
 
@@ -191,37 +261,113 @@ public:
             m_free_blocks.append(*block);
         }
         block->deallocate(ptr);
+        m_counters.record_free(m_obj_size);
+        m_free_bytes += m_obj_size;
+        if (block->allocated_objects != 0) return;
+        // Return empty blocks to the PageAllocator, but keep one around to avoid thrashing.
+        if (block->page_backed && m_empty_blocks > 0) {
+            m_free_blocks.remove(*block);
+            m_page_blocks--;
+            m_free_bytes -= block->total_bytes();
+            mem::PageAllocator::the().free_region(mem::VirtualPtr{reinterpret_cast<u8*>(block)});
+        } else {
+            m_empty_blocks++;
+        }
     }
 
     [[nodiscard]] uSize total_bytes() const {
         return (m_free_blocks.size() + m_full_blocks.size()) * m_blk_size;
     }
-    [[nodiscard]] uSize free_bytes() const {
-        uSize free = 0;
-        for (auto& item : m_free_blocks) {
-            free += item.free_bytes();
-        }
-        return free;
-    }
+    /// Bytes of blocks taken from the PageAllocator, rather than the heap arenas.
+    [[nodiscard]] uSize page_backed_bytes() const { return m_page_blocks * m_blk_size; }
+    [[nodiscard]] uSize free_bytes() const { return m_free_bytes; }
+    [[nodiscard]] const SizeClassCounters& counters() const { return m_counters; }
 
 private:
     SlabBlock::List m_free_blocks;
     SlabBlock::List m_full_blocks;
     uSize m_obj_size;
     uSize m_blk_size;
+    uSize m_page_blocks{0};
+    /// Blocks in m_free_blocks with nothing allocated from them.
+    uSize m_empty_blocks{0};
+    uSize m_free_bytes{0};
+    SizeClassCounters m_counters;
 };
 
 struct KernelAllocator {
-    KernelAllocator(char* initial_start, uSize initial_size)
-        : m_bitmap_allocator(initial_start, initial_size) {}
+    /// Size of each arena added once the existing ones are full. Must fit the largest bitmap allocation.
+    static constexpr uSize ARENA_PAGES = 64;
+
+    /// Adds the arena to be used before the PageAllocator is available. It is never returned.
+    void add_initial_arena(char* start, uSize size) { add_arena(*BitmapAllocator::create_in(start, size, false)); }
 
-    mem::AllocatedRegion allocate(uSize size, uSize align) {
+    void add_arena(BitmapAllocator& arena) {
+        m_arenas.append(arena);
+        m_arena_total_bytes += arena.total_bytes();
+        m_arena_free_bytes += arena.free_bytes();
+        if (arena.page_backed()) m_empty_page_arenas++;
+    }
+
+    void* allocate_from_arena(BitmapAllocator& arena, uSize size, uSize align) {
+        auto was_empty   = arena.empty();
+        auto free_before = arena.free_bytes();
+        auto* ptr        = arena.allocate(size, align);
+        m_arena_free_bytes -= free_before - arena.free_bytes();
+        if (ptr && was_empty && arena.page_backed()) m_empty_page_arenas--;
+        return ptr;
+    }
+
+    void* allocate_from_arenas(uSize size, uSize align) {
+        for (auto& arena : m_arenas) {
+            if (auto* ptr = allocate_from_arena(arena, size, align)) return ptr;
+        }
+        auto region = mem::PageAllocator::the().allocate_region(ARENA_PAGES);
+        if (!region) return nullptr;
+        auto* arena = BitmapAllocator::create_in(reinterpret_cast<char*>(region->start.get()), region->size, true);
+        add_arena(*arena);
+        DBG::dbgln("Added heap arena at {}."_sv, region->start);
+        return allocate_from_arena(*arena, size, align);
+    }
+
+    void free_to_arenas(void* ptr, uSize size) {
+        for (auto& arena : m_arenas) {
+            if (arena.owns(ptr)) {
+                auto free_before = arena.free_bytes();
+                arena.free(ptr, size);
+                m_arena_free_bytes += arena.free_bytes() - free_before;
+                if (!arena.empty() || !arena.page_backed()) return;
+                // Return empty arenas to the PageAllocator, but keep one around to avoid thrashing.
+                if (m_empty_page_arenas > 0) {
+                    m_arenas.remove(arena);
+                    m_arena_total_bytes -= arena.total_bytes();
+                    m_arena_free_bytes -= arena.free_bytes();
+                    mem::PageAllocator::the().free_region(mem::VirtualPtr{reinterpret_cast<u8*>(&arena)});
+                } else {
+                    m_empty_page_arenas++;
+                }
+                return;
+            }
+        }
+        PANIC("Freeing pointer not in kernel heap.");
+    }
+
+    mem::AllocatedRegion allocate(uSize size, uSize align, bool contiguous) {
         if (size >= 64 * KiB) {
             VERIFY(align <= PAGE_SIZE);
             auto pages = bek::ceil_div(size, (uSize)PAGE_SIZE);
-            if (auto region = mem::PageAllocator::the().allocate_region(pages)) {
+            // Large physically contiguous runs become scarce as memory fragments, so only take one when needed.
+            bek::optional<mem::VirtualRegion> region;
+            if (contiguous || !mem::MemoryManager::is_initialised()) {
+                region = mem::PageAllocator::the().allocate_region(pages);
+            } else {
+                region = mem::MemoryManager::the().allocate_virtual(pages);
+            }
+            if (region) {
+                m_page_counters.record_allocation(region->size);
                 return {region->start.get(), region->size};
             } else {
+                m_page_counters.record_failure();
                 return {nullptr, 0};
             }
         }
@@ -232,14 +378,26 @@ struct KernelAllocator {
             }
         }
 
-        return {m_bitmap_allocator.allocate(size, align), size};
+        auto* ptr = allocate_from_arenas(size, align);
+        if (ptr) {
+            m_arena_counters.record_allocation(size);
+        } else {
+            m_arena_counters.record_failure();
+        }
+        return {ptr, size};
     }
 
     void free(void* ptr, uSize size, uSize align) {
         if (size >= 64 * KiB) {
             VERIFY(align <= PAGE_SIZE);
             VERIFY((uPtr)ptr % PAGE_SIZE == 0);
-            mem::PageAllocator::the().free_region(mem::VirtualPtr{static_cast<u8*>(ptr)});
+            if (mem::MemoryManager::is_virtual_allocation(ptr)) {
+                mem::MemoryManager::the().free_virtual(mem::VirtualPtr{static_cast<u8*>(ptr)});
+            } else {
+                mem::PageAllocator::the().free_region(mem::VirtualPtr{static_cast<u8*>(ptr)});
+            }
+            m_page_counters.record_free(bek::align_up(size, (uSize)PAGE_SIZE));
+            return;
         }
 
         for (auto& allocator : m_slab_allocators) {
@@ -248,25 +406,50 @@ struct KernelAllocator {
                 return;
             }
         }
-        m_bitmap_allocator.free(ptr, size);
+        free_to_arenas(ptr, size);
+        m_arena_counters.record_free(size);
     }
 
-    [[nodiscard]] uSize total_bytes() const { return m_bitmap_allocator.total_bytes(); }
+    [[nodiscard]] uSize total_bytes() const {
+        uSize total = m_arena_total_bytes;
+        for (auto& allocator : m_slab_allocators) {
+            total += allocator.page_backed_bytes();
+        }
+        return total;
+    }
     [[nodiscard]] uSize free_bytes() const {
-        uSize free = m_bitmap_allocator.free_bytes();
+        uSize free = m_arena_free_bytes;
         for (auto& allocator : m_slab_allocators) {
             free += allocator.free_bytes();
         }
         return free;
     }
 
-    BitmapAllocator m_bitmap_allocator;
+    void get_stats(sc::KernelHeapStats& stats) const {
+        static_assert(sizeof(m_slab_allocators) / sizeof(SlabAllocator) + 2 == sc::HEAP_SIZE_CLASS_COUNT);
+        stats.total_bytes = total_bytes();
+        stats.free_bytes  = free_bytes();
+        uSize i           = 0;
+        for (auto& allocator : m_slab_allocators) {
+            stats.size_classes[i++] = allocator.counters().to_stats(allocator.object_size());
+        }
+        stats.size_classes[i++] = m_arena_counters.to_stats(64 * KiB - 1);
+        stats.size_classes[i++] = m_page_counters.to_stats(0);
+    }
+
+    BitmapAllocator::List m_arenas;
+    uSize m_arena_total_bytes{0};
+    uSize m_arena_free_bytes{0};
+    /// Page-backed arenas with nothing allocated from them.
+    uSize m_empty_page_arenas{0};
+    SizeClassCounters m_arena_counters;
+    SizeClassCounters m_page_counters;
     SlabAllocator m_slab_allocators[6] = {SlabAllocator{32},  SlabAllocator{64},
                                           SlabAllocator{128}, SlabAllocator{256},
                                           SlabAllocator{512}, SlabAllocator{1024}};
 };
 
-// FIXME BAD BAD BAD
+// Heap used until the PageAllocator is available - afterwards, the heap grows from it.
 inline constexpr uSize INITIAL_ALLOCATION_SPACE_SIZE = 1 * MiB;
 alignas(BitmapAllocator::chunk_size) static char initial_allocation_space
     [INITIAL_ALLOCATION_SPACE_SIZE];
@@ -274,15 +457,18 @@ alignas(BitmapAllocator::chunk_size) static char initial_allocation_space
 bek::optional<KernelAllocator> global_kernel_allocator{};
 
 void mem::initialise_kmalloc() {
-    global_kernel_allocator =
-        KernelAllocator{initial_allocation_space, INITIAL_ALLOCATION_SPACE_SIZE};
+    global_kernel_allocator = KernelAllocator{};
+    global_kernel_allocator->add_initial_arena(initial_allocation_space, INITIAL_ALLOCATION_SPACE_SIZE);
 }
 
 mem::AllocatedRegion mem::allocate(uSize size, uSize align) {
-    auto res = global_kernel_allocator->allocate(size, align);
-    if (!res.pointer) DBG::dbgln("Failed to allocate."_sv);
-    DBG::dbgln("{} of {} bytes remaining."_sv, global_kernel_allocator->free_bytes(),
-               global_kernel_allocator->total_bytes());
+    auto res = global_kernel_allocator->allocate(size, align, false);
+    if (!res.pointer) DBG::dbgln("Failed to allocate {} bytes."_sv, size);
+    return res;
+}
+mem::AllocatedRegion mem::allocate_contiguous(uSize size, uSize align) {
+    auto res = global_kernel_allocator->allocate(size, align, true);
+    if (!res.pointer) DBG::dbgln("Failed to allocate {} contiguous bytes."_sv, size);
     return res;
 }
 void mem::free(void* ptr, uSize size, uSize align) {
@@ -293,6 +479,7 @@ void mem::free(void* ptr, uSize size, uSize align) {
 bek::pair<uSize, uSize> mem::get_kmalloc_usage() {
     return {global_kernel_allocator->free_bytes(), global_kernel_allocator->total_bytes()};
 }
+void mem::get_kmalloc_stats(sc::KernelHeapStats& stats) { global_kernel_allocator->get_stats(stats); }
 void mem::log_kmalloc_usage() {
     auto [free_mem, total_mem] = mem::get_kmalloc_usage();
     DBG::warnln("Memory: {} of {} bytes used ({}%)."_sv, total_mem - free_mem, total_mem,
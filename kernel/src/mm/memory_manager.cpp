@@ -19,6 +19,14 @@
 #include "mm/memory_manager.h"
 
 #include "bek/format.h"
+#include "interrupts/int_ctrl.h"
+#include "library/debug.h"
+
+using DBG = DebugScope<"MemoryManager", DebugLevel::WARN>;
+
+extern "C" {
+extern u8 __kernel_start, __kernel_end;
+}
 
 namespace mem {
 
@@ -83,15 +91,21 @@ MemoryManager& MemoryManager::the() {
     VERIFY(memoryManager);
     return *memoryManager;
 }
-void MemoryManager::initialise(const bek::vector<AnnotatedRegion>& regions,
-                               u8* current_embedded_table) {
+bool MemoryManager::is_initialised() { return memoryManager; }
+ErrorCode MemoryManager::initialise(const bek::vector<AnnotatedRegion>& regions,
+                                    u8* current_embedded_table) {
     memoryManager = new MemoryManager(current_embedded_table);
     for (auto& region : regions) {
         if (region.kind == AnnotatedRegion::Kind::Memory) {
             auto v_region = memoryManager->map_normal_memory(region.region);
+            if (auto r = memoryManager->map_uncached_alias(region.region); r != ESUCCESS) return r;
             PageAllocator::the().register_new_region(v_region);
         }
     }
+    // The early kmalloc arena lives in the kernel image, and DMA buffers may be carved from it.
+    PhysicalRegion kernel_region{*kernel_virt_to_phys(&__kernel_start),
+                                 static_cast<uSize>(&__kernel_end - &__kernel_start)};
+    return memoryManager->map_uncached_alias(kernel_region.align_to_page());
 }
 
 MemoryManager::MemoryManager(u8* current_embedded_table)
@@ -105,6 +119,92 @@ VirtualRegion MemoryManager::map_normal_memory(PhysicalRegion region) {
     return {{reinterpret_cast<u8*>(v_ptr)}, region.size};
 }
 
+ErrorCode MemoryManager::map_uncached_alias(PhysicalRegion region) {
+    if (!m_table_manager.map_region(VA_DMA_OFFSET + region.start.get(), region.start.get(), region.size,
+                                    AttributesRWnE, NormalUncached)) {
+        DBG::errln("Could not map uncached alias of {:XL} ({:XL})."_sv, region.start.get(), region.size);
+        return ENOMEM;
+    }
+    return ESUCCESS;
+}
+
+bek::optional<VirtualRegion> MemoryManager::allocate_virtual(uSize pages) {
+    // First fit, leaving a guard page after each area.
+    uSize size = (pages + 1) * PAGE_SIZE;
+    uPtr start = VA_VMALLOC_OFFSET;
+    VirtualArea* next_area = nullptr;
+    for (auto& area : m_virtual_areas) {
+        if (start + size <= area.start) {
+            next_area = &area;
+            break;
+        }
+        start = area.start + area.size;
+    }
+    if (start + size > VA_VMALLOC_OFFSET + VA_VMALLOC_SIZE) return {};
+
+    // Map pages in physically contiguous runs where the allocator happens to give us them.
+    uPtr run_start = start;
+    uPtr run_phys  = 0;
+    uSize run_size = 0;
+    for (uSize i = 0; i < pages; i++) {
+        auto page = PageAllocator::the().allocate_region(1);
+        if (!page) {
+            DBG::warnln("Out of pages for virtual allocation of {} pages."_sv, pages);
+            if (run_size) m_table_manager.map_region(run_start, run_phys, run_size, AttributesRWnE, NormalRAM);
+            release_virtual_pages(start, run_start + run_size - start);
+            return {};
+        }
+        auto phys = kernel_virt_to_phys(page->start.get())->get();
+        if (run_size && phys == run_phys + run_size) {
+            run_size += PAGE_SIZE;
+            continue;
+        }
+        if (run_size) {
+            VERIFY(m_table_manager.map_region(run_start, run_phys, run_size, AttributesRWnE, NormalRAM));
+        }
+        run_start += run_size;
+        run_phys = phys;
+        run_size = PAGE_SIZE;
+    }
+    if (run_size) {
+        VERIFY(m_table_manager.map_region(run_start, run_phys, run_size, AttributesRWnE, NormalRAM));
+    }
+
+    auto* area = new VirtualArea{start, size, {}};
+    if (next_area) {
+        m_virtual_areas.insert_before(*next_area, *area);
+    } else {
+        m_virtual_areas.append(*area);
+    }
+    return VirtualRegion{{reinterpret_cast<u8*>(start)}, pages * PAGE_SIZE};
+}
+
+void MemoryManager::free_virtual(VirtualPtr start) {
+    for (auto& area : m_virtual_areas) {
+        if (area.start == reinterpret_cast<uPtr>(start.get())) {
+            release_virtual_pages(area.start, area.size - PAGE_SIZE);
+            m_virtual_areas.remove(area);
+            delete &area;
+            return;
+        }
+    }
+    PANIC("Freeing unknown virtual allocation.");
+}
+
+void MemoryManager::release_virtual_pages(uPtr start, uSize size) {
+    if (!size) return;
+    // The pages must be looked up while still mapped, but must not be handed out again until they are unmapped.
+    // Nothing else can allocate in between: other CPUs wait for the kernel lock, and interrupts are disabled.
+    InterruptDisabler disabler;
+    for (uPtr page = start; page < start + size; page += PAGE_SIZE) {
+        auto phys = kernel_virt_to_phys(reinterpret_cast<void*>(page));
+        VERIFY(phys);
+        PageAllocator::the().free_region(VirtualPtr{static_cast<u8*>(kernel_phys_to_virt(*phys))});
+    }
+    // One unmap, so one invalidation for the whole range.
+    VERIFY(m_table_manager.unmap_region(start, size));
+}
+
 DeviceArea MemoryManager::map_for_io(PhysicalRegion region) {
     auto aligned_region = region.align_to_page();
     auto r              = m_table_manager.map_region(VA_IDENT_OFFSET + aligned_region.start.get(),
@@ -19,91 +19,242 @@
 #include "mm/page_allocator.h"
 
 #include "bek/assertions.h"
+#include "bek/memory.h"
+#include "interrupts/int_ctrl.h"
+#include "library/debug.h"
 
-/// 00 = free; 11 = reserved, not end; 10 = reserved, end.
-constexpr u8 RESERVED_END     = 0b10;
-constexpr u8 RESERVED_NOT_END = 0b11;
+using DBG = DebugScope<"PageAlloc", DebugLevel::WARN>;
 
-mem::RegionPageAllocator::RegionPageAllocator(VirtualRegion region) : m_region{region} {
+/// Tag bytes, one per page. Only the first page of a block carries the block's tag; all other pages
+/// of a block are TAG_NONE.
+///  - Free block:      TAG_FREE | order
+///  - Allocated block: order, with TAG_CONTINUED set if the allocation continues into the next block.
+constexpr u8 TAG_ORDER_MASK = 0x3F;
+constexpr u8 TAG_FREE       = 0x40;
+constexpr u8 TAG_CONTINUED  = 0x80;
+constexpr u8 TAG_NONE       = TAG_ORDER_MASK;
+
+/// Smallest order such that 2^order >= n_pages.
+constexpr u8 order_for_pages(uSize n_pages) {
+    return n_pages <= 1 ? 0 : static_cast<u8>(64 - __builtin_clzl(n_pages - 1));
+}
+
+mem::RegionPageAllocator::RegionPageAllocator(VirtualRegion region)
+    : m_region{region}, m_page_count{region.size / PAGE_SIZE}, m_base_frame{region.start.raw() / PAGE_SIZE} {
     ASSERT(region.page_aligned());
-    // First, we need to work out how large our data area needs to be.
-    auto page_number = region.size / PAGE_SIZE;
-    // We need to round up here. One bit needed per page for each array.
-    auto bytes_per_bitmap = (page_number - 1) / 8 + 1;
-    auto pages_needed     = (bytes_per_bitmap * 2 - 1) / PAGE_SIZE + 1;
+    // One tag byte is needed per page, stored at the start of the region.
+    auto pages_needed = bek::ceil_div(m_page_count, static_cast<uSize>(PAGE_SIZE));
+    VERIFY(pages_needed < m_page_count);
 
     // TODO: Map into virtual memory. (How do we do this without mem allocation!?)
-    m_free_bitmap =
-        bek::mut_buffer{reinterpret_cast<char*>(region.start.get_bytes()), bytes_per_bitmap};
-    m_continuation_bitmap = bek::mut_buffer{m_free_bitmap.end(), bytes_per_bitmap};
+    m_page_tags = region.start.get_bytes();
+    bek::memset(m_page_tags, TAG_NONE, m_page_count);
+    for (uSize i = 0; i < pages_needed; i++) {
+        // Permanently allocated, as order 0 blocks.
+        m_page_tags[i] = 0;
+    }
 
-    mark_as_reserved(0, pages_needed);
+    carve_free_range(pages_needed, m_page_count);
 }
 
-void mem::RegionPageAllocator::mark_as_reserved(uSize index, uSize n_pages) {
-    auto end = index + n_pages;
+mem::RegionPageAllocator::FreeBlock* mem::RegionPageAllocator::block_at(uSize index) const {
+    return reinterpret_cast<FreeBlock*>(m_region.start.offset(index * PAGE_SIZE).get_bytes());
+}
 
-    for (; index < end; index++) {
-        auto byte_index = index / 8;
-        auto bit_index  = index % 8;
-        m_free_bitmap.data()[byte_index] |= 1 << bit_index;
-        if (index + 1 == end) {
-            m_continuation_bitmap.data()[byte_index] &= ~(1 << bit_index);
-        } else {
-            m_continuation_bitmap.data()[byte_index] |= 1 << bit_index;
+uSize mem::RegionPageAllocator::index_of(const FreeBlock* block) const {
+    return (reinterpret_cast<const u8*>(block) - m_region.start.get_bytes()) / PAGE_SIZE;
+}
+
+void mem::RegionPageAllocator::push_free(uSize index, u8 order) {
+    auto* block = block_at(index);
+    block->prev = nullptr;
+    block->next = m_free_lists[order];
+    if (block->next) block->next->prev = block;
+    m_free_lists[order] = block;
+
+    m_page_tags[index] = TAG_FREE | order;
+    m_free_pages += 1ul << order;
+}
+
+void mem::RegionPageAllocator::remove_free(uSize index, u8 order) {
+    auto* block = block_at(index);
+    if (block->prev) {
+        block->prev->next = block->next;
+    } else {
+        m_free_lists[order] = block->next;
+    }
+    if (block->next) block->next->prev = block->prev;
+
+    m_page_tags[index] = TAG_NONE;
+    m_free_pages -= 1ul << order;
+}
+
+/// Frees a single block, merging it with its buddy for as long as the buddy is also free.
+void mem::RegionPageAllocator::free_block(uSize index, u8 order) {
+    while (order < MAX_ORDER) {
+        auto buddy_frame = (m_base_frame + index) ^ (1ul << order);
+        if (buddy_frame < m_base_frame) break;
+        auto buddy = buddy_frame - m_base_frame;
+        if (buddy + (1ul << order) > m_page_count || m_page_tags[buddy] != (TAG_FREE | order)) {
+            break;
         }
+        remove_free(buddy, order);
+        m_page_tags[bek::max(index, buddy)] = TAG_NONE;
+        index = bek::min(index, buddy);
+        order++;
     }
+    push_free(index, order);
 }
 
-/// Warning - must be given valid index to first allocated page of get_region.
-void mem::RegionPageAllocator::mark_region_as_free(uSize start_index) {
-    m_last_freed = start_index;
-    for (;; start_index++) {
-        auto byte_index = start_index / 8;
-        auto bit_index  = start_index % 8;
-        // Clear reserved bit
-        m_free_bitmap.data()[byte_index] &= ~(1 << bit_index);
-        if (!(m_continuation_bitmap.data()[byte_index] & (1 << bit_index))) {
-            return;
+/// Places [start, end) on the free lists, as the largest naturally-aligned blocks which fit.
+void mem::RegionPageAllocator::carve_free_range(uSize start, uSize end) {
+    while (start < end) {
+        u8 order = MAX_ORDER;
+        while (order > 0 && (((m_base_frame + start) & ((1ul << order) - 1)) || start + (1ul << order) > end)) {
+            order--;
         }
+        push_free(start, order);
+        start += 1ul << order;
     }
 }
-uSize mem::RegionPageAllocator::search_for_free(uSize n_pages) {
-    auto page_number  = m_region.size / PAGE_SIZE;
-    auto region_begin = m_last_freed;
-    uSize region_size = 0;
-    for (uSize index = region_begin; index < page_number; index++) {
-        if (m_free_bitmap.data()[index / 8] & (1 << (index % 8))) {
-            // Not free
-            region_size  = 0;
-            region_begin = index + 1;
-        } else {
-            region_size++;
-            if (region_size == n_pages) {
-                return region_begin;
+
+void mem::RegionPageAllocator::reserve_page(uSize index) {
+    for (u8 order = 0; order <= MAX_ORDER; order++) {
+        auto head_frame = (m_base_frame + index) & ~((1ul << order) - 1);
+        // Larger blocks would start before the region too.
+        if (head_frame < m_base_frame) break;
+        auto head = head_frame - m_base_frame;
+        if (m_page_tags[head] != (TAG_FREE | order)) continue;
+
+        // Split the containing block, returning the halves which don't contain index.
+        remove_free(head, order);
+        while (order > 0) {
+            order--;
+            auto half = 1ul << order;
+            if (index >= head + half) {
+                push_free(head, order);
+                head += half;
+            } else {
+                push_free(head + half, order);
             }
         }
+        m_page_tags[index] = 0;
+        return;
     }
-    return -1;
+    // Page is not free - already allocated or reserved.
 }
+
 bek::optional<mem::VirtualPtr> mem::RegionPageAllocator::allocate_pages(uSize n_pages) {
-    auto region = search_for_free(n_pages);
-    if (region != static_cast<uSize>(-1)) {
-        mark_as_reserved(region, n_pages);
-        return m_region.start.offset(region * PAGE_SIZE);
-    } else {
-        return {};
+    if (n_pages == 0) return {};
+    auto order = order_for_pages(n_pages);
+    if (order > MAX_ORDER) return {};
+
+    auto found_order = order;
+    while (found_order <= MAX_ORDER && !m_free_lists[found_order]) {
+        found_order++;
     }
+    if (found_order > MAX_ORDER) return {};
+
+    auto index = index_of(m_free_lists[found_order]);
+    remove_free(index, found_order);
+    while (found_order > order) {
+        found_order--;
+        push_free(index + (1ul << found_order), found_order);
+    }
+
+    // Record the allocation as the binary decomposition of n_pages (largest blocks first), so that
+    // free_region can walk it, and return the unused tail of the block.
+    uSize position  = index;
+    uSize remaining = n_pages;
+    for (int o = order; o >= 0; o--) {
+        auto block_size = 1ul << o;
+        if (!(remaining & block_size)) continue;
+        remaining -= block_size;
+        m_page_tags[position] = static_cast<u8>(o) | (remaining ? TAG_CONTINUED : 0);
+        position += block_size;
+    }
+    carve_free_range(index + n_pages, index + (1ul << order));
+
+    return m_region.start.offset(index * PAGE_SIZE);
 }
+
 void mem::RegionPageAllocator::free_region(VirtualPtr region) {
     auto index = (region.page_base() - m_region.start) / PAGE_SIZE;
-    mark_region_as_free(index);
+    bool continued;
+    do {
+        auto tag = m_page_tags[index];
+        VERIFY(tag != TAG_NONE && !(tag & TAG_FREE));
+        auto order = static_cast<u8>(tag & TAG_ORDER_MASK);
+        continued  = tag & TAG_CONTINUED;
+        free_block(index, order);
+        index += 1ul << order;
+    } while (continued);
+}
+
+bek::optional<uSize> mem::RegionPageAllocator::allocated_block_containing(uSize index) const {
+    for (u8 order = 0; order <= MAX_ORDER; order++) {
+        auto head_frame = (m_base_frame + index) & ~((1ul << order) - 1);
+        if (head_frame < m_base_frame) break;
+        auto head = head_frame - m_base_frame;
+        auto tag  = m_page_tags[head];
+        // Blocks are aligned to their size, so smaller alignments of index fall inside the containing block, where
+        // tags are TAG_NONE - the first head found is the block's own.
+        if (tag == TAG_NONE) continue;
+        if (tag & TAG_FREE) return {};
+        return head;
+    }
+    return {};
+}
+
+void mem::RegionPageAllocator::split_allocation_at(uSize index) {
+    if (index >= m_page_count || m_page_tags[index] != TAG_NONE) return;
+    auto head = allocated_block_containing(index);
+    if (!head) return;
+    auto tag       = m_page_tags[*head];
+    auto order     = static_cast<u8>(tag & TAG_ORDER_MASK);
+    bool continued = tag & TAG_CONTINUED;
+    // Halve the block until index starts one. The left half always continues into the right, which takes
+    // over the block's own place in the allocation.
+    while (*head != index) {
+        order--;
+        auto half                  = 1ul << order;
+        m_page_tags[*head]        = order | TAG_CONTINUED;
+        m_page_tags[*head + half] = order | (continued ? TAG_CONTINUED : 0);
+        if (index >= *head + half) {
+            *head += half;
+        } else {
+            continued = true;
+        }
+    }
+}
+
+void mem::RegionPageAllocator::release_pages(VirtualPtr start, uSize n_pages) {
+    uSize index = (start.page_base() - m_region.start) / PAGE_SIZE;
+    uSize end   = index + n_pages;
+    VERIFY(end <= m_page_count);
+    split_allocation_at(index);
+    split_allocation_at(end);
+    // Whatever precedes the range no longer continues into it.
+    if (index > 0) {
+        if (auto previous = allocated_block_containing(index - 1)) m_page_tags[*previous] &= ~TAG_CONTINUED;
+    }
+    while (index < end) {
+        auto tag = m_page_tags[index];
+        VERIFY(tag != TAG_NONE && !(tag & TAG_FREE));
+        auto order = static_cast<u8>(tag & TAG_ORDER_MASK);
+        VERIFY(index + (1ul << order) <= end);
+        free_block(index, order);
+        index += 1ul << order;
+    }
 }
+
 void mem::RegionPageAllocator::mark_as_reserved(VirtualRegion region) {
     auto index = (region.start.page_base() - m_region.start) / PAGE_SIZE;
     auto len   = region.size / PAGE_SIZE;
-    VERIFY(index + len < m_region.size / PAGE_SIZE);
-    mark_as_reserved(index, region.size / PAGE_SIZE);
+    VERIFY(index + len <= m_page_count);
+    for (uSize i = index; i < index + len; i++) {
+        reserve_page(i);
+    }
 }
 
 void mem::PageAllocator::register_new_region(VirtualRegion region) {
@@ -131,6 +282,20 @@ mem::PageAllocator kernel_page_allocator{};
 
 mem::PageAllocator& mem::PageAllocator::the() { return kernel_page_allocator; }
 bek::optional<mem::VirtualRegion> mem::PageAllocator::allocate_region(uSize page_number) {
+    if (auto region = allocate_from_regions(page_number)) return region;
+
+    // Out of memory - the pre-zeroed pool is only a cache, so give it up.
+    InterruptDisabler disabler;
+    if (!m_zeroed_count) return {};
+    if (page_number == 1) {
+        return VirtualRegion{m_zeroed_pages[--m_zeroed_count], PAGE_SIZE};
+    }
+    while (m_zeroed_count) {
+        free_region(m_zeroed_pages[--m_zeroed_count]);
+    }
+    return allocate_from_regions(page_number);
+}
+bek::optional<mem::VirtualRegion> mem::PageAllocator::allocate_from_regions(uSize page_number) {
     for (auto& o_region : m_phys_regions) {
         if (!o_region) {
             return {};
@@ -153,3 +318,42 @@ void mem::PageAllocator::free_region(VirtualPtr start) {
     }
     PANIC("Tried to free page region not in memory.");
 }
+void mem::PageAllocator::release_pages(VirtualPtr start, uSize n_pages) {
+    for (auto& o_region : m_phys_regions) {
+        if (!o_region) {
+            break;
+        }
+        if (o_region->region().contains(start)) {
+            o_region->release_pages(start, n_pages);
+            return;
+        }
+    }
+    PANIC("Tried to free pages not in memory.");
+}
+bek::optional<mem::VirtualRegion> mem::PageAllocator::allocate_zeroed_page() {
+    {
+        InterruptDisabler disabler;
+        if (m_zeroed_count) {
+            return VirtualRegion{m_zeroed_pages[--m_zeroed_count], PAGE_SIZE};
+        }
+    }
+    auto page = allocate_region(1);
+    if (page) bek::memset(page->start.get(), 0, PAGE_SIZE);
+    return page;
+}
+mem::PageAllocator::RefillStatus mem::PageAllocator::refill_zeroed_pages(uSize budget) {
+    for (; budget; budget--) {
+        if (m_zeroed_count >= ZEROED_POOL_PAGES) return RefillStatus::Full;
+        auto page = allocate_from_regions(1);
+        if (!page) return RefillStatus::OutOfPages;
+        // Zero outside of the critical section - this is the slow part.
+        bek::memset(page->start.get(), 0, PAGE_SIZE);
+        InterruptDisabler disabler;
+        if (m_zeroed_count >= ZEROED_POOL_PAGES) {
+            free_region(page->start);
+            return RefillStatus::Full;
+        }
+        m_zeroed_pages[m_zeroed_count++] = page->start;
+    }
+    return m_zeroed_count >= ZEROED_POOL_PAGES ? RefillStatus::Full : RefillStatus::NotFull;
+}
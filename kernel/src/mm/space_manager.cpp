@@ -24,60 +24,168 @@ using DBG = DebugScope<"SpaceManager", DebugLevel::INFO>;
 constexpr inline uPtr virt_addr_start = 0x0000000000500000;
 
 expected<SpaceManager> SpaceManager::create() { return SpaceManager{TableManager::create_user_manager()}; }
+SpaceManager::SpaceManager(TableManager manager) : m_tables(bek::move(manager)) { add_gap_before(0); }
+SpaceManager::SpaceManager(TableManager manager, bek::vector<UserspaceRegion> regions)
+    : m_regions{bek::move(regions)}, m_tables{bek::move(manager)} {
+    for (uSize i = 0; i <= m_regions.size(); i++) {
+        add_gap_before(i);
+    }
+}
 bool SpaceManager::check_region(uPtr location, uSize size, MemoryOperation operation) {
-    mem::UserRegion check_region{location, size};
-    for (auto& region : m_regions) {
-        if (region.user_region.contains(check_region)) {
-            return (region.permissions & operation) == operation;
+    auto* region = find_region(location);
+    if (!region || !region->user_region.contains(mem::UserRegion{location, size})) return false;
+    return (region->permissions & operation) == operation;
+}
+u64 SpaceManager::translation_base() { return m_tables.translation_base(); }
+
+uSize SpaceManager::region_index_for(uPtr address) const {
+    uSize low = 0, high = m_regions.size();
+    while (low < high) {
+        auto mid = low + (high - low) / 2;
+        if (m_regions[mid].user_region.end().get() <= address) {
+            low = mid + 1;
+        } else {
+            high = mid;
         }
     }
-    return false;
+    return low;
 }
-uPtr SpaceManager::raw_root_ptr() const {
-    auto opt_addr = mem::kernel_virt_to_phys(m_tables.get_root_table());
-    VERIFY(opt_addr);
-    return opt_addr->get();
+UserspaceRegion* SpaceManager::find_region(uPtr address) {
+    auto i = region_index_for(address);
+    if (i < m_regions.size() && m_regions[i].user_region.start.get() <= address) return &m_regions[i];
+    return nullptr;
+}
+bek::optional<uPtr> SpaceManager::find_gap(uSize size, uPtr alignment) const {
+    // Best fit: take the smallest gap which fits, to leave large gaps for large regions. Aligning its start may
+    // push the region out of the smallest gap big enough - but never out of one alignment - 1 bigger.
+    if (auto* gap = m_gaps.lower_bound({size, 0});
+        gap && bek::align_up(gap->start, alignment) + size <= gap->start + gap->size) {
+        return bek::align_up(gap->start, alignment);
+    }
+    if (auto* gap = m_gaps.lower_bound({size + alignment - 1, 0})) {
+        return bek::align_up(gap->start, alignment);
+    }
+    return {};
+}
+bek::optional<SpaceManager::Gap> SpaceManager::gap_before(uSize index) const {
+    uPtr gap_start = virt_addr_start;
+    if (index > 0) gap_start = bek::max(gap_start, m_regions[index - 1].user_region.end().get());
+    uPtr gap_end = (index < m_regions.size()) ? m_regions[index].user_region.start.get() : USER_ADDR_MAX;
+    if (gap_end <= gap_start) return {};
+    return Gap{gap_end - gap_start, gap_start};
+}
+void SpaceManager::add_gap_before(uSize index) {
+    if (auto gap = gap_before(index)) VERIFY(m_gaps.insert(*gap));
+}
+void SpaceManager::remove_gap_before(uSize index) {
+    if (auto gap = gap_before(index)) VERIFY(m_gaps.remove(*gap));
 }
 
 ErrorCode SpaceManager::deallocate_userspace_region(uPtr location, uSize size) {
-    for (auto& region : m_regions) {
-        // TODO: support splitting regions.
-        if (region.user_region.start.get() == location && region.user_region.size == size) {
-            // LOCK?
-            auto res = region.backing->unmap_from_table(m_tables, region.user_region, 0);
-            if (res != ESUCCESS) return res;
+    mem::UserRegion range{location, size};
+    if (!size || !range.page_aligned()) return EINVAL;
+    auto first = region_index_for(location);
+    auto last  = first;
+    while (last < m_regions.size() && m_regions[last].user_region.overlaps(range)) last++;
+    if (first == last) return EINVAL;
 
-            auto to_deallocate = m_regions.extract(region);
-            return ESUCCESS;
-        }
+    // Regions only partly covered keep the rest as a region of their own. Create those first, so that
+    // failure leaves the address space untouched.
+    bek::optional<UserspaceRegion> head, tail;
+    if (auto& region = m_regions[first].user_region; region.start < range.start) {
+        head = EXPECTED_TRY(slice_region(m_regions[first], {region.start, location - region.start.get()}));
+    }
+    if (auto& region = m_regions[last - 1].user_region; region.end() > range.end()) {
+        tail = EXPECTED_TRY(
+            slice_region(m_regions[last - 1], {range.end(), region.end().get() - range.end().get()}));
+    }
+
+    // LOCK?
+    // Unmapping a page-aligned range cannot fail, so the regions are never left half unmapped.
+    for (uSize i = first; i < last; i++) {
+        auto& region = m_regions[i];
+        auto part    = region.user_region.intersection(range);
+        VERIFY(region.backing->unmap_from_table(m_tables, part, part.start.get() - region.user_region.start.get()) ==
+               ESUCCESS);
+    }
+    for (uSize i = first; i < last; i++) {
+        erase_region(first);
+    }
+    if (tail) insert_region(first, bek::move(*tail));
+    if (head) insert_region(first, bek::move(*head));
+    return ESUCCESS;
+}
+ErrorCode SpaceManager::discard_userspace_region(uPtr location, uSize size) {
+    mem::UserRegion range{location, size};
+    if (!size || !range.page_aligned()) return EINVAL;
+    auto first = region_index_for(location);
+    // The whole range must be allocated, and not shared with anyone else (who would not see it discarded).
+    uPtr covered = location;
+    uSize last   = first;
+    for (; covered < range.end().get(); last++) {
+        if (last == m_regions.size() || m_regions[last].user_region.start.get() > covered) return EINVAL;
+        if (m_regions[last].backing->ref_count() != 1) return EINVAL;
+        if (!m_regions[last].backing->can_discard()) return ENOTSUP;
+        covered = m_regions[last].user_region.end().get();
+    }
+
+    // Everything is checked, and discarding a page-aligned range cannot fail after that - so no region is left
+    // half discarded.
+    for (uSize i = first; i < last; i++) {
+        auto& region = m_regions[i];
+        auto part    = region.user_region.intersection(range);
+        VERIFY(region.backing->discard(m_tables, part, part.start.get() - region.user_region.start.get()) ==
+               ESUCCESS);
+    }
+    return ESUCCESS;
+}
+expected<UserspaceRegion> SpaceManager::slice_region(const UserspaceRegion& region, mem::UserRegion part) {
+    // Another address space shares the backing, and would not see it split.
+    if (region.backing->ref_count() != 1) return EINVAL;
+    auto backing =
+        EXPECTED_TRY(region.backing->slice(part.start.get() - region.user_region.start.get(), part.size));
+    return UserspaceRegion{part, bek::move(backing), region.name, region.permissions};
+}
+void SpaceManager::insert_region(uSize index, UserspaceRegion region) {
+    remove_gap_before(index);
+    if (index == m_regions.size()) {
+        m_regions.push_back(bek::move(region));
+    } else {
+        m_regions.insert(index, bek::move(region));
     }
-    return EINVAL;
+    add_gap_before(index);
+    add_gap_before(index + 1);
+}
+UserspaceRegion SpaceManager::erase_region(uSize index) {
+    remove_gap_before(index);
+    remove_gap_before(index + 1);
+    auto region = m_regions.pop(index);
+    add_gap_before(index);
+    return region;
 }
 expected<mem::UserRegion> SpaceManager::place_region(bek::optional<uPtr> location, MemoryOperation allowed_operations,
                                                      bek::string name, bek::shared_ptr<mem::BackingRegion> region) {
     uSize pages = bek::ceil_div(region->size(), (uSize)PAGE_SIZE);
     // FIXME: Overflow checks.
 
-    uPtr actual_location = virt_addr_start;
+    uPtr actual_location;
     if (location) {
         actual_location = *location;
-    } else if (m_regions.size() != 0) {
-        actual_location = bek::align_up((m_regions.back().user_region.end().ptr), (uPtr)PAGE_SIZE);
+    } else {
+        // Align large regions so that they can use block or contiguous-hint mappings.
+        uPtr alignment = (region->size() >= SIZE_2M) ? SIZE_2M : (region->size() >= SIZE_64K) ? SIZE_64K : PAGE_SIZE;
+        auto gap       = find_gap(pages * PAGE_SIZE, alignment);
+        if (!gap) return ENOMEM;
+        actual_location = *gap;
     }
     if (actual_location + region->size() > USER_ADDR_MAX) {
         return EINVAL;
     }
 
     mem::UserRegion desired_region{actual_location, pages * PAGE_SIZE};
-    uSize i;  // Insertion position
-    for (i = 0; i < m_regions.size(); i++) {
-        if (m_regions[i].user_region.overlaps(desired_region)) return {EADDRINUSE};
-
-        if (m_regions[i].user_region.start >= desired_region.end()) {
-            // Insertion point identified.
-            break;
-        }
-    }
+    // Insertion position: the first region ending after our start must begin after our end.
+    uSize i = region_index_for(actual_location);
+    if (i < m_regions.size() && m_regions[i].user_region.overlaps(desired_region)) return {EADDRINUSE};
 
     // Next, try to map it.
     if (auto res = region->map_into_table(m_tables, desired_region, 0,
@@ -88,11 +196,7 @@ expected<mem::UserRegion> SpaceManager::place_region(bek::optional<uPtr> locatio
         return res;
     }
 
-    if (i == m_regions.size()) {
-        m_regions.push_back(UserspaceRegion{desired_region, bek::move(region), bek::move(name), allowed_operations});
-    } else {
-        m_regions.insert(i, UserspaceRegion{desired_region, bek::move(region), bek::move(name), allowed_operations});
-    }
+    insert_region(i, UserspaceRegion{desired_region, bek::move(region), bek::move(name), allowed_operations});
     return desired_region;
 }
 void SpaceManager::debug_print() const {
@@ -102,48 +206,42 @@ void SpaceManager::debug_print() const {
     }
 }
 ErrorCode SpaceManager::deallocate_userspace_region(const bek::shared_ptr<mem::BackingRegion>& region) {
-    bool found = false;
-    do {
-        found = false;
-        for (auto& user_region : m_regions) {
-            if (user_region.backing == region) {
-                m_regions.extract(user_region);
-                found = true;
-                break;
-            }
+    for (uSize i = 0; i < m_regions.size();) {
+        if (m_regions[i].backing == region) {
+            erase_region(i);
+        } else {
+            i++;
         }
-    } while (found);
+    }
     return ESUCCESS;
 }
 
 expected<bek::shared_ptr<mem::UserOwnedAllocation>> SpaceManager::allocate_placed_region(
-    mem::UserRegion region, MemoryOperation allowed_operations, bek::str_view name) {
+    mem::UserRegion region, MemoryOperation allowed_operations, bek::str_view name, bool zeroed) {
     VERIFY(region.page_aligned());
-    auto allocation = EXPECTED_TRY(mem::UserOwnedAllocation::create_contiguous(region.size / PAGE_SIZE));
+    auto allocation = EXPECTED_TRY(mem::UserOwnedAllocation::create_scattered(region.size / PAGE_SIZE, zeroed));
     EXPECTED_TRY(place_region(region.start.ptr, allowed_operations, bek::string{name}, allocation));
     return allocation;
 }
 expected<bek::shared_ptr<mem::BackingRegion>> SpaceManager::get_shareable_region(mem::UserRegion user_region) {
-    for (auto& region : m_regions) {
-        if (region.user_region.contains(user_region)) {
-            if (region.user_region.start != user_region.start || region.user_region.size != user_region.size) {
-                DBG::infoln("Could not find exact match for a shareable region."_sv);
-                return EINVAL;
-            }
-            // Exact match
-            return region.backing;
-        }
+    auto* region = find_region(user_region.start.get());
+    if (!region || !region->user_region.contains(user_region)) return EINVAL;
+    if (region->user_region.start != user_region.start || region->user_region.size != user_region.size) {
+        DBG::infoln("Could not find exact match for a shareable region."_sv);
+        return EINVAL;
     }
-    return EINVAL;
+    // Exact match. Pages still shared with a fork must be copied now - a copy made by a later write fault
+    // would only be seen by the address space which faulted.
+    EXPECT_SUCCESS(region->backing->break_copy_on_write(
+        m_tables, region->user_region, (region->permissions & MemoryOperation::Read) != MemoryOperation::None,
+        (region->permissions & MemoryOperation::Write) != MemoryOperation::None,
+        (region->permissions & MemoryOperation::Execute) != MemoryOperation::None));
+    return region->backing;
 }
 expected<MemoryOperation> SpaceManager::get_allowed_operations(mem::UserRegion region) {
-    for (auto& other_region : m_regions) {
-        if (other_region.user_region.contains(region)) {
-            // Exact match
-            return other_region.permissions;
-        }
-    }
-    return EINVAL;
+    auto* other_region = find_region(region.start.get());
+    if (!other_region || !other_region->user_region.contains(region)) return EINVAL;
+    return other_region->permissions;
 }
 expected<SpaceManager> SpaceManager::clone_for_fork() {
     bek::vector<UserspaceRegion> regions{};
@@ -157,6 +255,13 @@ expected<SpaceManager> SpaceManager::clone_for_fork() {
             .permissions = old_region.permissions,
         });
         auto& new_region = regions.back();
+        if ((old_region.permissions & MemoryOperation::Write) != MemoryOperation::None &&
+            new_region.backing != old_region.backing) {
+            // Pages may now be shared copy-on-write, so must be write-protected in our mappings too.
+            if (auto res = remap_region(old_region); res != ESUCCESS) {
+                return res;
+            }
+        }
         if (auto res = new_region.backing->map_into_table(
                 manager, new_region.user_region, 0,
                 (new_region.permissions & MemoryOperation::Read) != MemoryOperation::None,
@@ -168,3 +273,54 @@ expected<SpaceManager> SpaceManager::clone_for_fork() {
     }
     return SpaceManager{bek::move(manager), bek::move(regions)};
 }
+ErrorCode SpaceManager::remap_region(UserspaceRegion& region) {
+    if (auto res = region.backing->unmap_from_table(m_tables, region.user_region, 0); res != ESUCCESS) {
+        return res;
+    }
+    return region.backing->map_into_table(m_tables, region.user_region, 0,
+                                          (region.permissions & MemoryOperation::Read) != MemoryOperation::None,
+                                          (region.permissions & MemoryOperation::Write) != MemoryOperation::None,
+                                          (region.permissions & MemoryOperation::Execute) != MemoryOperation::None);
+}
+expected<mem::PhysicalPtr> SpaceManager::resolve_physical(uPtr address) {
+    auto* region = find_region(address);
+    if (!region || (region->permissions & MemoryOperation::Read) == MemoryOperation::None) return EFAULT;
+    // A page shared copy-on-write is swapped for a copy on the next write, so writable regions translate as for a
+    // write, which breaks the sharing. Read-only ones never copy, so any present page will do.
+    bool writable = (region->permissions & MemoryOperation::Write) != MemoryOperation::None;
+    // At most one fault needs resolving, making the page present (and private).
+    for (int attempt = 0; attempt < 2; attempt++) {
+        u64 par;
+        if (writable) {
+            asm volatile("at s1e0w, %1\n"
+                         "isb\n"
+                         "mrs %0, par_el1"
+                         : "=r"(par)
+                         : "r"(address));
+        } else {
+            asm volatile("at s1e0r, %1\n"
+                         "isb\n"
+                         "mrs %0, par_el1"
+                         : "=r"(par)
+                         : "r"(address));
+        }
+        // PAR_EL1.F is clear on success, with the output address in bits 47:12.
+        if (!(par & 1)) return mem::PhysicalPtr{(par & 0xFFFF'FFFF'F000) | (address & (PAGE_SIZE - 1))};
+        if (auto r = handle_fault(address, writable); r != ESUCCESS) return r;
+    }
+    return EFAULT;
+}
+ErrorCode SpaceManager::handle_fault(uPtr address, bool is_write) {
+    auto* region = find_region(address);
+    if (!region) return EFAULT;
+    auto required = is_write ? MemoryOperation::Write : MemoryOperation::Read;
+    if ((region->permissions & required) == MemoryOperation::None) {
+        return EFAULT;
+    }
+    auto page_start = address & ~(static_cast<uPtr>(PAGE_SIZE) - 1);
+    return region->backing->resolve_fault(
+        m_tables, mem::UserRegion{page_start, PAGE_SIZE}, page_start - region->user_region.start.get(), is_write,
+        (region->permissions & MemoryOperation::Read) != MemoryOperation::None,
+        (region->permissions & MemoryOperation::Write) != MemoryOperation::None,
+        (region->permissions & MemoryOperation::Execute) != MemoryOperation::None);
+}
@@ -204,6 +204,29 @@ void ArmGIC::handle_interrupt() {
         ASSERT(interrupt_id >= 1020);
     }
 }
+void ArmGIC::initialise_secondary_cpu() {
+    // SGIs and PPIs (the first 32 ids) are banked per CPU, so were only set up for the boot CPU.
+    m_distributor_base.write<u32>(dist::IGROUPRn, 0u);
+    m_distributor_base.write<u32>(dist::ICENABLERn, ~0u);
+    m_distributor_base.write<u32>(dist::ICPENDRn, ~0u);
+    m_distributor_base.write<u32>(dist::ICACTIVERn, ~0u);
+    for (u32 i = 0; i < 32 / 4; i++) {
+        m_distributor_base.write<u32>(dist::IPRIORITYRn + i * 4,
+                                      (dist::IPRIORITY_DEFAULT << 24) | (dist::IPRIORITY_DEFAULT << 16) |
+                                          (dist::IPRIORITY_DEFAULT << 8) | dist::IPRIORITY_DEFAULT);
+    }
+
+    m_cpu_base.write<u32>(cpu::PMR, dist::IPRIORITY_LOWEST);
+    m_cpu_base.write<u32>(cpu::CTLR, cpu::CTLR_ENABLE);
+}
+bool ArmGIC::send_software_interrupt(u32 target_cpu, u32 id) {
+    if (target_cpu >= m_num_cpus || id >= 16) return false;
+    // Whatever the interrupt is about must be visible before it arrives.
+    asm volatile("dsb ishst" ::: "memory");
+    // Target list filter of 0 - send to the CPUs in the target list.
+    m_distributor_base.write<u32>(dist::SGIR, ((1u << target_cpu) << 16) | id);
+    return true;
+}
 
 extern InterruptController* global_intc;
 dev_tree::DevStatus ArmGIC::probe_devtree(dev_tree::Node& node, dev_tree::device_tree&, dev_tree::probe_ctx&) {
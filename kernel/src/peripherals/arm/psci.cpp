@@ -0,0 +1,137 @@
+/*
+ * bekOS is a basic OS for the Raspberry Pi
+ * Copyright (C) 2025 Bekos Contributors
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "peripherals/arm/psci.h"
+
+#include "library/debug.h"
+
+using DBG = DebugScope<"PSCI", DebugLevel::WARN>;
+
+namespace {
+
+enum class Conduit { None, HVC, SMC };
+
+/// Standard function IDs, from PSCI 0.2 onwards.
+constexpr u32 PSCI_0_2_FN64_CPU_ON = 0xC400'0003;
+
+constexpr i64 PSCI_SUCCESS            = 0;
+constexpr i64 PSCI_NOT_SUPPORTED      = -1;
+constexpr i64 PSCI_INVALID_PARAMETERS = -2;
+constexpr i64 PSCI_DENIED             = -3;
+constexpr i64 PSCI_ALREADY_ON         = -4;
+constexpr i64 PSCI_ON_PENDING         = -5;
+constexpr i64 PSCI_INVALID_ADDRESS    = -9;
+
+Conduit g_conduit = Conduit::None;
+u32 g_cpu_on_fn   = PSCI_0_2_FN64_CPU_ON;
+
+i64 psci_call(u64 function, u64 arg0, u64 arg1, u64 arg2) {
+    register u64 x0 asm("x0") = function;
+    register u64 x1 asm("x1") = arg0;
+    register u64 x2 asm("x2") = arg1;
+    register u64 x3 asm("x3") = arg2;
+    // SMCCC 1.0 leaves x4-x17 unpredictable.
+    if (g_conduit == Conduit::HVC) {
+        asm volatile("hvc #0"
+                     : "+r"(x0), "+r"(x1), "+r"(x2), "+r"(x3)
+                     :
+                     : "x4", "x5", "x6", "x7", "x8", "x9", "x10", "x11", "x12", "x13", "x14", "x15", "x16", "x17",
+                       "memory");
+    } else {
+        asm volatile("smc #0"
+                     : "+r"(x0), "+r"(x1), "+r"(x2), "+r"(x3)
+                     :
+                     : "x4", "x5", "x6", "x7", "x8", "x9", "x10", "x11", "x12", "x13", "x14", "x15", "x16", "x17",
+                       "memory");
+    }
+    return static_cast<i64>(x0);
+}
+
+ErrorCode to_error_code(i64 psci_result) {
+    switch (psci_result) {
+        case PSCI_SUCCESS:
+        case PSCI_ON_PENDING:
+            return ESUCCESS;
+        case PSCI_NOT_SUPPORTED:
+            return ENOTSUP;
+        case PSCI_INVALID_PARAMETERS:
+        case PSCI_INVALID_ADDRESS:
+            return EINVAL;
+        case PSCI_DENIED:
+            return EPERM;
+        case PSCI_ALREADY_ON:
+            return EADDRINUSE;
+        default:
+            return EFAIL;
+    }
+}
+
+}  // namespace
+
+ErrorCode psci::initialise(const dev_tree::device_tree& tree) {
+    dev_tree::Node* psci_node = nullptr;
+    bool is_v0_1              = false;
+    for (auto& child : tree.root_node->children) {
+        for (auto& compatible : child->compatible) {
+            if (compatible == "arm,psci-1.0"_sv || compatible == "arm,psci-0.2"_sv) {
+                psci_node = child.get();
+                break;
+            } else if (compatible == "arm,psci"_sv) {
+                psci_node = child.get();
+                is_v0_1   = true;
+            }
+        }
+        if (psci_node) break;
+    }
+    if (!psci_node) return ENODEV;
+
+    auto method_prop = psci_node->get_property("method"_sv);
+    if (!method_prop) return ENODEV;
+    auto method = dev_tree::parse_stringlist(*method_prop);
+    if (method.size() == 0) return EINVAL;
+    if (method[0] == "hvc"_sv) {
+        g_conduit = Conduit::HVC;
+    } else if (method[0] == "smc"_sv) {
+        g_conduit = Conduit::SMC;
+    } else {
+        DBG::errln("Unknown conduit {}."_sv, method[0]);
+        return ENOTSUP;
+    }
+
+    if (is_v0_1) {
+        // PSCI 0.1 has no standard function IDs - the device tree gives them.
+        auto cpu_on = dev_tree::get_property_u32(*psci_node, "cpu_on"_sv);
+        if (!cpu_on) {
+            g_conduit = Conduit::None;
+            return ENOTSUP;
+        }
+        g_cpu_on_fn = *cpu_on;
+    }
+    return ESUCCESS;
+}
+
+bool psci::is_available() { return g_conduit != Conduit::None; }
+
+ErrorCode psci::cpu_on(u64 target_mpidr, mem::PhysicalPtr entry, u64 context) {
+    if (!is_available()) return ENOTSUP;
+    auto result = psci_call(g_cpu_on_fn, target_mpidr, entry.get(), context);
+    if (result != PSCI_SUCCESS) {
+        DBG::warnln("CPU_ON {:Xl} failed: {}"_sv, target_mpidr, result);
+    }
+    return to_error_code(result);
+}
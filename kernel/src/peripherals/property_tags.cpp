@@ -23,6 +23,7 @@
 
 #include "bek/utility.h"
 #include "library/debug.h"
+#include "mm/dma_utils.h"
 #include "mm/kmalloc.h"
 
 using DBG = DebugScope<"PropTag", DebugLevel::WARN>;
@@ -51,8 +52,8 @@ bool property_tags::request_tags(void* tags, u32 tags_size) {
     // Pad - must be 16 byte aligned
     buffer_size += (buffer_size % 16) ? 16 - (buffer_size % 16) : 0;
 
-    // Hope kmalloc aligns 16
-    PropertyTagsBuffer* buffer = reinterpret_cast<PropertyTagsBuffer*>(kmalloc(buffer_size));
+    // Mailbox buffers must be 16-byte aligned, and are read by the VideoCore directly.
+    PropertyTagsBuffer* buffer = reinterpret_cast<PropertyTagsBuffer*>(kmalloc_contiguous(buffer_size, 16));
     bek::memset(buffer, 0, buffer_size);
     DBG::dbgln("Buffer address: {:XL}"_sv, reinterpret_cast<uPtr>(buffer));
     buffer->buffer_code = BUFFER_CODE_REQUEST;
@@ -63,18 +64,20 @@ bool property_tags::request_tags(void* tags, u32 tags_size) {
     u32 bus_addr = (u32)bus_address((uPtr)buffer);
     DBG::dbgln("Ready to send tags:"_sv);
     // ASSERT((buffer, buffer_size);
+    mem::dma_sync_after_write(buffer, buffer_size);
     write_barrier();
     m_mailbox.write(bus_addr);
     u32 result = m_mailbox.read();
     read_barrier();
+    mem::dma_sync_before_read(buffer, buffer_size);
     if (buffer->buffer_code != BUFFER_CODE_RESPONSE_SUCCESS || result != bus_addr) {
         DBG::warnln("Tag submission failure: response code = {:X}, result = {:X}"_sv, buffer->buffer_code, result);
-        kfree(buffer, buffer_size);
+        kfree(buffer, buffer_size, 16);
         return false;
     }
     DBG::dbgln("Tag submission success"_sv);
     bek::memcopy(tags, buffer->Tags, tags_size);
-    kfree(buffer, buffer_size);
+    kfree(buffer, buffer_size, 16);
     return true;
 }
 bool set_peripheral_power_state(property_tags& tags, BCMDevices device, bool state, bool wait) {
@@ -14,102 +14,249 @@
 // You should have received a copy of the GNU General Public License
 // along with this program.  If not, see <https://www.gnu.org/licenses/>.
 
+#include "arch/smp.h"
 #include "interrupts/int_ctrl.h"
 #include "library/debug.h"
 #include "library/intrusive_list.h"
+#include "peripherals/interrupt_controller.h"
 #include "peripherals/timer.h"
 
 using DBG = DebugScope<"Timing", DebugLevel::WARN>;
 
+extern InterruptController* global_intc;
+
 inline constexpr u64 operation_ns_estimate = 10;
 inline constexpr u64 nanoseconds_per_s = 1'000'000'000;
 
+/// Keeps pending timers in a hierarchical timing wheel. Level 0 has a slot per granule of ticks, and each level
+/// above has slots 64 times as wide. Timers keep their exact deadline - granules only decide which slot they are
+/// in - and the hardware is only ever programmed for the earliest deadline.
 class TimingManager {
 public:
     explicit TimingManager(bek::shared_ptr<TimerDevice>&& device)
         : m_device{bek::move(device)},
-          m_operation_ticks_estimate{(operation_ns_estimate * m_device->get_frequency()) / nanoseconds_per_s} {};
+          m_operation_ticks_estimate{(operation_ns_estimate * m_device->get_frequency()) / nanoseconds_per_s},
+          m_base{m_device->get_ticks() >> GRANULE_SHIFT},
+          m_home_cpu{smp::current_cpu_id()} {}
 
     ErrorCode schedule_callback(bek::function<TimerDevice::CallbackAction(u64)>&& action, long period_ns) {
         VERIFY(period_ns >= 0);
-        auto period = bek::max((period_ns * m_device->get_frequency()) / nanoseconds_per_s, m_operation_ticks_estimate);
-        auto* node = new TimingNode{bek::move(action), {}, period, 0};
-        if (!node) return ENOMEM;
-        queue_node(*node);
+        auto* timer = new timing::Timer{bek::move(action)};
+        if (!timer) return ENOMEM;
+        timer->m_owned = true;
+        arm(*timer, static_cast<u64>(period_ns));
         return ESUCCESS;
     }
 
+    void arm(timing::Timer& timer, u64 nanoseconds) {
+        auto period = bek::max(ns_to_ticks(nanoseconds), m_operation_ticks_estimate);
+        InterruptDisabler disabler;
+        if (timer.is_armed()) unlink(timer);
+        auto now = m_device->get_ticks();
+        // Nothing is pending, so the base can catch up without walking the wheel.
+        if (is_empty()) m_base = now >> GRANULE_SHIFT;
+        timer.m_deadline = now + period;
+        insert(timer);
+        if (timer.m_deadline < m_programmed_deadline) program_next();
+    }
+
+    void cancel(timing::Timer& timer) {
+        InterruptDisabler disabler;
+        // The hardware is left alone - at worst, it fires once with nothing to do.
+        if (timer.is_armed()) unlink(timer);
+    }
+
+    void reprogram() {
+        InterruptDisabler disabler;
+        program_next();
+    }
+
     uSize nanoseconds_since_start() { return m_device->get_ticks() * nanoseconds_per_s / m_device->get_frequency(); }
 
 private:
-    struct TimingNode {
-        bek::function<TimerDevice::CallbackAction(u64)> action;
-        bek::IntrusiveListNode<TimingNode> node;
-        /// The number of ticks between triggering.
-        uSize period;
-        /// The value of ticks at next trigger.
-        uSize next_trigger;
-        using List = bek::IntrusiveList<TimingNode, &TimingNode::node>;
-    };
+    static constexpr u64 GRANULE_SHIFT = 12;
+    static constexpr u64 SLOT_BITS     = 6;
+    static constexpr u64 SLOTS         = 1ull << SLOT_BITS;
+    static constexpr u64 SLOT_MASK     = SLOTS - 1;
+    static constexpr u64 LEVELS        = 5;
+    /// Timers further out than this many granules wait in the top level, and are reinserted as it turns.
+    static constexpr u64 MAX_DELTA     = (1ull << (LEVELS * SLOT_BITS)) - 1;
+    static constexpr u64 NO_DEADLINE   = ~0ull;
+
+    using TimerList = bek::IntrusiveList<timing::Timer, &timing::Timer::m_node>;
 
     bek::shared_ptr<TimerDevice> m_device;
-    TimingNode::List m_pending_timers;
     u64 m_operation_ticks_estimate;
+    TimerList m_wheel[LEVELS][SLOTS]{};
+    /// Bit n is set if slot n of the level holds any timers.
+    u64 m_occupied[LEVELS]{};
+    /// The granule being processed: everything before it has run.
+    u64 m_base;
+    u64 m_programmed_deadline{NO_DEADLINE};
+    u32 m_home_cpu;
+    bool m_in_trigger{false};
+
+    u64 ns_to_ticks(u64 nanoseconds) const {
+        auto frequency = m_device->get_frequency();
+        // Split, to not overflow with long sleeps.
+        return (nanoseconds / nanoseconds_per_s) * frequency +
+               ((nanoseconds % nanoseconds_per_s) * frequency) / nanoseconds_per_s;
+    }
+
+    void insert(timing::Timer& timer) {
+        // A deadline already passed goes in the slot currently being processed.
+        auto granule = bek::max(timer.m_deadline >> GRANULE_SHIFT, m_base);
+        auto delta   = granule - m_base;
+        u8 level     = 0;
+        while (level < LEVELS - 1 && delta >= (1ull << ((level + 1) * SLOT_BITS))) level++;
+        if (delta > MAX_DELTA) granule = m_base + MAX_DELTA;
+        auto slot = static_cast<u8>((granule >> (level * SLOT_BITS)) & SLOT_MASK);
 
-    void queue_node(TimingNode& node) {
-        if (node.period <= m_operation_ticks_estimate) {
-            DBG::dbgln("Warn: Short tick period: {}"_sv, node.period);
+        timer.m_level = level;
+        timer.m_slot  = slot;
+        m_wheel[level][slot].append(timer);
+        m_occupied[level] |= 1ull << slot;
+    }
+
+    void unlink(timing::Timer& timer) {
+        auto& list = m_wheel[timer.m_level][timer.m_slot];
+        list.remove(timer);
+        if (list.empty()) m_occupied[timer.m_level] &= ~(1ull << timer.m_slot);
+    }
+
+    /// Moves the timers in the slots of higher levels which the base has just reached down the wheel. Called when
+    /// the base reaches a new rotation of level 0.
+    void cascade() {
+        for (u64 level = 1; level < LEVELS; level++) {
+            auto slot  = (m_base >> (level * SLOT_BITS)) & SLOT_MASK;
+            auto& list = m_wheel[level][slot];
+            TimerList moving;
+            while (!list.empty()) moving.append(list.pop_front());
+            m_occupied[level] &= ~(1ull << slot);
+            while (!moving.empty()) insert(moving.pop_front());
+            // Only carry on up once this level has also gone round.
+            if (slot != 0) break;
         }
-        // This may get old - by design?
-        auto current_ticks = m_device->get_ticks();
-        node.next_trigger = current_ticks + node.period;
-        // Need to loop through.
-        bool inserted = false;
-        {
-            InterruptDisabler disabler;
-            for (auto& other_node : m_pending_timers) {
-                // FIXME: Assuming monotonically _increasing_ counter.
-                if (node.next_trigger < other_node.next_trigger) {
-                    // We insert!
-                    m_pending_timers.insert_before(other_node, node);  // Ruins iterator.
-                    inserted = true;
-                    break;
+    }
+
+    void run_expired(u64 now) {
+        auto now_granule = now >> GRANULE_SHIFT;
+        while (m_base <= now_granule) {
+            auto index = m_base & SLOT_MASK;
+            if (index == 0) cascade();
+
+            // Everything in an earlier granule is due, but only some of the current one may be. Timers are
+            // unlinked one at a time, as an action may arm or cancel others.
+            auto& slot = m_wheel[0][index];
+            while (true) {
+                timing::Timer* due = nullptr;
+                for (auto& timer : slot) {
+                    if (timer.m_deadline <= now) {
+                        due = &timer;
+                        break;
+                    }
                 }
+                if (!due) break;
+                unlink(*due);
+                run_timer(*due);
             }
-            if (!inserted) m_pending_timers.append(node);
+
+            if (m_base == now_granule) break;
+            m_base = bek::min(next_event(), now_granule);
         }
-        if (m_pending_timers.front_ptr() == &node) {
-            set_next_tick(node.period);
+    }
+
+    /// The first granule after the base where a slot needs to run or cascade.
+    u64 next_event() const {
+        u64 event = ~0ull;
+        for (u64 level = 0; level < LEVELS; level++) {
+            auto block = (m_base >> (level * SLOT_BITS)) + 1;
+            auto slot  = first_occupied_from(level, block & SLOT_MASK);
+            if (slot < 0) continue;
+            block += (static_cast<u64>(slot) - block) & SLOT_MASK;
+            event = bek::min(event, block << (level * SLOT_BITS));
         }
+        return event;
     }
 
-    void set_next_tick(u64 tick) {
-        m_device->schedule_callback([this]() { return on_trigger(); }, static_cast<long>(tick));
+    /// The first occupied slot of the level, in the order the base reaches them starting from start.
+    int first_occupied_from(u64 level, u64 start) const {
+        auto occupied = m_occupied[level];
+        if (!occupied) return -1;
+        auto rotated = start ? (occupied >> start) | (occupied << (SLOTS - start)) : occupied;
+        return static_cast<int>((start + __builtin_ctzll(rotated)) & SLOT_MASK);
     }
 
-    TimerDevice::CallbackAction on_trigger() {
+    bool is_empty() const {
+        for (auto occupied : m_occupied) {
+            if (occupied) return false;
+        }
+        return true;
+    }
+
+    void run_timer(timing::Timer& timer) {
         auto current_ticks = m_device->get_ticks();
-        auto* front_action = m_pending_timers.front_ptr();
-        while (front_action && front_action->next_trigger < current_ticks) {
-            front_action->node.remove();
-            if (auto result = front_action->action(current_ticks); result.is_reschedule()) {
-                // Period is in NANOSECONDS
-                front_action->period = (result.period * m_device->get_frequency()) / nanoseconds_per_s;
-                queue_node(*front_action);
-            } else {
-                delete front_action;
-                front_action = nullptr;
+        if (auto result = timer.m_action(current_ticks); result.is_reschedule()) {
+            // Period is in NANOSECONDS
+            if (!timer.is_armed()) {
+                timer.m_deadline =
+                    current_ticks + bek::max(ns_to_ticks(static_cast<u64>(result.period)), m_operation_ticks_estimate);
+                insert(timer);
             }
-            current_ticks = m_device->get_ticks();
-            front_action = m_pending_timers.front_ptr();
+        } else if (timer.m_owned) {
+            delete &timer;
+        }
+    }
+
+    /// The earliest deadline of any pending timer. Each level is ordered from the base, so this only needs to look
+    /// at the first occupied slot of each.
+    u64 next_deadline() {
+        u64 earliest = NO_DEADLINE;
+        for (u64 level = 0; level < LEVELS; level++) {
+            // Above level 0, the slot the base is in has already cascaded, so the order starts from the one after.
+            auto slot = first_occupied_from(level, ((m_base >> (level * SLOT_BITS)) + (level ? 1 : 0)) & SLOT_MASK);
+            if (slot < 0) continue;
+            for (auto& timer : m_wheel[level][slot]) {
+                earliest = bek::min(earliest, timer.m_deadline);
+            }
+        }
+        return earliest;
+    }
+
+    /// Called with interrupts disabled.
+    void program_next() {
+        // on_trigger programs the timer itself once it has finished running timers.
+        if (m_in_trigger) return;
+        if (smp::current_cpu_id() != m_home_cpu) {
+            // Only the CPU which owns the timer can program it.
+            global_intc->send_software_interrupt(m_home_cpu, smp::TIMER_SGI);
+            return;
         }
-        if (!front_action) {
+        auto deadline = next_deadline();
+        if (deadline == NO_DEADLINE) return;
+        m_programmed_deadline = deadline;
+        auto now              = m_device->get_ticks();
+        m_device->schedule_callback(
+            [this]() { return on_trigger(); },
+            bek::max<long>(deadline > now ? static_cast<long>(deadline - now) : 0,
+                           static_cast<long>(m_operation_ticks_estimate)));
+    }
+
+    TimerDevice::CallbackAction on_trigger() {
+        m_in_trigger = true;
+        run_expired(m_device->get_ticks());
+        m_in_trigger = false;
+
+        auto deadline = next_deadline();
+        if (deadline == NO_DEADLINE) {
+            m_programmed_deadline = NO_DEADLINE;
             return TimerDevice::CallbackAction::Cancel;
-        } else {
-            return TimerDevice::CallbackAction::Reschedule(
-                bek::max<long>(static_cast<long>(front_action->next_trigger - current_ticks),
-                               static_cast<long>(m_operation_ticks_estimate)));
         }
+        m_programmed_deadline = deadline;
+        auto now              = m_device->get_ticks();
+        return TimerDevice::CallbackAction::Reschedule(
+            bek::max<long>(deadline > now ? static_cast<long>(deadline - now) : 0,
+                           static_cast<long>(m_operation_ticks_estimate)));
     }
 };
 
@@ -143,14 +290,27 @@ ErrorCode timing::schedule_callback(bek::function<TimerDevice::CallbackAction(u6
 void timing::spindelay_us(uSize microseconds) {
     VERIFY(g_timing_manager);
     volatile bool completed = false;
-    auto r = g_timing_manager->schedule_callback(
-        [&completed](u64) {
-            completed = true;
-            return TimerDevice::CallbackAction::Cancel;
-        },
-        microseconds * 1000ul);
-    while (r == ESUCCESS && !completed) {
+    Timer timer{[&completed](u64) {
+        completed = true;
+        return TimerDevice::CallbackAction::Cancel;
+    }};
+    timer.arm(microseconds * 1000ul);
+    // The callback runs on the CPU with the timer, which needs the kernel lock to do so.
+    auto lock_depth = smp::kernel_lock_release_all();
+    while (!completed) {
         asm volatile("nop");
     }
+    smp::kernel_lock_reacquire(lock_depth);
+}
+void timing::reprogram() {
+    VERIFY(g_timing_manager);
+    g_timing_manager->reprogram();
+}
+void timing::Timer::arm(u64 nanoseconds) {
+    VERIFY(g_timing_manager);
+    g_timing_manager->arm(*this, nanoseconds);
+}
+void timing::Timer::cancel() {
+    if (g_timing_manager) g_timing_manager->cancel(*this);
 }
 uSize timing::nanoseconds_since_start() { return g_timing_manager->nanoseconds_since_start(); }
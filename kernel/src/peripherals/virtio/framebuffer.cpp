@@ -252,8 +252,8 @@ virtio::GraphicsDevice::GraphicsDevice(bek::own_ptr<MMIOTransport> transport, u3
       m_information(height, width, R8G8B8A8, false, true),
       m_framebuffer(m_transport->get_dma_pool().allocate(framebuffer_size(width, height), 1)),
       m_fb_info({{reinterpret_cast<u8*>(m_framebuffer.data())}, m_framebuffer.size()}, 4 * m_information.width,
-                bek::adopt_shared(
-                    new DeviceBackedRegion({*mem::kernel_virt_to_phys(m_framebuffer.data()), m_framebuffer.size()}))) {}
+                bek::adopt_shared(new DeviceBackedRegion(
+                    {*mem::kernel_virt_to_phys(m_framebuffer.data()), m_framebuffer.size()}, NormalUncached))) {}
 
 const FramebufferInfo& virtio::GraphicsDevice::front_buffer() const { return m_fb_info; }
 
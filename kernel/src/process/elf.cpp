@@ -223,20 +223,22 @@ expected<uPtr> ElfFile::load_into(SpaceManager& space) {
 
             bek::string name = create_region_name(m_file->name(), operations);
             auto region = EXPECTED_TRY(space.allocate_placed_region(aligned_region, operations, name.view()));
-            auto kernel_memory_region = region->kernel_mapped_region();
 
-            // Now we populate
-            if (region_start_offset) {
-                bek::memset(kernel_memory_region.start.get(), 0, region_start_offset);
-            }
-
-            KernelBuffer data_buffer{kernel_memory_region.start.offset(region_start_offset).get(), hdr.file_size};
-            auto length = EXPECTED_TRY(m_file->read_bytes(data_buffer, hdr.offset, hdr.file_size));
-            if (length < hdr.file_size) return EIO;
+            // Now we populate - the region may be physically scattered, so read into it run by run.
+            region->clear(0, region_start_offset);
+            auto r = region->for_each_kernel_run(
+                region_start_offset, hdr.file_size, [&](bek::mut_buffer run, uSize run_offset) -> ErrorCode {
+                    KernelBuffer data_buffer{run.data(), run.size()};
+                    auto length = m_file->read_bytes(data_buffer, hdr.offset + (run_offset - region_start_offset),
+                                                     run.size());
+                    if (length.has_error()) return length.error();
+                    return (length.value() < run.size()) ? EIO : ESUCCESS;
+                });
+            if (r != ESUCCESS) return r;
+            region->clear(region_start_offset + hdr.file_size, region->size() - (region_start_offset + hdr.file_size));
 
-            if (region_start_offset + hdr.file_size < kernel_memory_region.size) {
-                bek::memset(kernel_memory_region.start.offset(region_start_offset + hdr.file_size).get(), 0,
-                            kernel_memory_region.size - (region_start_offset + hdr.file_size));
+            if ((operations & MemoryOperation::Execute) != MemoryOperation::None) {
+                region->sync_instruction_cache();
             }
         }
     }
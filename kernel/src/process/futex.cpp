@@ -0,0 +1,83 @@
+/*
+ * bekOS is a basic OS for the Raspberry Pi
+ * Copyright (C) 2025 Bekos Contributors
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "process/futex.h"
+
+#include "library/intrusive_list.h"
+#include "peripherals/timer.h"
+#include "process/wait_queue.h"
+
+namespace {
+
+struct Waiter {
+    explicit Waiter(uPtr key) : key{key} {}
+
+    uPtr key;
+    bool woken{false};
+    /// Just this waiter, so that it can be woken individually.
+    WaitQueue queue;
+    bek::IntrusiveListNode<Waiter> node;
+};
+using WaiterList = bek::IntrusiveList<Waiter, &Waiter::node>;
+
+constexpr uSize BUCKET_COUNT = 64;
+/// Waiters in order of arrival, hashed by address.
+WaiterList g_buckets[BUCKET_COUNT];
+
+WaiterList& bucket_for(uPtr key) { return g_buckets[((key >> 2) ^ (key >> 12)) % BUCKET_COUNT]; }
+
+}  // namespace
+
+ErrorCode futex::wait(mem::PhysicalPtr address, u64 timeout_ns) {
+    Waiter waiter{address.get()};
+    auto& bucket = bucket_for(waiter.key);
+    bucket.append(waiter);
+
+    volatile bool timed_out = false;
+    timing::Timer timer{[&waiter, &timed_out](u64) {
+        timed_out = true;
+        waiter.queue.wake_one();
+        return TimerDevice::CallbackAction::Cancel;
+    }};
+    if (timeout_ns) timer.arm(timeout_ns);
+    bool finished = waiter.queue.wait_until([&waiter, &timed_out] { return waiter.woken || timed_out; });
+
+    if (waiter.node.is_linked()) bucket.remove(waiter);
+    if (waiter.woken) return ESUCCESS;
+    return finished ? ETIMEDOUT : EINTR;
+}
+
+u32 futex::wake(mem::PhysicalPtr address, u32 count) {
+    auto& bucket = bucket_for(address.get());
+    u32 woken    = 0;
+    while (woken < count) {
+        Waiter* next = nullptr;
+        for (auto& waiter : bucket) {
+            if (waiter.key == address.get()) {
+                next = &waiter;
+                break;
+            }
+        }
+        if (!next) break;
+        bucket.remove(*next);
+        next->woken = true;
+        next->queue.wake_one();
+        woken++;
+    }
+    return woken;
+}
@@ -64,23 +64,23 @@ void Server::detach_handle(ServerHandle& handle) {
 
 Connection::QueuedMessage::~QueuedMessage() { VERIFY(kind == DATA); }
 expected<uSize> Connection::client_receive(TransactionalBuffer& buffer, bool blocking) {
-    return read_from_queue(buffer, m_client_ringbuffer, m_client_queue, blocking);
+    return read_from_queue(buffer, m_client_channel, blocking);
 }
 expected<uSize> Connection::send_to_client(TransactionalBuffer& buffer, bool blocking) {
-    return write_to_queue(buffer, m_client_ringbuffer, m_client_queue, blocking);
+    return write_to_queue(buffer, m_client_channel, blocking);
 }
 expected<uSize> Connection::server_read(TransactionalBuffer& buffer, bool blocking) {
-    return read_from_queue(buffer, m_server_ringbuffer, m_server_queue, blocking);
+    return read_from_queue(buffer, m_server_channel, blocking);
 }
 expected<uSize> Connection::send_to_server(TransactionalBuffer& buffer, bool blocking) {
-    return write_to_queue(buffer, m_server_ringbuffer, m_server_queue, blocking);
+    return write_to_queue(buffer, m_server_channel, blocking);
 }
 
 Connection::~Connection() { m_server->detach_connection(*this); }
-expected<uSize> Connection::write_to_queue(TransactionalBuffer& buffer, ring_buffer& binary_queue,
-                                           bek::vector<Connection::QueuedMessage>& message_queue, bool blocking) {
+expected<uSize> Connection::write_to_queue(TransactionalBuffer& buffer, Channel& channel, bool blocking) {
+    auto& binary_queue  = channel.ringbuffer;
+    auto& message_queue = channel.queue;
     // We need the ringbuffer to contain enough space for our message.
-    // Blocking currently makes no difference.
 
     // First, read and verify the buffer.
     auto header = EXPECTED_TRY(buffer.read_object<MessageHeader>());
@@ -114,6 +114,11 @@ expected<uSize> Connection::write_to_queue(TransactionalBuffer& buffer, ring_buf
             TransactionalBufferSubset to_write{buffer, payload_item.data.offset, payload_item.data.len};
             auto res = binary_queue.write_to(to_write, false);
             while (res.has_error() && res.error() == EAGAIN && blocking) {
+                // Let the receiver drain what's already queued.
+                channel.receivers.wake_all();
+                if (!channel.senders.wait_until([&] { return binary_queue.free_bytes() >= payload_item.data.len; })) {
+                    return EINTR;
+                }
                 res = binary_queue.write_to(to_write, false);
             }
             message_queue.push_back(QueuedMessage(is_final, header.message_id, EXPECTED_TRY(res)));
@@ -135,10 +140,12 @@ expected<uSize> Connection::write_to_queue(TransactionalBuffer& buffer, ring_buf
                 QueuedMessage(is_final, header.message_id, bek::move(shareable_memory), allowed_ops));
         }
     }
+    channel.receivers.wake_all();
     return total_data_size;
 }
-expected<uSize> Connection::read_from_queue(TransactionalBuffer& buffer, ring_buffer& binary_queue,
-                                            bek::vector<Connection::QueuedMessage>& message_queue, bool blocking) {
+expected<uSize> Connection::read_from_queue(TransactionalBuffer& buffer, Channel& channel, bool blocking) {
+    auto& binary_queue  = channel.ringbuffer;
+    auto& message_queue = channel.queue;
     // First, check we have enough size.
     u32 payload_items = 0;
     uSize total_data_size = 0;
@@ -146,9 +153,7 @@ expected<uSize> Connection::read_from_queue(TransactionalBuffer& buffer, ring_bu
     if (message_queue.size() == 0 && !blocking) {
         return EAGAIN;
     }
-    while (message_queue.size() == 0) {
-        asm volatile ("nop");
-    }
+    if (!channel.receivers.wait_until([&] { return message_queue.size() != 0; })) return EINTR;
     for (auto& payload_item : message_queue) {
         payload_items++;
         if (payload_item.kind == QueuedMessage::DATA) {
@@ -186,6 +191,7 @@ expected<uSize> Connection::read_from_queue(TransactionalBuffer& buffer, ring_bu
                                            .data = {.offset = current_data_offset, .len = item.data_size}},
                 payload_item_offset));
             current_data_offset += item.data_size;
+            channel.senders.wake_all();
         } else if (item.kind == QueuedMessage::ENTITY) {
             // FIXME: Group?
             auto res =
@@ -229,10 +235,14 @@ EntityHandle::SupportedOperations ServerHandle::get_supported_operations() const
 expected<bek::shared_ptr<Connection>> Server::connect() {
     auto connection = bek::adopt_shared(new Connection(this, INTERLINK_DEFAULT_RINGBUFFER_SIZE));
     m_pending_connections.push_back(connection);
+    m_acceptors.wake_one();
     return connection;
 }
 
-expected<bek::shared_ptr<Connection>> Server::accept() {
+expected<bek::shared_ptr<Connection>> Server::accept(bool blocking) {
+    if (blocking) {
+        if (!m_acceptors.wait_until([this] { return m_pending_connections.size() != 0; })) return EINTR;
+    }
     if (m_pending_connections.size()) {
         return m_pending_connections.pop();
     } else {
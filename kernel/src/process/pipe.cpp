@@ -24,11 +24,16 @@ Pipe::Pipe() : m_data(PIPE_DEFAULT_SIZE), m_read_idx{}, m_write_idx{} {}
 // NOTE: When read_idx == write_idx, the read head is behind the write head (nothing to read, lots to write)
 // So we can only write until write_idx + 1 == read_idx.
 
+uSize Pipe::read_space() const {
+    return (m_write_idx >= m_read_idx) ? m_write_idx - m_read_idx : m_data.size() - m_read_idx + m_write_idx;
+}
+uSize Pipe::write_space() const {
+    return (m_write_idx >= m_read_idx) ? m_data.size() - m_write_idx + m_read_idx - 1 : m_read_idx - m_write_idx - 1;
+}
+
 expected<uSize> Pipe::write(TransactionalBuffer& buffer, bool blocking) {
     // Total space available to write.
-    auto write_space =
-        (m_write_idx >= m_read_idx) ? m_data.size() - m_write_idx + m_read_idx - 1 : m_read_idx - m_write_idx - 1;
-    if (write_space < buffer.size() && !blocking) return EAGAIN;
+    if (write_space() < buffer.size() && !blocking) return EAGAIN;
 
     uSize bytes_written = 0;
     while (bytes_written < buffer.size()) {
@@ -36,6 +41,12 @@ expected<uSize> Pipe::write(TransactionalBuffer& buffer, bool blocking) {
         auto segment_write_space =
             (m_write_idx >= m_read_idx) ? m_data.size() - m_write_idx : m_read_idx - m_write_idx - 1;
         if (m_read_idx == 0) segment_write_space -= 1;
+        if (!segment_write_space) {
+            // Full - let the readers make room.
+            m_readers.wake_all();
+            if (!m_writers.wait_until([this] { return write_space() != 0; })) return EINTR;
+            continue;
+        }
 
         auto to_write = bek::min(segment_write_space, buffer.size() - bytes_written);
         EXPECTED_TRY(buffer.read_to(m_data.data() + m_write_idx, to_write, bytes_written));
@@ -43,14 +54,14 @@ expected<uSize> Pipe::write(TransactionalBuffer& buffer, bool blocking) {
         m_write_idx += to_write;
         if (m_write_idx == m_data.size()) m_write_idx = 0;
     }
+    m_readers.wake_all();
     return bytes_written;
 }
 expected<uSize> Pipe::read(TransactionalBuffer& buffer, bool blocking) {
-    uSize read_space;
-    do {
-        read_space = (m_write_idx >= m_read_idx) ? m_write_idx - m_read_idx : m_data.size() - m_read_idx + m_write_idx;
-    } while (!read_space && blocking);
-
+    if (blocking) {
+        if (!m_readers.wait_until([this] { return read_space() != 0; })) return EINTR;
+    }
+    auto read_space = this->read_space();
     if (!read_space) return EAGAIN;
 
     uSize bytes_read = 0;
@@ -62,7 +73,8 @@ expected<uSize> Pipe::read(TransactionalBuffer& buffer, bool blocking) {
         m_read_idx += to_read;
         if (m_read_idx == m_data.size()) m_read_idx = 0;
 
-        read_space = (m_write_idx >= m_read_idx) ? m_write_idx - m_read_idx : m_data.size() - m_read_idx + m_write_idx;
+        read_space = this->read_space();
     }
+    m_writers.wake_all();
     return bytes_read;
 }
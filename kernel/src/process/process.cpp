@@ -33,7 +33,10 @@ constexpr inline uSize KERNEL_STACK_PAGES = 3;
 constexpr inline uSize DEFAULT_USER_STACK = 4 * PAGE_SIZE;
 constexpr inline uSize MAX_USER_STACK = 1024 * PAGE_SIZE;
 
-constexpr inline uSize CONTEXT_SWITCH_NS = 100'000'00;  // 100ms
+/// Everything runnable should get a turn within this long.
+constexpr inline u64 SCHED_LATENCY_NS = 20'000'000;  // 20ms
+constexpr inline u64 MIN_QUANTUM_NS   = 2'000'000;   // 2ms
+constexpr inline u64 MAX_QUANTUM_NS   = 10'000'000;  // 10ms
 
 Process::Process(bek::string name, Process* parent, mem::VirtualRegion kernel_stack)
     : m_name(bek::move(name)),
@@ -42,13 +45,56 @@ Process::Process(bek::string name, Process* parent, mem::VirtualRegion kernel_st
       m_kernel_stack(kernel_stack),
       m_running_state{ProcessState::Unready} {}
 
+ProcessState Process::set_state(ProcessState new_state) {
+    auto old_state = bek::exchange(m_running_state, new_state);
+    if (old_state != new_state) ProcessManager::the().update_run_queue(*this);
+    return old_state;
+}
+
 void Process::quit_process(int exit_code) {
     DBG::warnln("Process {} ({}) quit with code {}."_sv, name(), pid(), exit_code);
-    m_running_state = ProcessState::AwaitingDeath;
     m_exit_code = exit_code;
+    {
+        // Once AwaitingDeath we never run again, so the parent must be woken before we can be preempted.
+        InterruptDisabler disabler;
+        set_state(ProcessState::AwaitingDeath);
+        auto& leader = thread_leader();
+        if (m_thread_leader) leader.m_thread_waiters.wake_all();
+        if (leader.m_parent) leader.m_parent->m_child_waiters.wake_all();
+    }
     ProcessManager::the().schedule();
     // TODO: What to do if fails.
 }
+void Process::exit_process(int exit_code) {
+    auto& leader = thread_leader();
+    if (!leader.m_group_exit_code) leader.m_group_exit_code = exit_code;
+    // Threads running elsewhere notice on their way back to userspace, so prod them to get there sooner. Blocked
+    // ones are woken to give up their wait.
+    if (m_thread_leader) {
+        WaitQueue::interrupt(leader);
+        smp::request_reschedule(leader.m_cpu);
+    }
+    for (auto* thread : leader.m_threads) {
+        if (thread == this) continue;
+        WaitQueue::interrupt(*thread);
+        smp::request_reschedule(thread->m_cpu);
+    }
+    quit_process(*leader.m_group_exit_code);
+}
+void Process::exit_if_requested() {
+    if (exit_requested()) quit_process(*thread_leader().m_group_exit_code);
+}
+bool Process::exit_requested() const {
+    auto& leader = m_thread_leader ? *m_thread_leader : *this;
+    return leader.m_group_exit_code && m_running_state != ProcessState::AwaitingDeath;
+}
+bool Process::has_exited() const {
+    if (m_running_state != ProcessState::AwaitingDeath) return false;
+    for (auto* thread : m_threads) {
+        if (thread->m_running_state != ProcessState::AwaitingDeath) return false;
+    }
+    return true;
+}
 expected<UserBuffer> Process::create_user_buffer(uPtr ptr, uSize size, bool for_writing) {
     if (!m_userspace_state->address_space_manager.check_region(
             ptr, size, for_writing ? MemoryOperation::Write : MemoryOperation::Read)) {
@@ -131,12 +177,11 @@ ErrorCode Process::execute_executable(fs::EntryRef executable, fs::EntryRef cwd,
     auto stack_suggestion = elf->get_sensible_stack_region(MAX_USER_STACK);
     mem::UserRegion stack_region{stack_suggestion.end() - DEFAULT_USER_STACK, DEFAULT_USER_STACK};
     auto stack = EXPECTED_TRY(
-        new_space.allocate_placed_region(stack_region, MemoryOperation::Read | MemoryOperation::Write, "stack"_sv));
+        new_space.allocate_placed_region(stack_region, MemoryOperation::Read | MemoryOperation::Write, "stack"_sv,
+                                         true));
 
     // Now we need to copy items onto stack.
     auto stack_offset = static_cast<iSize>(stack->size());
-    auto stack_bottom_ptr = stack->kernel_mapped_region().start;
-    bek::memset(stack->kernel_mapped_region().start.get(), 0, stack->size());
 
     auto put_string_on_stack = [&](const bek::string& str) {
         auto needed_size = str.size() + 1;
@@ -145,7 +190,7 @@ ErrorCode Process::execute_executable(fs::EntryRef executable, fs::EntryRef cwd,
             return ENOMEM;
         } else {
             stack_offset -= needed_size;
-            bek::memcopy(stack_bottom_ptr.offset(stack_offset).ptr, str.data(), needed_size);
+            stack->write(stack_offset, str.data(), needed_size);
             return ESUCCESS;
         }
     };
@@ -172,11 +217,15 @@ ErrorCode Process::execute_executable(fs::EntryRef executable, fs::EntryRef cwd,
         return ENOMEM;
     }
     stack_offset -= needed_size;
-    bek::memcopy(stack_bottom_ptr.offset(stack_offset).ptr, init_stack_ptr_array.data(),
-                 init_stack_ptr_array.size() * sizeof(uPtr));
+    stack->write(stack_offset, init_stack_ptr_array.data(), init_stack_ptr_array.size() * sizeof(uPtr));
 
-    m_userspace_state = UserspaceState{stack_region.start.offset(stack_offset), bek::move(cwd), bek::move(new_space),
-                                       bek::move(handles)};
+    auto new_state = bek::adopt_shared(new UserspaceState{stack_region.start.offset(stack_offset), bek::move(cwd),
+                                                          bek::move(new_space), bek::move(handles)});
+    if (&ProcessManager::the().current_process() == this) {
+        // Releasing the old state frees its tables, so stop using them first.
+        do_switch_user_address_space(new_state->address_space_manager.translation_base());
+    }
+    m_userspace_state = bek::move(new_state);
     m_name = bek::move(name);
 
     DBG::dbgln("Executing process {}. Address space:"_sv, this->name());
@@ -216,19 +265,18 @@ ErrorCode ProcessManager::initialise_and_adopt(bek::string name, mem::VirtualReg
 }
 
 ErrorCode ProcessManager::initialise_with_scheduling(bek::shared_ptr<Process> first_process) {
-    VERIFY(m_processes.size() == 0 && m_current == nullptr);
-    m_last_nanoseconds = timing::nanoseconds_since_start();
+    auto& cpu = this_cpu();
+    VERIFY(m_processes.size() == 0 && cpu.current == nullptr);
+    cpu.last_nanoseconds = timing::nanoseconds_since_start();
     first_process->m_pid = 0;
-    m_current = first_process.get();
+    first_process->m_cpu = smp::current_cpu_id();
+    cpu.current = first_process.get();
     m_processes.push_back(bek::move(first_process));
+    cpu.idle = EXPECTED_TRY(Process::spawn_kernel_process(bek::string{"idle"}, &idle_loop, nullptr));
+    cpu.idle->m_cpu = smp::current_cpu_id();
 
-    // Now start scheduler.
-    return timing::schedule_callback(
-        [](u64) {
-            VERIFY(deferred::queue_call([]() { g_process_manager->schedule(); }) == ESUCCESS);
-            return TimerDevice::CallbackAction::Reschedule(CONTEXT_SWITCH_NS);
-        },
-        CONTEXT_SWITCH_NS);
+    // There is no periodic tick - the preemption timer starts once a process has to wait for a CPU.
+    return ESUCCESS;
 }
 
 ProcessManager& ProcessManager::the() {
@@ -236,26 +284,79 @@ ProcessManager& ProcessManager::the() {
     return *g_process_manager;
 }
 
-Process& ProcessManager::current_process() { return *m_current; }
+void ProcessManager::adopt_secondary_cpu(mem::VirtualRegion kernel_stack) {
+    auto& cpu = this_cpu();
+    VERIFY(cpu.current == nullptr);
+    // We are already running on kernel_stack, so this becomes the CPU's idle task.
+    auto idle = bek::adopt_shared(new Process(bek::string{"idle"}, nullptr, kernel_stack));
+    VERIFY(idle);
+    idle->m_saved_registers = {};
+    cpu.current             = idle.get();
+    VERIFY(register_process(idle) == ESUCCESS);
+    idle->m_cpu          = smp::current_cpu_id();
+    cpu.idle             = bek::move(idle);
+    cpu.last_nanoseconds = timing::nanoseconds_since_start();
+    idle_loop(nullptr);
+}
+
+Process& ProcessManager::current_process() { return *this_cpu().current; }
+
+u64 ProcessManager::idle_nanoseconds() const {
+    InterruptDisabler disabler;
+    u64 total = 0;
+    for (auto& cpu : m_cpus) {
+        total += cpu.idle_nanoseconds;
+    }
+    return total;
+}
+
+void ProcessManager::idle_loop(void*) {
+    auto& manager = ProcessManager::the();
+    while (true) {
+        // We start with interrupts disabled, having been switched to from within schedule().
+        enable_interrupts();
+        // Nothing else wants the CPU, so top up the pool of pre-zeroed pages - unless there is nothing to top it up
+        // with, in which case there is no point trying again until woken.
+        bool refill_done =
+            mem::PageAllocator::the().refill_zeroed_pages(16) != mem::PageAllocator::RefillStatus::NotFull;
+        deferred::execute_queue();
+        disable_interrupts();
+        if (manager.has_runnable()) {
+            enable_interrupts();
+            manager.schedule();
+        } else if (refill_done && !deferred::has_pending_work()) {
+            // Interrupts are masked, so one arriving after the check above still wakes us, and is taken once
+            // they are re-enabled at the top of the loop. Other CPUs can use the kernel in the meantime.
+            kernel_lock_release();
+            asm volatile("wfi");
+            kernel_lock_acquire();
+        } else {
+            // Give other CPUs a chance at the kernel between batches.
+            kernel_lock_release();
+            asm volatile("yield");
+            kernel_lock_acquire();
+        }
+    }
+}
 
 void ProcessManager::enter_critical() {
     // Don't want process changing halfway through!
     InterruptDisabler disabler;
-    m_current->m_preempt_counter++;
+    this_cpu().current->m_preempt_counter++;
 }
 
 void ProcessManager::exit_critical() {
     InterruptDisabler disabler;
-    m_current->m_preempt_counter--;
+    this_cpu().current->m_preempt_counter--;
 }
 bool ProcessManager::is_critical() const {
     InterruptDisabler d;
-    return m_current->m_preempt_counter;
+    return this_cpu().current->m_preempt_counter;
 }
 
 int ProcessManager::count_critical() const {
     InterruptDisabler d;
-    return m_current->m_preempt_counter;
+    return this_cpu().current->m_preempt_counter;
 }
 
 ErrorCode ProcessManager::register_process(bek::shared_ptr<Process> proc) {
@@ -294,6 +395,7 @@ ErrorCode ProcessManager::register_process(bek::shared_ptr<Process> proc) {
     exit_critical();
     if (proc_ref.m_running_state == ProcessState::Unready) {
         proc_ref.m_running_state = ProcessState::Stopped;
+        proc_ref.m_cpu           = least_loaded_cpu();
     }
     return ESUCCESS;
 }
@@ -305,40 +407,29 @@ bool ProcessManager::schedule() {
         return false;
     }
     // We are allowed to schedule
-    // Try to avoid getting scheduled back...
-    m_current->m_processor_time_counter = 0;
+    auto& cpu = this_cpu();
     Process* best_process = nullptr;
-    while (true) {
-        long max_counter = -1;
-        best_process = nullptr;
-        for (auto& process : m_processes) {
-            if (process && process->m_running_state == ProcessState::Running &&
-                process->m_processor_time_counter > max_counter) {
-                max_counter = process->m_processor_time_counter;
-                best_process = process.get();
-            }
-        }
-
-        // There is a process owed ticks
-        if (max_counter > 0) {
-            // Give it a tick
-            VERIFY(best_process);
-            break;
-        } else {
-            // We need to increment ticks of the processes:
-            for (auto& process : m_processes) {
-                if (process) {
-                    process->m_processor_time_counter++;
-                }
-            }
+    {
+        InterruptDisabler disabler;
+        // If still runnable, go to the back of the queue - behind anything else of the same priority.
+        if (cpu.current->m_running_state == ProcessState::Running && cpu.current != cpu.idle.get()) {
+            enqueue(*cpu.current);
         }
+        best_process = dequeue_next();
+        if (!best_process) best_process = cpu.idle.get();
     }
     // We have chosen the next process
     auto cur_nanoseconds = timing::nanoseconds_since_start();
-    auto last_nanoseconds = bek::exchange(m_last_nanoseconds, cur_nanoseconds);
+    auto last_nanoseconds = bek::exchange(cpu.last_nanoseconds, cur_nanoseconds);
+    if (cpu.current == cpu.idle.get()) {
+        InterruptDisabler disabler;
+        cpu.idle_nanoseconds += cur_nanoseconds - last_nanoseconds;
+    }
     auto ms_duration = (cur_nanoseconds - last_nanoseconds) / 1'000'000;
-    DBG::dbgln("Switch to: {} ({}); cycle took {}ms."_sv, best_process->name(), best_process->pid(), ms_duration);
+    DBG::dbgln("CPU {}: switch to: {} ({}); cycle took {}ms."_sv, smp::current_cpu_id(), best_process->name(),
+               best_process->pid(), ms_duration);
     switch_context(*best_process);
+    // We may be resumed on another CPU - don't use cpu from here on.
     exit_critical();
     return true;
 }
@@ -346,24 +437,139 @@ void ProcessManager::switch_context(Process& process) {
     // Exclusive critical section.
     InterruptDisabler disabler;
     VERIFY(count_critical() == 1);
-    if (&process == m_current) {
+    auto& cpu = this_cpu();
+    if (&process == cpu.current) {
         // Do nothing
         return;
     }
 
-    SavedRegisters& previous_registers = m_current->m_saved_registers;
-    m_current = &process;
-
-    if (m_current->has_userspace()) {
-        do_switch_user_address_space(m_current->m_userspace_state->address_space_manager.raw_root_ptr());
+    Process& previous = *cpu.current;
+    cpu.current       = &process;
+    process.m_cpu     = smp::current_cpu_id();
+    // The kernel lock stays with this CPU, but each process unwinds its own acquisitions.
+    previous.m_kernel_lock_depth = smp::exchange_kernel_lock_depth(process.m_kernel_lock_depth);
+
+    if (process.has_userspace()) {
+        do_switch_user_address_space(process.m_userspace_state->address_space_manager.translation_base());
+    } else if (previous.has_userspace()) {
+        // Once previous has exited, another CPU may reap it and free its tables - which this CPU must not be able
+        // to walk, even speculatively.
+        do_switch_user_address_space(TableManager::empty_translation_base());
     }
     // Perform the switch - who knows when this function will return?
-    do_context_switch(previous_registers, m_current->m_saved_registers);
+    do_context_switch(previous.m_saved_registers, process.m_saved_registers);
+}
+void ProcessManager::update_run_queue(Process& process) {
+    InterruptDisabler disabler;
+    // A running process is queued again (or not) when it is switched away from.
+    if (m_cpus[process.m_cpu].current == &process) return;
+    bool queued = process.m_run_queue_node.is_linked();
+    if (process.m_running_state == ProcessState::Running && !queued) {
+        enqueue(process);
+    } else if (process.m_running_state != ProcessState::Running && queued) {
+        dequeue(process);
+    }
+}
+void ProcessManager::enqueue(Process& process) {
+    VERIFY(process.m_priority < SCHED_PRIORITY_LEVELS);
+    if (!smp::is_online(process.m_cpu)) process.m_cpu = smp::current_cpu_id();
+    auto& cpu = m_cpus[process.m_cpu];
+    cpu.run_queues[process.m_priority].append(process);
+    cpu.runnable_priorities |= 1u << process.m_priority;
+    cpu.runnable_count++;
+    // Another CPU has to be told to switch - our own will get round to it.
+    if (process.m_cpu != smp::current_cpu_id() &&
+        (cpu.current == cpu.idle.get() || cpu.current->m_priority > process.m_priority)) {
+        smp::request_reschedule(process.m_cpu);
+    }
+    // Only a process waiting behind another needs the tick - not one about to be picked by an idle CPU, nor the
+    // current process going to the back of its own queue in schedule().
+    bool waiting = cpu.current && cpu.current != cpu.idle.get() && cpu.current != &process;
+    if (waiting && !m_preempt_timer.is_armed()) m_preempt_timer.arm(preempt_quantum());
+}
+void ProcessManager::dequeue(Process& process) {
+    auto& cpu   = m_cpus[process.m_cpu];
+    auto& queue = cpu.run_queues[process.m_priority];
+    queue.remove(process);
+    cpu.runnable_count--;
+    if (queue.empty()) cpu.runnable_priorities &= ~(1u << process.m_priority);
+}
+Process* ProcessManager::dequeue_from(CpuState& cpu) {
+    if (!cpu.runnable_priorities) return nullptr;
+    auto priority = __builtin_ctz(cpu.runnable_priorities);
+    auto& queue   = cpu.run_queues[priority];
+    auto& process = queue.pop_front();
+    cpu.runnable_count--;
+    if (queue.empty()) cpu.runnable_priorities &= ~(1u << priority);
+    return &process;
+}
+Process* ProcessManager::dequeue_next() {
+    if (auto* process = dequeue_from(this_cpu())) return process;
+    // Nothing of our own to run, so take some work from the busiest CPU.
+    CpuState* busiest = nullptr;
+    for (auto& cpu : m_cpus) {
+        if (cpu.runnable_count && (!busiest || cpu.runnable_count > busiest->runnable_count)) busiest = &cpu;
+    }
+    if (!busiest) return nullptr;
+    auto* process  = dequeue_from(*busiest);
+    process->m_cpu = smp::current_cpu_id();
+    return process;
+}
+bool ProcessManager::has_runnable() const {
+    for (auto& cpu : m_cpus) {
+        if (cpu.runnable_count) return true;
+    }
+    return false;
+}
+u64 ProcessManager::preempt_quantum() const {
+    u32 contenders = 0;
+    for (u32 i = 0; i < smp::MAX_CPUS; i++) {
+        if (!smp::is_online(i)) continue;
+        auto& cpu = m_cpus[i];
+        contenders += cpu.runnable_count + (cpu.current && cpu.current != cpu.idle.get() ? 1 : 0);
+    }
+    auto quantum = SCHED_LATENCY_NS * smp::online_count() / bek::max(contenders, 1u);
+    return bek::min(bek::max(quantum, MIN_QUANTUM_NS), MAX_QUANTUM_NS);
+}
+TimerDevice::CallbackAction ProcessManager::on_preempt_tick() {
+    // Whatever is running can carry on until something else wants its CPU.
+    if (!has_runnable()) return TimerDevice::CallbackAction::Cancel;
+    // Only this CPU takes timer interrupts, so it hands out time slices to the others - but only those with a
+    // process waiting.
+    for (u32 i = 0; i < smp::MAX_CPUS; i++) {
+        if (!m_cpus[i].runnable_count) continue;
+        if (i == smp::current_cpu_id()) {
+            deferred::queue_work(m_schedule_work, deferred::Priority::High);
+        } else {
+            smp::request_reschedule(i);
+        }
+    }
+    return TimerDevice::CallbackAction::Reschedule(static_cast<long>(preempt_quantum()));
+}
+u32 ProcessManager::least_loaded_cpu() const {
+    u32 best      = smp::current_cpu_id();
+    u32 best_load = ~0u;
+    for (u32 i = 0; i < smp::MAX_CPUS; i++) {
+        if (!smp::is_online(i)) continue;
+        auto& cpu = m_cpus[i];
+        u32 load  = cpu.runnable_count + (cpu.current && cpu.current != cpu.idle.get() ? 1 : 0);
+        if (load < best_load) {
+            best      = i;
+            best_load = load;
+        }
+    }
+    return best;
 }
 ErrorCode ProcessManager::reap_process(Process& proc) {
     VERIFY(m_processes[proc.pid()].get() == &proc);
     VERIFY(proc.m_children.size() == 0);
     VERIFY(proc.ref_count() == 1);
+    // Threads that were never joined go with the process.
+    for (auto* thread : proc.m_threads) {
+        VERIFY(thread->m_running_state == ProcessState::AwaitingDeath);
+        reap_process(*thread);
+    }
+    proc.m_threads = {};
     m_processes[proc.pid()] = nullptr;
     return ESUCCESS;
 }
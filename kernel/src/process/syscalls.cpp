@@ -23,8 +23,10 @@
 #include "arch/process_entry.h"
 #include "interrupts/int_ctrl.h"
 #include "library/debug.h"
+#include "mm/kmalloc.h"
 #include "mm/page_allocator.h"
 #include "peripherals/timer.h"
+#include "process/futex.h"
 #include "process/pipe.h"
 #include "process/process.h"
 
@@ -61,13 +63,14 @@ expected<long> handle_syscall(u64 syscall_no, u64 arg1, u64 arg2, u64 arg3, u64
             return current_process.sys_allocate(arg1, arg2, static_cast<sc::AllocateFlags>(arg3));
         case sc::SysCall::Deallocate:
             return current_process.sys_deallocate(arg1, arg2);
+        case sc::SysCall::Discard:
+            return current_process.sys_discard(arg1, arg2);
         case sc::SysCall::GetPid:
             return current_process.sys_get_pid();
         case sc::SysCall::Fork:
             return current_process.sys_fork(ctx);
         case sc::SysCall::Sleep:
-            timing::spindelay_us(arg1);
-            return 0;
+            return current_process.sys_sleep(arg1, static_cast<sc::SleepFlags>(arg2));
         case sc::SysCall::Exec:
             return current_process.sys_execute(arg1, arg2, arg3, arg4, arg5, arg6);
         case sc::SysCall::CreatePipe:
@@ -79,9 +82,17 @@ expected<long> handle_syscall(u64 syscall_no, u64 arg1, u64 arg2, u64 arg3, u64
         case sc::SysCall::ChangeWorkingDirectory:
             return current_process.sys_chdir(arg1, arg2);
         case sc::SysCall::Exit:
+            current_process.exit_process(arg1);
+            ASSERT_UNREACHABLE();
+            break;
+        case sc::SysCall::CreateThread:
+            return current_process.sys_create_thread(arg1, arg2, arg3);
+        case sc::SysCall::ExitThread:
             current_process.quit_process(arg1);
             ASSERT_UNREACHABLE();
             break;
+        case sc::SysCall::JoinThread:
+            return current_process.sys_join_thread(arg1, arg2);
         case sc::SysCall::InterlinkAdvertise:
             return current_process.sys_interlink_advertise(arg1, arg2, arg3);
         case sc::SysCall::InterlinkConnect:
@@ -92,8 +103,16 @@ expected<long> handle_syscall(u64 syscall_no, u64 arg1, u64 arg2, u64 arg3, u64
             return current_process.sys_interlink_send(arg1, arg2, arg3);
         case sc::SysCall::InterlinkReceive:
             return current_process.sys_interlink_receive(arg1, arg2, arg3, 0);
+        case sc::SysCall::FutexWait:
+            return current_process.sys_futex_wait(arg1, arg2, arg3);
+        case sc::SysCall::FutexWake:
+            return current_process.sys_futex_wake(arg1, arg2);
         case sc::SysCall::GetTicks:
             return static_cast<long>(timing::nanoseconds_since_start());
+        case sc::SysCall::GetIdleTicks:
+            return static_cast<long>(ProcessManager::the().idle_nanoseconds());
+        case sc::SysCall::GetKernelHeapStats:
+            return current_process.sys_get_kernel_heap_stats(arg1);
         default:
             return ENOTSUP;
     }
@@ -281,7 +300,14 @@ expected<long> Process::sys_stat(int entity_handle, uPtr path_str, uSize path_le
 
     return (long)0;
 }
-expected<long> Process::sys_get_pid() { return m_pid; }
+expected<long> Process::sys_get_pid() { return thread_leader().pid(); }
+expected<long> Process::sys_get_kernel_heap_stats(uPtr stats_struct) {
+    auto stats_region = EXPECTED_TRY(create_user_buffer(stats_struct, sizeof(sc::KernelHeapStats), true));
+    sc::KernelHeapStats stats{};
+    mem::get_kmalloc_stats(stats);
+    EXPECTED_TRY(stats_region.write_object(stats, 0));
+    return (long)0;
+}
 expected<long> Process::sys_allocate(uPtr address, uSize size, sc::AllocateFlags flags) {
     // TODO: This is ridiculously low.
     DBG::infoln("Process {} ({}) trying to allocate {} bytes."_sv, name(), pid(), size);
@@ -296,11 +322,12 @@ expected<long> Process::sys_allocate(uPtr address, uSize size, sc::AllocateFlags
 
     bek::optional<uPtr> hint{};
     if (address != sc::INVALID_ADDRESS_VAL) {
-        if ((address & PAGE_SIZE) != 0) return EINVAL;
+        if ((address % PAGE_SIZE) != 0) return EINVAL;
         hint = address;
     }
 
-    auto space = EXPECTED_TRY(mem::UserOwnedAllocation::create_contiguous(size / PAGE_SIZE));
+    // Pages are only allocated (and zeroed) once touched.
+    auto space = EXPECTED_TRY(mem::UserOwnedAllocation::create_lazy(size / PAGE_SIZE));
 
     auto x = EXPECTED_TRY(m_userspace_state->address_space_manager.place_region(
         hint, MemoryOperation::Read | MemoryOperation::Write, bek::string{"Allocate"}, bek::move(space)));
@@ -318,6 +345,15 @@ expected<long> Process::sys_deallocate(uPtr address, uSize size) {
         return e;
     }
 }
+expected<long> Process::sys_discard(uPtr address, uSize size) {
+    DBG::infoln("Process {} ({}) discarding {} bytes at {}."_sv, name(), pid(), size, address);
+    auto e = m_userspace_state->address_space_manager.discard_userspace_region(address, size);
+    if (e == ESUCCESS) {
+        return 0;
+    } else {
+        return e;
+    }
+}
 
 expected<long> Process::sys_list_devices(uPtr buffer, uSize len, u64 protocol_filter) {
     bek::optional<DeviceProtocol> proto_filter =
@@ -416,17 +452,17 @@ expected<long> Process::sys_message_device(int entity_handle, u64 id, uPtr buffe
 expected<long> Process::sys_fork(InterruptContext& ctx) {
     auto kernel_stack = mem::PageAllocator::the().allocate_region(m_kernel_stack.size / PAGE_SIZE);
     if (!kernel_stack) return ENOMEM;
-    auto proc = bek::adopt_shared(new Process(m_name, this, *kernel_stack));
+    // Children belong to the process as a whole, rather than the thread that forked.
+    auto& parent = thread_leader();
+    auto proc    = bek::adopt_shared(new Process(m_name, &parent, *kernel_stack));
     if (!proc) {
         mem::PageAllocator::the().free_region(kernel_stack->start);
         return ENOMEM;
     }
-    proc->m_userspace_state = UserspaceState{
-        .user_stack_top = m_userspace_state->user_stack_top,
-        .cwd = m_userspace_state->cwd,
-        .address_space_manager = EXPECTED_TRY(m_userspace_state->address_space_manager.clone_for_fork()),
-        .open_entities = m_userspace_state->open_entities,
-    };
+    proc->m_userspace_state = bek::adopt_shared(
+        new UserspaceState{m_userspace_state->user_stack_top, m_userspace_state->cwd,
+                           EXPECTED_TRY(m_userspace_state->address_space_manager.clone_for_fork()),
+                           m_userspace_state->open_entities});
 
     auto current_user_stack = do_get_current_user_stack();
 
@@ -436,15 +472,74 @@ expected<long> Process::sys_fork(InterruptContext& ctx) {
     if (auto r = ProcessManager::the().register_process(proc); r != ESUCCESS) {
         return r;
     }
-    m_children.push_back(proc.get());
+    parent.m_children.push_back(proc.get());
     DBG::infoln("Forking process {}: forked address space:"_sv, proc->name());
     proc->m_userspace_state->address_space_manager.debug_print();
     proc->set_state(ProcessState::Running);
     return proc->pid();
 }
 
+expected<long> Process::sys_create_thread(uPtr entry, u64 argument, uPtr user_stack) {
+    // FIXME: Stack pointer alignment should be arch-dependent constant.
+    if (user_stack % 16) return EINVAL;
+    if (!m_userspace_state->address_space_manager.check_region(user_stack - 16, 16, MemoryOperation::Write)) {
+        return EFAULT;
+    }
+    auto kernel_stack = mem::PageAllocator::the().allocate_region(m_kernel_stack.size / PAGE_SIZE);
+    if (!kernel_stack) return ENOMEM;
+    auto thread = bek::adopt_shared(new Process(m_name, nullptr, *kernel_stack));
+    if (!thread) {
+        mem::PageAllocator::the().free_region(kernel_stack->start);
+        return ENOMEM;
+    }
+    auto& leader               = thread_leader();
+    thread->m_thread_leader    = &leader;
+    thread->m_userspace_state  = m_userspace_state;
+    thread->m_priority         = m_priority;
+    thread->m_saved_registers  = SavedRegisters::create_for_user_thread(entry, argument,
+                                                                       thread->m_kernel_stack.end().ptr, user_stack);
+
+    if (auto r = ProcessManager::the().register_process(thread); r != ESUCCESS) {
+        return r;
+    }
+    leader.m_threads.push_back(thread.get());
+    thread->set_state(ProcessState::Running);
+    return thread->pid();
+}
+
+expected<long> Process::sys_join_thread(long thread_id, uPtr status_ptr) {
+    bek::optional<UserBuffer> status_buffer =
+        status_ptr ? bek::optional{EXPECTED_TRY(create_user_buffer(status_ptr, sizeof(int), true))} : bek::nullopt;
+    if (thread_id == m_pid) return EINVAL;
+    auto& leader     = thread_leader();
+    auto find_thread = [&leader, thread_id]() -> Process* {
+        for (auto* thread : leader.m_threads) {
+            if (thread->pid() == thread_id) return thread;
+        }
+        return nullptr;
+    };
+    // Someone else may join it first, so look it up afresh each time.
+    bool finished = leader.m_thread_waiters.wait_until([&find_thread] {
+        auto* thread = find_thread();
+        return !thread || thread->m_running_state == ProcessState::AwaitingDeath;
+    });
+    if (!finished) return EINTR;
+    auto* thread = find_thread();
+    if (!thread) return ECHILD;
+
+    if (status_buffer) {
+        auto exit_code = thread->m_exit_code ? *thread->m_exit_code : -1;
+        status_buffer->write_from(&exit_code, sizeof(exit_code), 0);
+    }
+    leader.m_threads.extract(thread);
+    ProcessManager::the().reap_process(*thread);
+    return thread_id;
+}
+
 expected<long> Process::sys_execute(uPtr executable_path, uSize path_len, uPtr args_array, uSize args_n, uPtr env_array,
                                     uSize env_n) {
+    // The other threads would be left running in the old address space.
+    if (m_thread_leader || m_threads.size() > 0) return EPERM;
     {
         using namespace fs;
         // Caution - path needs stable reference to path string.
@@ -493,7 +588,7 @@ expected<long> Process::sys_execute(uPtr executable_path, uSize path_len, uPtr a
     // (b) SavedRegisters has been set and is volatile.
     // (c) The current kernel stack *must* contain no RAII elements, or resources to be freed.
 
-    do_switch_user_address_space(m_userspace_state->address_space_manager.raw_root_ptr());
+    do_switch_user_address_space(m_userspace_state->address_space_manager.translation_base());
 
     // (i) Disable interrupts
     disable_interrupts();
@@ -540,37 +635,50 @@ expected<long> Process::sys_duplicate(long handle_slot, long new_handle_slot, u8
 expected<long> Process::sys_wait(long pid, uPtr status_ptr, u64 flags) {
     bek::optional<UserBuffer> status_buffer =
         status_ptr ? bek::optional{EXPECTED_TRY(create_user_buffer(status_ptr, sizeof(int), true))} : bek::nullopt;
+    // Any thread can wait for the process's children.
+    auto& parent = thread_leader();
     if (pid > 0) {
-        for (auto child : m_children) {
-            if (child->pid() == pid) {
-                while (child->m_running_state != ProcessState::AwaitingDeath) {
-                    // Bloop
-                }
-
-                if (status_buffer) {
-                    auto exit_code = child->m_exit_code ? *child->m_exit_code : -1;
-                    status_buffer->write_from(&exit_code, sizeof(exit_code), 0);
-                }
-                for (auto& current_child : m_children) {
-                    if (current_child->pid() == pid) {
-                        m_children.extract(current_child);
-                    }
-                }
-                ProcessManager::the().reap_process(*child);
-                return pid;
+        auto find_child = [&parent, pid]() -> Process* {
+            for (auto child : parent.m_children) {
+                if (child->pid() == pid) return child;
             }
+            return nullptr;
+        };
+        if (!find_child()) return ECHILD;
+        // Another thread may reap it first, so look it up afresh each time.
+        bool finished = parent.m_child_waiters.wait_until([&find_child] {
+            auto* child = find_child();
+            return !child || child->has_exited();
+        });
+        if (!finished) return EINTR;
+        auto* child = find_child();
+        if (!child) return ECHILD;
+
+        if (status_buffer) {
+            auto exit_code = child->m_exit_code ? *child->m_exit_code : -1;
+            status_buffer->write_from(&exit_code, sizeof(exit_code), 0);
         }
-        return ECHILD;
+        parent.m_children.extract(child);
+        ProcessManager::the().reap_process(*child);
+        return pid;
     } else if (pid == -1) {
-        while (m_children.size() > 0) {
-            for (auto& child : m_children) {
-                if (child->m_running_state == ProcessState::AwaitingDeath) {
+        while (parent.m_children.size() > 0) {
+            bool finished = parent.m_child_waiters.wait_until([&parent] {
+                if (parent.m_children.size() == 0) return true;
+                for (auto child : parent.m_children) {
+                    if (child->has_exited()) return true;
+                }
+                return false;
+            });
+            if (!finished) return EINTR;
+            for (auto& child : parent.m_children) {
+                if (child->has_exited()) {
                     if (status_buffer) {
                         auto exit_code = child->m_exit_code ? *child->m_exit_code : -1;
                         status_buffer->write_from(&exit_code, sizeof(exit_code), 0);
                     }
                     auto child_pid = child->pid();
-                    m_children.extract(child);
+                    parent.m_children.extract(child);
                     ProcessManager::the().reap_process(*child);
                     return child_pid;
                 }
@@ -581,6 +689,47 @@ expected<long> Process::sys_wait(long pid, uPtr status_ptr, u64 flags) {
         return EINVAL;
     }
 }
+expected<long> Process::sys_sleep(u64 nanoseconds, sc::SleepFlags flags) {
+    if (flags == sc::SleepFlags::Absolute) {
+        auto now = timing::nanoseconds_since_start();
+        if (nanoseconds <= now) return 0;
+        nanoseconds -= now;
+    } else if (flags != sc::SleepFlags::None) {
+        return EINVAL;
+    }
+    if (nanoseconds == 0) return 0;
+    if (nanoseconds > static_cast<u64>(__LONG_MAX__)) return EINVAL;
+
+    // The timer is cancelled if we leave early, so all of this can live on our stack.
+    WaitQueue sleeper;
+    volatile bool expired = false;
+    timing::Timer timer{[&sleeper, &expired](u64) {
+        expired = true;
+        sleeper.wake_one();
+        return TimerDevice::CallbackAction::Cancel;
+    }};
+    timer.arm(nanoseconds);
+    if (!sleeper.wait_until([&expired] { return expired; })) return EINTR;
+    return 0;
+}
+expected<long> Process::sys_futex_wait(uPtr address, u32 expected_value, u64 timeout_ns) {
+    if (address % alignof(u32)) return EINVAL;
+    if (timeout_ns > static_cast<u64>(__LONG_MAX__)) return EINVAL;
+    auto buffer   = EXPECTED_TRY(create_user_buffer(address, sizeof(u32), false));
+    auto physical = EXPECTED_TRY(with_space_manager(
+        [address](SpaceManager& manager) { return manager.resolve_physical(address); }));
+    // Nothing can wake the address between reading it and queueing, as both happen under the kernel lock.
+    auto value = EXPECTED_TRY(buffer.read_object<u32>());
+    if (value != expected_value) return EAGAIN;
+    if (auto r = futex::wait(physical, timeout_ns); r != ESUCCESS) return r;
+    return 0;
+}
+expected<long> Process::sys_futex_wake(uPtr address, u32 count) {
+    if (address % alignof(u32)) return EINVAL;
+    auto physical = EXPECTED_TRY(with_space_manager(
+        [address](SpaceManager& manager) { return manager.resolve_physical(address); }));
+    return futex::wake(physical, count);
+}
 expected<long> Process::sys_chdir(uPtr path_str, uSize path_len) {
     auto path_string = EXPECTED_TRY(read_string_from_user(path_str, path_len));
     auto the_path = EXPECTED_TRY(fs::path::parse_path(path_string));
@@ -612,11 +761,7 @@ expected<long> Process::sys_interlink_accept(long interlink_ed, u8 group, bool b
         return ENOTSUP;
     }
     auto& server = static_cast<interlink::ServerHandle&>(*handle).server();
-    auto accept_result = server.accept();
-    while (blocking && accept_result.has_error() && accept_result.error() == EAGAIN) {
-        accept_result = server.accept();
-    }
-    auto conn = EXPECTED_TRY(bek::move(accept_result));
+    auto conn = EXPECTED_TRY(server.accept(blocking));
     return allocate_entity_handle_slot(
         bek::adopt_shared(new interlink::ConnectionHandle(conn, interlink::ConnectionHandle::SERVER)), group);
 }
@@ -0,0 +1,75 @@
+/*
+ * bekOS is a basic OS for the Raspberry Pi
+ * Copyright (C) 2025 Bekos Contributors
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "process/wait_queue.h"
+
+#include "process/process.h"
+
+bool WaitQueue::current_must_exit() { return ProcessManager::the().current_process().exit_requested(); }
+
+void WaitQueue::enqueue_current(Waiter& waiter) {
+    waiter.process = &ProcessManager::the().current_process();
+    m_waiters.append(waiter);
+    waiter.process->m_blocked_on = this;
+    waiter.process->set_state(ProcessState::Waiting);
+}
+
+void WaitQueue::sleep(Waiter& waiter) {
+    // If woken before we switch away, we are simply scheduled again.
+    ProcessManager::the().schedule();
+
+    InterruptDisabler disabler;
+    if (waiter.node.is_linked()) {
+        // Not woken - the switch couldn't happen (e.g. in a critical section). Wait again by polling.
+        m_waiters.remove(waiter);
+        waiter.process->m_blocked_on = nullptr;
+        waiter.process->set_state(ProcessState::Running);
+    }
+}
+
+bool WaitQueue::wake_one() {
+    InterruptDisabler disabler;
+    if (m_waiters.empty()) return false;
+    auto* process         = m_waiters.pop_front().process;
+    process->m_blocked_on = nullptr;
+    process->set_state(ProcessState::Running);
+    return true;
+}
+
+void WaitQueue::wake_all() {
+    InterruptDisabler disabler;
+    while (!m_waiters.empty()) {
+        auto* process         = m_waiters.pop_front().process;
+        process->m_blocked_on = nullptr;
+        process->set_state(ProcessState::Running);
+    }
+}
+
+void WaitQueue::interrupt(Process& process) {
+    InterruptDisabler disabler;
+    auto* queue = process.m_blocked_on;
+    if (!queue) return;
+    for (auto& waiter : queue->m_waiters) {
+        if (waiter.process == &process) {
+            queue->m_waiters.remove(waiter);
+            break;
+        }
+    }
+    process.m_blocked_on = nullptr;
+    process.set_state(ProcessState::Running);
+}
@@ -97,6 +97,8 @@ expected<long> close(int entity_handle);
 expected<long> get_directory_entries(int entity_handle, uSize offset, void* buffer, uSize len);
 expected<uPtr> allocate(uPtr address_hint, uSize size, sc::AllocateFlags flags);
 expected<uPtr> deallocate(uPtr address, uSize size);
+/// Drops the contents of allocated memory, returning its pages to the kernel. It stays allocated, and reads as zero.
+ErrorCode discard(uPtr address, uSize size);
 
 expected<long> open_device(bek::str_view path);
 
@@ -109,6 +111,24 @@ expected<int> get_pid();
 
 expected<long> fork();
 
+using ThreadEntry = int (*)(void*);
+/// Runs entry(argument) in a new thread, sharing this process's memory and handles. stack_top is the end of a
+/// stack the caller has allocated for it, which must stay allocated until the thread is joined. The thread ends
+/// when entry returns, with the result as its exit code.
+/// \return the thread's id, for join_thread.
+expected<long> create_thread(ThreadEntry entry, void* argument, void* stack_top);
+[[noreturn]] void exit_thread(int code);
+/// Waits for a thread to end, and releases it.
+expected<long> join_thread(long thread_id, int& status);
+
+/// Sleeps until futex_wake is called on address, as long as *address still equals expected_value when checked. Works
+/// between processes sharing the memory, at whichever address each has it mapped.
+/// \return EAGAIN if *address had changed, or ETIMEDOUT after timeout_ns, unless that is 0.
+ErrorCode futex_wait(const u32* address, u32 expected_value, u64 timeout_ns = 0);
+/// Wakes up to count threads sleeping in futex_wait on address.
+/// \return the number woken.
+expected<long> futex_wake(const u32* address, u32 count);
+
 core::expected<long> exec(bek::str_view path, bek::span<bek::str_view> arguments, bek::span<bek::str_view> environ);
 
 expected<sc::CreatePipeHandles> create_pipe(sc::CreatePipeHandleFlags flags);
@@ -116,7 +136,15 @@ expected<sc::CreatePipeHandles> create_pipe(sc::CreatePipeHandleFlags flags);
 expected<long> duplicate(long old_slot, long new_slot, u8 group);
 
 void sleep(uSize microseconds);
+void sleep_ns(u64 nanoseconds);
+/// Sleeps until get_ticks() reaches deadline_ns, for pacing periodic work without accumulating drift.
+void sleep_until(u64 deadline_ns);
 u64 get_ticks();
+/// Nanoseconds the kernel has spent idle, on the same clock as get_ticks().
+u64 get_idle_ticks();
+
+/// Syscall: Reads the kernel heap's usage counters.
+ErrorCode get_kernel_heap_stats(sc::KernelHeapStats& stats);
 
 expected<long> wait(long pid, int& status);
 
@@ -27,6 +27,8 @@ constexpr bool is_power_of_two(uSize n) { return n != 0 && (n & (n - 1ul)) == 0;
 struct BlockHeader {
     BlockHeader* next;
     uSize size;
+    /// Whether the whole pages of this (free) block have been discarded since it was last written.
+    bool discarded{false};
 
     void* data() { return (reinterpret_cast<char*>(this) + sizeof(BlockHeader)); }
 
@@ -36,7 +38,8 @@ struct BlockHeader {
         VERIFY(can_be_split(target_size));
         auto second_size = data_size() - target_size;
         size = sizeof(BlockHeader) + target_size;
-        next = new (end()) BlockHeader(next, second_size);
+        // The second block's pages are a subset of ours.
+        next = new (end()) BlockHeader(next, second_size, discarded);
     }
 
     constexpr bool can_be_split(uSize target_size) {
@@ -58,9 +61,52 @@ constexpr inline uSize PAGE_SIZE = 4096;
 constexpr inline uSize SIZE_FOR_SEPARATE_LARGE_BLOCK = PAGE_SIZE;
 constexpr inline uSize DEFAULT_LARGE_BLOCK_SIZE = PAGE_SIZE * 16;
 
+/// Futex-based mutex for the heap, which all threads of a process share.
+class HeapLock {
+public:
+    void lock() {
+        u32 state = UNLOCKED;
+        if (__atomic_compare_exchange_n(&m_state, &state, LOCKED, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) return;
+        // Contended - mark that there are waiters, so whoever holds it wakes one of us.
+        if (state != CONTENDED) state = __atomic_exchange_n(&m_state, CONTENDED, __ATOMIC_ACQUIRE);
+        while (state != UNLOCKED) {
+            core::syscall::futex_wait(&m_state, CONTENDED);
+            state = __atomic_exchange_n(&m_state, CONTENDED, __ATOMIC_ACQUIRE);
+        }
+    }
+
+    void unlock() {
+        if (__atomic_exchange_n(&m_state, UNLOCKED, __ATOMIC_RELEASE) == CONTENDED) {
+            (void)core::syscall::futex_wake(&m_state, 1);
+        }
+    }
+
+private:
+    static constexpr u32 UNLOCKED  = 0;
+    static constexpr u32 LOCKED    = 1;
+    static constexpr u32 CONTENDED = 2;
+    u32 m_state{UNLOCKED};
+};
+
+HeapLock g_heap_lock;
+
+struct HeapLocker {
+    HeapLocker() { g_heap_lock.lock(); }
+    ~HeapLocker() { g_heap_lock.unlock(); }
+    HeapLocker(const HeapLocker&)            = delete;
+    HeapLocker& operator=(const HeapLocker&) = delete;
+};
+
+// The following are all guarded by g_heap_lock.
 HugeBlockHeader* g_huge_block_head = nullptr;
 BlockHeader* g_free_blocks = nullptr;
 
+// Free blocks with at least this many whole pages give them back to the kernel...
+constexpr inline uSize MIN_DISCARD_SIZE = PAGE_SIZE * 4;
+// ...checked each time this much has been freed.
+constexpr inline uSize DISCARD_INTERVAL = PAGE_SIZE * 64;
+uSize g_freed_since_discard = 0;
+
 // Debug Checks
 void* g_heap_start = nullptr;
 void* g_heap_end = nullptr;
@@ -74,7 +120,8 @@ void update_heap_range_tracker(void* retptr) {
     }
 }
 
-// We will not free any (standard-ly allocated) blocks to the kernel -> one unified free list.
+// We will not free any (standard-ly allocated) blocks to the kernel -> one unified free list. The pages of large
+// free blocks are discarded though, so they cost no memory until reused.
 /// Inserts a block into the list, maintaining sort order.
 /// \param block Block to insert. Must not already be in list.
 /// \return the precursor block; nullptr if new block is at front.
@@ -104,6 +151,7 @@ mem::AllocatedRegion mem::allocate(uSize size, uSize align) {
         return {nullptr, 0};
     }
     VERIFY(align <= PAGE_SIZE);
+    HeapLocker locker;
 
     // all structs are 8-byte-aligned - so make all regions thus also.
     size = bek::align_up(size, 8ul);
@@ -144,7 +192,9 @@ mem::AllocatedRegion mem::allocate(uSize size, uSize align) {
             auto res =
                 core::syscall::allocate(sc::INVALID_ADDRESS_VAL, DEFAULT_LARGE_BLOCK_SIZE, sc::AllocateFlags::None);
             if (res.has_error()) return {nullptr, 0};
-            best_block = new (reinterpret_cast<void*>(res.value())) BlockHeader(nullptr, DEFAULT_LARGE_BLOCK_SIZE);
+            // Allocated memory is populated on first touch, so the pages start out as good as discarded.
+            best_block =
+                new (reinterpret_cast<void*>(res.value())) BlockHeader(nullptr, DEFAULT_LARGE_BLOCK_SIZE, true);
             best_block_prev = insert_block(best_block);
         }
 
@@ -186,15 +236,30 @@ bool try_free_huge(void* ptr) {
     return false;
 }
 
+/// Discards the whole pages within large free blocks. Block headers come before their pages, so are kept.
+void discard_free_pages() {
+    for (auto* block = g_free_blocks; block; block = block->next) {
+        if (block->discarded) continue;
+        auto start = bek::align_up(reinterpret_cast<uPtr>(block->data()), PAGE_SIZE);
+        auto end = bek::align_down(reinterpret_cast<uPtr>(block->end()), PAGE_SIZE);
+        if (end > start && end - start >= MIN_DISCARD_SIZE) {
+            block->discarded = core::syscall::discard(start, end - start) == ESUCCESS;
+        }
+    }
+}
+
 void free_small(void* ptr) {
     // Not a huge block.
     auto* header = reinterpret_cast<BlockHeader*>(reinterpret_cast<u8*>(ptr) - sizeof(BlockHeader));
     // Small sanity check.
     VERIFY(8 <= header->data_size() && header->data_size() < SIZE_FOR_SEPARATE_LARGE_BLOCK);
 
+    g_freed_since_discard += header->size;
+    header->discarded = false;
+
     // Insert it into list.
     BlockHeader* previous = insert_block(header);
-    // Now, coallesce if possible.
+    // Now, coallesce if possible. The merged block has pages in use until now, so is no longer discarded.
     if (header->next == header->end()) {
         header->size = header->size + header->next->size;
         header->next = header->next->next;
@@ -203,11 +268,18 @@ void free_small(void* ptr) {
     if (previous && header == previous->end()) {
         previous->size = previous->size + header->size;
         previous->next = header->next;
+        previous->discarded = false;
+    }
+
+    if (g_freed_since_discard >= DISCARD_INTERVAL) {
+        g_freed_since_discard = 0;
+        discard_free_pages();
     }
 }
 
 void free(void* ptr) {
     if (ptr == nullptr) return;
+    HeapLocker locker;
 
     VERIFY(g_heap_start <= ptr && ptr <= g_heap_end);
 
@@ -217,6 +289,7 @@ void free(void* ptr) {
 
 uSize get_size_of_allocation(void* ptr) {
     if (ptr == nullptr) return 0;
+    HeapLocker locker;
     VERIFY(g_heap_start <= ptr && ptr <= g_heap_end);
     // Try huge block
     {
@@ -237,6 +310,21 @@ uSize get_size_of_allocation(void* ptr) {
     return header->data_size();
 }
 
+/// If ptr is a huge block, hands its pages beyond size back to the kernel.
+void try_shrink_huge(void* ptr, uSize size) {
+    HeapLocker locker;
+    for (auto* hb = g_huge_block_head; hb; hb = hb->next) {
+        if (ptr == hb->data()) {
+            uSize hb_size = bek::align_up(size + sizeof(HugeBlockHeader), PAGE_SIZE);
+            if (hb_size < hb->size &&
+                !core::syscall::deallocate(reinterpret_cast<uPtr>(hb) + hb_size, hb->size - hb_size).has_error()) {
+                hb->size = hb_size;
+            }
+            return;
+        }
+    }
+}
+
 void* realloc(void* ptr, uSize size) {
     if (ptr == nullptr) return mem::allocate(size).pointer;
     if (auto data_size = get_size_of_allocation(ptr); size > data_size) {
@@ -247,6 +335,7 @@ void* realloc(void* ptr, uSize size) {
         free(ptr);
         return new_alloc.pointer;
     } else {
+        try_shrink_huge(ptr, size);
         return ptr;
     }
 }
@@ -77,6 +77,9 @@ core::expected<uPtr> core::syscall::allocate(uPtr address, uSize size, sc::Alloc
 core::expected<uPtr> core::syscall::deallocate(uPtr address, uSize size) {
     return syscall_to_result<uPtr>(sc::SysCall::Deallocate, address, size);
 }
+ErrorCode core::syscall::discard(uPtr address, uSize size) {
+    return syscall_to_error_code(sc::SysCall::Discard, address, size);
+}
 core::expected<int> core::syscall::get_pid() { return syscall_to_result<int>(sc::SysCall::GetPid); }
 core::expected<long> core::syscall::open_device(bek::str_view path) {
     return syscall_to_result<long>(sc::SysCall::OpenDevice, path.data(), path.size());
@@ -95,8 +98,48 @@ core::expected<long> core::syscall::message(long entity_handle, u64 id, void* bu
     return syscall_to_result<long>(sc::SysCall::CommandDevice, entity_handle, id, buffer, length);
 }
 core::expected<long> core::syscall::fork() { return syscall_to_result<long>(sc::SysCall::Fork); }
-void core::syscall::sleep(uSize microseconds) { syscall(sc::SysCall::Sleep, microseconds); }
+
+namespace {
+struct ThreadStart {
+    core::syscall::ThreadEntry entry;
+    void* argument;
+};
+
+[[noreturn]] void thread_trampoline(void* start_ptr) {
+    auto start = *static_cast<ThreadStart*>(start_ptr);
+    core::syscall::exit_thread(start.entry(start.argument));
+}
+}  // namespace
+
+core::expected<long> core::syscall::create_thread(ThreadEntry entry, void* argument, void* stack_top) {
+    // The entry point rides at the top of the new stack, so nothing needs freeing if the thread never starts.
+    auto stack = (reinterpret_cast<uPtr>(stack_top) - sizeof(ThreadStart)) & ~uPtr{15};
+    *reinterpret_cast<ThreadStart*>(stack) = {entry, argument};
+    return syscall_to_result<long>(sc::SysCall::CreateThread, &thread_trampoline, stack, stack);
+}
+void core::syscall::exit_thread(int code) {
+    syscall(sc::SysCall::ExitThread, code);
+    ASSERT_UNREACHABLE();
+}
+core::expected<long> core::syscall::join_thread(long thread_id, int& status) {
+    return syscall_to_result<long>(sc::SysCall::JoinThread, thread_id, &status);
+}
+ErrorCode core::syscall::futex_wait(const u32* address, u32 expected_value, u64 timeout_ns) {
+    return syscall_to_error_code(sc::SysCall::FutexWait, address, expected_value, timeout_ns);
+}
+core::expected<long> core::syscall::futex_wake(const u32* address, u32 count) {
+    return syscall_to_result<long>(sc::SysCall::FutexWake, address, count);
+}
+void core::syscall::sleep(uSize microseconds) { sleep_ns(microseconds * 1000); }
+void core::syscall::sleep_ns(u64 nanoseconds) { syscall(sc::SysCall::Sleep, nanoseconds, to_syscall_arg(sc::SleepFlags::None)); }
+void core::syscall::sleep_until(u64 deadline_ns) {
+    syscall(sc::SysCall::Sleep, deadline_ns, to_syscall_arg(sc::SleepFlags::Absolute));
+}
 u64 core::syscall::get_ticks() { return syscall(sc::SysCall::GetTicks); }
+u64 core::syscall::get_idle_ticks() { return syscall(sc::SysCall::GetIdleTicks); }
+ErrorCode core::syscall::get_kernel_heap_stats(sc::KernelHeapStats& stats) {
+    return syscall_to_error_code(sc::SysCall::GetKernelHeapStats, &stats);
+}
 
 core::expected<long> core::syscall::exec(bek::str_view path, bek::span<bek::str_view> arguments,
                                          bek::span<bek::str_view> environ) {
@@ -138,6 +138,21 @@ core::expected<bool> builtin_ls(bek::vector<bek::str_view>& command) {
     return false;
 }
 
+core::expected<bool> builtin_kheap(bek::vector<bek::str_view>& command) {
+    if (command.size() > 1) {
+        core::fprintln(core::stderr, "sh: warn: {} takes no arguments."_sv, command[0]);
+    }
+    sc::KernelHeapStats stats{};
+    if (auto r = core::syscall::get_kernel_heap_stats(stats); r != ESUCCESS) return r;
+    core::fprintln(core::stdout, "Kernel heap: {} of {} bytes free."_sv, stats.free_bytes, stats.total_bytes);
+    core::fprintln(core::stdout, "    max size  allocs  frees  live  peak  failures"_sv);
+    for (auto& size_class : stats.size_classes) {
+        core::fprintln(core::stdout, "    {}  {}  {}  {}  {}  {}"_sv, size_class.max_size, size_class.allocations,
+                       size_class.frees, size_class.live_bytes, size_class.peak_live_bytes, size_class.failures);
+    }
+    return false;
+}
+
 core::expected<bool> builtin_stub(bek::vector<bek::str_view>& command) {
     auto fork_result = core::syscall::fork();
     if (fork_result.has_error()) {
@@ -174,6 +189,7 @@ int main(int argc, char** argv) {
     builtin_commands.insert({"help"_sv, builtin_help});
     builtin_commands.insert({"ls"_sv, builtin_ls});
     builtin_commands.insert({"stub"_sv, builtin_stub});
+    builtin_commands.insert({"kheap"_sv, builtin_kheap});
 
     auto result = loop();
     core::fprintln(core::stdout, "Goodbye: {}."_sv, result);
@@ -285,6 +285,8 @@ core::expected<int> run() {
 
     starting_coords = 50;
     u64 last_blit = core::syscall::get_ticks();
+    // Frames are due at fixed intervals, however long each takes to render.
+    u64 next_frame = last_blit + NS_PER_FRAME;
     window::Vec last_mouse_position{};
 
     // Mainloop
@@ -311,7 +313,7 @@ core::expected<int> run() {
 
         mouse->update();
         // Next, we blit!
-        if (current_time - last_blit > NS_PER_FRAME) {
+        if (current_time >= next_frame) {
             window::Renderer renderer{ctx, ctx.render_rect()};
             auto old_mouse_rect = window::Rect{last_mouse_position, {50, 50}}.intersection(ctx.render_rect());
             renderer.paint_rect(0, old_mouse_rect);
@@ -328,7 +330,12 @@ core::expected<int> run() {
                 dbgln("Bad frame length: {}"_sv, current_time - last_blit);
             }
             last_blit = current_time;
+            next_frame += NS_PER_FRAME;
+            // If whole frames were missed, don't try to catch up on them.
+            if (next_frame <= current_time) next_frame = current_time + NS_PER_FRAME;
         }
+        // Nothing else to do until the next frame is due.
+        core::syscall::sleep_until(next_frame);
     }
     return 0;
 }